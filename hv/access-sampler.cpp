@@ -0,0 +1,251 @@
+#include "access-sampler.h"
+#include "hypercalls.h"
+
+#include <ntddk.h>
+
+namespace hv {
+
+// allocate the memory for the access sampler
+bool create_access_sampler(access_sampler& sampler) {
+  sampler.lock.initialize();
+  sampler.region_counts  = nullptr;
+  sampler.sample_regions = nullptr;
+  sampler.region_count   = 0;
+  sampler.active         = false;
+
+  auto const ranges = MmGetPhysicalMemoryRanges();
+  if (!ranges)
+    return false;
+
+  // the histogram covers everything up to the highest RAM address
+  uint64_t end = 0;
+  for (auto range = ranges; range->BaseAddress.QuadPart ||
+       range->NumberOfBytes.QuadPart; ++range) {
+    auto const range_end = static_cast<uint64_t>(
+      range->BaseAddress.QuadPart + range->NumberOfBytes.QuadPart);
+
+    if (range_end > end)
+      end = range_end;
+  }
+
+  ExFreePool(ranges);
+
+  sampler.region_count = (end + 0x1FFFFF) >> 21;
+
+  sampler.region_counts = static_cast<uint16_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sampler.region_count * sizeof(uint16_t), 'fr0g'));
+  sampler.sample_regions = static_cast<uint64_t volatile*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, (sampler.region_count + 63) / 64 * sizeof(uint64_t), 'fr0g'));
+
+  if (!sampler.region_counts || !sampler.sample_regions) {
+    destroy_access_sampler(sampler);
+    return false;
+  }
+
+  memset(sampler.hot_regions, 0, sizeof(sampler.hot_regions));
+  sampler.released_count = 0;
+
+  reset_access_sampler(sampler);
+
+  return true;
+}
+
+// free the memory that was allocated with create_access_sampler()
+void destroy_access_sampler(access_sampler& sampler) {
+  if (sampler.region_counts)
+    ExFreePoolWithTag(sampler.region_counts, 'fr0g');
+
+  if (sampler.sample_regions)
+    ExFreePoolWithTag(const_cast<uint64_t*>(sampler.sample_regions), 'fr0g');
+
+  sampler.region_counts  = nullptr;
+  sampler.sample_regions = nullptr;
+  sampler.region_count   = 0;
+}
+
+// clear the histogram. hot regions stay hot but their page counts are cleared.
+void reset_access_sampler(access_sampler& sampler) {
+  memset(sampler.region_counts, 0, sampler.region_count * sizeof(uint16_t));
+  memset(const_cast<uint64_t*>(sampler.sample_regions), 0,
+    (sampler.region_count + 63) / 64 * sizeof(uint64_t));
+
+  for (auto& hot : sampler.hot_regions) {
+    memset(hot.page_counts, 0, sizeof(hot.page_counts));
+    memset(const_cast<uint64_t*>(hot.sample_pages), 0, sizeof(hot.sample_pages));
+    hot.idle_samples = 0;
+  }
+
+  sampler.sample_count = 0;
+}
+
+// get the hot region that contains the specified physical address
+static access_sampler_hot_region* find_hot_region(
+    access_sampler& sampler, uint64_t const physical_address) {
+  for (auto& hot : sampler.hot_regions) {
+    if (hot.used && hot.physical_address == (physical_address & ~0x1FFFFFull))
+      return &hot;
+  }
+
+  return nullptr;
+}
+
+// mark a 2MB region (and optionally some of its pages) as accessed in the
+// current sample. ctx is the sampler, so that this can be passed directly
+// to collect_ept_accessed_regions(). this can be called on every vcpu at once.
+void record_accessed_region(uint64_t const physical_address,
+    uint64_t const* const pages, void* const ctx) {
+  auto& sampler = *static_cast<access_sampler*>(ctx);
+  auto const region = physical_address >> 21;
+
+  // MMIO above the highest RAM address
+  if (region >= sampler.region_count)
+    return;
+
+  _interlockedbittestandset64(reinterpret_cast<long long volatile*>(
+    &sampler.sample_regions[region / 64]), region % 64);
+
+  if (!pages)
+    return;
+
+  if (auto const hot = find_hot_region(sampler, physical_address)) {
+    for (size_t i = 0; i < 8; ++i) {
+      if (pages[i])
+        _InterlockedOr64(reinterpret_cast<long long volatile*>(&hot->sample_pages[i]), pages[i]);
+    }
+  }
+}
+
+// add the current sample to the histogram and update which regions are hot
+void finish_access_sample(access_sampler& sampler) {
+  ++sampler.sample_count;
+
+  for (auto& hot : sampler.hot_regions) {
+    if (!hot.used)
+      continue;
+
+    bool accessed = false;
+
+    for (size_t i = 0; i < 8; ++i) {
+      uint64_t const bits = hot.sample_pages[i];
+      hot.sample_pages[i] = 0;
+
+      for (size_t j = 0; j < 64; ++j) {
+        if ((bits & (1ull << j)) && hot.page_counts[i * 64 + j] < 0xFFFF)
+          ++hot.page_counts[i * 64 + j];
+      }
+
+      accessed |= (bits != 0);
+    }
+
+    hot.idle_samples = accessed ? 0 : hot.idle_samples + 1;
+
+    if (hot.idle_samples >= access_sampler_cold_samples) {
+      sampler.released[sampler.released_count++] = hot.physical_address;
+      hot.used = false;
+    }
+  }
+
+  for (size_t i = 0; i < (sampler.region_count + 63) / 64; ++i) {
+    uint64_t bits = sampler.sample_regions[i];
+    sampler.sample_regions[i] = 0;
+
+    unsigned long bit = 0;
+    while (_BitScanForward64(&bit, bits)) {
+      bits &= bits - 1;
+
+      auto& count = sampler.region_counts[i * 64 + bit];
+      if (count < 0xFFFF)
+        ++count;
+
+      if (count < access_sampler_hot_threshold)
+        continue;
+
+      auto const physical_address = (i * 64 + bit) << 21;
+      if (find_hot_region(sampler, physical_address))
+        continue;
+
+      // the first free slot goes to the region, which every vcpu will map
+      // with a PT during the next sample
+      for (auto& hot : sampler.hot_regions) {
+        if (hot.used)
+          continue;
+
+        memset(hot.page_counts, 0, sizeof(hot.page_counts));
+        hot.physical_address = physical_address;
+        hot.idle_samples     = 0;
+        hot.used             = true;
+        break;
+      }
+    }
+  }
+}
+
+// export the histogram as runs of pages with the same (non-zero) access
+// count, starting at the specified address. returns the number of runs that
+// were written, and updates the address to where the next call should
+// continue (or 0 if the end of the histogram was reached).
+size_t get_access_runs(access_sampler& sampler,
+    uint64_t& physical_address, ept_access_run* const runs, size_t const max_count) {
+  auto const end = static_cast<uint64_t>(sampler.region_count) << 21;
+
+  size_t count = 0;
+  ept_access_run curr = {};
+
+  // the run that is currently being built can't be written if the buffer is
+  // full, in which case the next call starts at that run instead
+  auto const flush = [&]() {
+    if (curr.size == 0)
+      return true;
+
+    if (count >= max_count)
+      return false;
+
+    runs[count++] = curr;
+    curr.size = 0;
+
+    return true;
+  };
+
+  for (auto addr = physical_address & ~0xFFFull; addr < end;) {
+    uint64_t size = 0, access_count = 0;
+
+    // hot regions are exported at 4KB granularity
+    if (auto const hot = find_hot_region(sampler, addr)) {
+      size         = 0x1000;
+      access_count = hot->page_counts[(addr >> 12) & 0x1FF];
+    }
+    else {
+      size         = ((addr | 0x1FFFFF) + 1) - addr;
+      access_count = sampler.region_counts[addr >> 21];
+    }
+
+    if (access_count != 0 && curr.size != 0 &&
+        curr.physical_address + curr.size == addr && curr.sample_count == access_count)
+      curr.size += size;
+    else {
+      if (!flush()) {
+        physical_address = curr.physical_address;
+        return count;
+      }
+
+      if (access_count != 0) {
+        curr.physical_address = addr;
+        curr.size             = size;
+        curr.sample_count     = access_count;
+      }
+    }
+
+    addr += size;
+  }
+
+  if (!flush()) {
+    physical_address = curr.physical_address;
+    return count;
+  }
+
+  physical_address = 0;
+  return count;
+}
+
+} // namespace hv
+
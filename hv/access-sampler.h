@@ -0,0 +1,90 @@
+#pragma once
+
+#include "spin-lock.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct ept_access_run;
+
+// maximum number of 2MB regions that are sampled at 4KB granularity
+inline constexpr size_t access_sampler_hot_region_count = 16;
+
+// a 2MB region becomes hot once it was accessed in this many samples
+inline constexpr uint16_t access_sampler_hot_threshold = 4;
+
+// a hot region that isn't accessed for this many samples in a row is
+// merged back into a 2MB page to make room for other regions
+inline constexpr uint32_t access_sampler_cold_samples = 16;
+
+// a 2MB region that is sampled at 4KB granularity
+struct access_sampler_hot_region {
+  uint64_t physical_address;
+
+  // number of samples (since the region became hot) that each page was accessed in
+  uint16_t page_counts[512];
+
+  // bitmap of the pages that were accessed in the current sample
+  uint64_t volatile sample_pages[8];
+
+  // number of samples in a row that the region wasn't accessed in
+  uint32_t idle_samples;
+
+  bool used;
+};
+
+// histogram of how often each page of RAM is accessed, which is built from
+// the EPT accessed flags of every vcpu. a sample is taken by clearing and
+// harvesting the flags, and every page is counted at most once per sample.
+struct access_sampler {
+  // held while taking a sample or exporting the histogram
+  spin_lock lock;
+
+  // number of samples in which each 2MB region (up to the highest RAM
+  // address) was accessed
+  uint16_t* region_counts;
+  size_t region_count;
+
+  // bitmap of the regions that were accessed in the current sample
+  uint64_t volatile* sample_regions;
+
+  access_sampler_hot_region hot_regions[access_sampler_hot_region_count];
+
+  // regions that stopped being hot, which every vcpu merges back into a
+  // 2MB page during the next sample
+  uint64_t released[access_sampler_hot_region_count];
+  size_t released_count;
+
+  uint64_t sample_count;
+
+  // whether the EPT accessed flags are enabled on every vcpu
+  bool active;
+};
+
+// allocate the memory for the access sampler
+bool create_access_sampler(access_sampler& sampler);
+
+// free the memory that was allocated with create_access_sampler()
+void destroy_access_sampler(access_sampler& sampler);
+
+// clear the histogram. hot regions stay hot but their page counts are cleared.
+void reset_access_sampler(access_sampler& sampler);
+
+// mark a 2MB region (and optionally some of its pages) as accessed in the
+// current sample. ctx is the sampler, so that this can be passed directly
+// to collect_ept_accessed_regions(). this can be called on every vcpu at once.
+void record_accessed_region(uint64_t physical_address, uint64_t const* pages, void* ctx);
+
+// add the current sample to the histogram and update which regions are hot
+void finish_access_sample(access_sampler& sampler);
+
+// export the histogram as runs of pages with the same (non-zero) access
+// count, starting at the specified address. returns the number of runs that
+// were written, and updates the address to where the next call should
+// continue (or 0 if the end of the histogram was reached).
+size_t get_access_runs(access_sampler& sampler,
+  uint64_t& physical_address, ept_access_run* runs, size_t max_count);
+
+} // namespace hv
+
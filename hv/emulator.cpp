@@ -0,0 +1,461 @@
+#include "emulator.h"
+#include "page-tables.h"
+#include "snapshot.h"
+#include "vcpu.h"
+#include "vmx.h"
+#include "mm.h"
+#include "hv.h"
+
+namespace hv {
+
+// maximum length of an x86 instruction
+inline constexpr size_t max_instruction_length = 15;
+
+// the ALU operations are in the same order as the reg field of opcodes 80-83
+enum emulated_op : uint8_t {
+  emulated_op_add,
+  emulated_op_or,
+  emulated_op_adc,
+  emulated_op_sbb,
+  emulated_op_and,
+  emulated_op_sub,
+  emulated_op_xor,
+  emulated_op_cmp,
+  emulated_op_test,
+  emulated_op_mov,
+  emulated_op_movzx,
+  emulated_op_movsx
+};
+
+// an instruction with a single memory operand
+struct decoded_instruction {
+  emulated_op op;
+  size_t length;
+
+  // size of the operation and of the memory operand, which only differ
+  // for MOVZX and MOVSX
+  size_t op_size;
+  size_t mem_size;
+
+  // whether the memory operand is the destination operand
+  bool mem_is_dst;
+
+  // the other operand is either a register or a sign-extended immediate
+  uint64_t reg;
+  bool has_imm;
+  uint64_t imm;
+
+  // a REX prefix changes 8-bit register operands 4-7 from AH-BH to SPL-DIL
+  bool rex;
+
+  // linear address of the memory operand
+  uint64_t address;
+};
+
+// mask of the bits that fit in an operand of the specified size
+static uint64_t operand_mask(size_t const size) {
+  return size >= 8 ? ~0ull : (1ull << (size * 8)) - 1;
+}
+
+// sign-extend a value of the specified size to 64 bits
+static uint64_t sign_extend(uint64_t const value, size_t const size) {
+  if (size == 0 || size >= 8)
+    return value;
+
+  auto const shift = 64 - size * 8;
+  return static_cast<uint64_t>(static_cast<int64_t>(value << shift) >> shift);
+}
+
+// decode an instruction that accesses memory through its ModR/M operand.
+// false is returned if the instruction isn't supported.
+static bool decode_instruction(guest_context const* const ctx,
+    uint8_t const* const code, size_t const code_size, decoded_instruction& insn) {
+  // the code buffer is zero-padded, so the decoder can read past the end
+  // and only check the length once the whole instruction was decoded
+  size_t pos = 0;
+
+  auto const read_imm = [&](size_t const size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+      value |= static_cast<uint64_t>(code[pos++]) << (i * 8);
+    return sign_extend(value, size);
+  };
+
+  bool operand_size_override = false, address_size_override = false;
+  uint64_t segment_base = 0;
+
+  // legacy prefixes
+  while (true) {
+    auto const prefix = code[pos];
+
+    if (prefix == 0x66)
+      operand_size_override = true;
+    else if (prefix == 0x67)
+      address_size_override = true;
+    else if (prefix == 0x64)
+      segment_base = vmx_vmread(VMCS_GUEST_FS_BASE);
+    else if (prefix == 0x65)
+      segment_base = vmx_vmread(VMCS_GUEST_GS_BASE);
+    // LOCK and REP aren't supported
+    else if (prefix == 0xF0 || prefix == 0xF2 || prefix == 0xF3)
+      return false;
+    // the ES, CS, SS and DS overrides are ignored in 64-bit mode
+    else if (prefix != 0x26 && prefix != 0x2E && prefix != 0x36 && prefix != 0x3E)
+      break;
+
+    ++pos;
+  }
+
+  // a REX prefix is only used if it comes right before the opcode
+  uint8_t rex = 0;
+  if ((code[pos] & 0xF0) == 0x40)
+    rex = code[pos++];
+
+  // size of the operation for opcodes that aren't byte-sized. immediates
+  // are at most 32 bits and are sign-extended to 64 bits.
+  size_t const full_size     = (rex & 0x08) ? 8 : (operand_size_override ? 2 : 4);
+  size_t const full_imm_size = full_size == 8 ? 4 : full_size;
+
+  size_t imm_size = 0;
+  auto opcode = code[pos++];
+
+  insn.op_size    = (opcode & 1) ? full_size : 1;
+  insn.mem_is_dst = true;
+
+  // MOVZX and MOVSX
+  if (opcode == 0x0F) {
+    opcode = code[pos++];
+
+    if (opcode != 0xB6 && opcode != 0xB7 && opcode != 0xBE && opcode != 0xBF)
+      return false;
+
+    insn.op         = (opcode & 0x08) ? emulated_op_movsx : emulated_op_movzx;
+    insn.op_size    = full_size;
+    insn.mem_size   = (opcode & 1) ? 2 : 1;
+    insn.mem_is_dst = false;
+  }
+  // ADD, OR, ADC, SBB, AND, SUB, XOR and CMP
+  else if (opcode < 0x40 && (opcode & 0x07) < 4) {
+    insn.op         = static_cast<emulated_op>(opcode >> 3);
+    insn.mem_is_dst = !(opcode & 0x02);
+  }
+  // MOVSXD (this is a plain MOV without REX.W)
+  else if (opcode == 0x63 && (rex & 0x08)) {
+    insn.op         = emulated_op_movsx;
+    insn.op_size    = 8;
+    insn.mem_size   = 4;
+    insn.mem_is_dst = false;
+  }
+  // ALU operations with an immediate (82 is invalid in 64-bit mode)
+  else if (opcode >= 0x80 && opcode <= 0x83 && opcode != 0x82) {
+    insn.op  = static_cast<emulated_op>((code[pos] >> 3) & 0x07);
+    imm_size = (opcode == 0x81) ? full_imm_size : 1;
+  }
+  // TEST
+  else if (opcode == 0x84 || opcode == 0x85)
+    insn.op = emulated_op_test;
+  // MOV
+  else if (opcode >= 0x88 && opcode <= 0x8B) {
+    insn.op         = emulated_op_mov;
+    insn.mem_is_dst = !(opcode & 0x02);
+  }
+  // MOV and TEST with an immediate
+  else if ((opcode == 0xC6 || opcode == 0xC7 || opcode == 0xF6 || opcode == 0xF7)
+      && ((code[pos] >> 3) & 0x07) == 0) {
+    insn.op  = (opcode >= 0xF6) ? emulated_op_test : emulated_op_mov;
+    imm_size = (opcode & 1) ? full_imm_size : 1;
+  }
+  else
+    return false;
+
+  if (insn.op != emulated_op_movzx && insn.op != emulated_op_movsx)
+    insn.mem_size = insn.op_size;
+
+  auto const modrm = code[pos++];
+  auto const mod   = modrm >> 6;
+  auto const rm    = modrm & 0x07;
+
+  // register operands don't access memory
+  if (mod == 3)
+    return false;
+
+  insn.reg = ((modrm >> 3) & 0x07) | ((rex & 0x04) << 1);
+
+  uint64_t address  = 0;
+  size_t disp_size  = (mod == 1) ? 1 : ((mod == 2) ? 4 : 0);
+  bool rip_relative = false;
+
+  if (rm == 4) {
+    auto const sib   = code[pos++];
+    auto const base  = (sib & 0x07) | ((rex & 0x01) << 3);
+    auto const index = ((sib >> 3) & 0x07) | ((rex & 0x02) << 2);
+
+    // an index of RSP means that there is no index
+    if (index != 4)
+      address += read_guest_gpr(ctx, index) << (sib >> 6);
+
+    // a base of RBP or R13 without a displacement means that there is no base
+    if ((sib & 0x07) == 5 && mod == 0)
+      disp_size = 4;
+    else
+      address += read_guest_gpr(ctx, base);
+  }
+  else if (rm == 5 && mod == 0) {
+    rip_relative = true;
+    disp_size    = 4;
+  }
+  else
+    address += read_guest_gpr(ctx, rm | ((rex & 0x01) << 3));
+
+  address += read_imm(disp_size);
+
+  if (imm_size) {
+    insn.has_imm = true;
+    insn.imm     = read_imm(imm_size);
+  }
+
+  insn.length = pos;
+
+  if (insn.length > code_size || insn.length > max_instruction_length)
+    return false;
+
+  // RIP-relative addresses are relative to the next instruction
+  if (rip_relative)
+    address += vmx_vmread(VMCS_GUEST_RIP) + insn.length;
+
+  if (address_size_override)
+    address &= 0xFFFF'FFFF;
+
+  insn.address = address + segment_base;
+  insn.rex     = rex != 0;
+
+  return true;
+}
+
+// read a register operand
+static uint64_t read_register(guest_context const* const ctx,
+    decoded_instruction const& insn, size_t const size) {
+  // AH, CH, DH and BH
+  if (size == 1 && !insn.rex && insn.reg >= 4 && insn.reg < 8)
+    return (read_guest_gpr(ctx, insn.reg - 4) >> 8) & 0xFF;
+
+  return read_guest_gpr(ctx, insn.reg) & operand_mask(size);
+}
+
+// write to a register operand. 32-bit writes clear the upper half of the
+// register, while 8-bit and 16-bit writes preserve the rest of it.
+static void write_register(guest_context* const ctx,
+    decoded_instruction const& insn, size_t const size, uint64_t const value) {
+  // AH, CH, DH and BH
+  if (size == 1 && !insn.rex && insn.reg >= 4 && insn.reg < 8) {
+    auto const old = read_guest_gpr(ctx, insn.reg - 4);
+    write_guest_gpr(ctx, insn.reg - 4, (old & ~0xFF00ull) | ((value & 0xFF) << 8));
+    return;
+  }
+
+  auto const mask = operand_mask(size);
+
+  if (size >= 4)
+    write_guest_gpr(ctx, insn.reg, value & mask);
+  else
+    write_guest_gpr(ctx, insn.reg, (read_guest_gpr(ctx, insn.reg) & ~mask) | (value & mask));
+}
+
+// read a memory operand with a single access, like the processor would
+static uint64_t read_memory(uint8_t const* const mem, size_t const size) {
+  switch (size) {
+  case 1:  return *reinterpret_cast<uint8_t  const volatile*>(mem);
+  case 2:  return *reinterpret_cast<uint16_t const volatile*>(mem);
+  case 4:  return *reinterpret_cast<uint32_t const volatile*>(mem);
+  default: return *reinterpret_cast<uint64_t const volatile*>(mem);
+  }
+}
+
+// write to a memory operand with a single access, like the processor would
+static void write_memory(uint8_t* const mem, size_t const size, uint64_t const value) {
+  switch (size) {
+  case 1:  *reinterpret_cast<uint8_t  volatile*>(mem) = static_cast<uint8_t>(value);  break;
+  case 2:  *reinterpret_cast<uint16_t volatile*>(mem) = static_cast<uint16_t>(value); break;
+  case 4:  *reinterpret_cast<uint32_t volatile*>(mem) = static_cast<uint32_t>(value); break;
+  default: *reinterpret_cast<uint64_t volatile*>(mem) = value;                        break;
+  }
+}
+
+// perform an ALU operation on two operands of the specified size and
+// update the arithmetic flags in the same way that the processor would
+static uint64_t execute_alu(emulated_op const op, uint64_t const a,
+    uint64_t const b, size_t const size, rflags& flags) {
+  auto const mask = operand_mask(size);
+  auto const sign = 1ull << (size * 8 - 1);
+
+  uint64_t const carry_in = (op == emulated_op_adc || op == emulated_op_sbb)
+    ? flags.carry_flag : 0;
+
+  uint64_t result = 0;
+
+  switch (op) {
+  case emulated_op_add:
+  case emulated_op_adc:
+    result = (a + b + carry_in) & mask;
+    flags.carry_flag           = result < a || (carry_in && result == a);
+    flags.overflow_flag        = ((a ^ result) & (b ^ result) & sign) != 0;
+    flags.auxiliary_carry_flag = ((a ^ b ^ result) & 0x10) != 0;
+    break;
+  case emulated_op_sub:
+  case emulated_op_sbb:
+  case emulated_op_cmp:
+    result = (a - b - carry_in) & mask;
+    flags.carry_flag           = a < b || (carry_in && a == b);
+    flags.overflow_flag        = ((a ^ b) & (a ^ result) & sign) != 0;
+    flags.auxiliary_carry_flag = ((a ^ b ^ result) & 0x10) != 0;
+    break;
+  default:
+    if (op == emulated_op_or)
+      result = a | b;
+    else if (op == emulated_op_xor)
+      result = a ^ b;
+    else
+      result = a & b;
+
+    // AF is undefined for the logical operations, so it is cleared as well
+    flags.carry_flag           = 0;
+    flags.overflow_flag        = 0;
+    flags.auxiliary_carry_flag = 0;
+    break;
+  }
+
+  // PF only reflects the lowest byte of the result
+  auto parity = result & 0xFF;
+  parity ^= parity >> 4;
+  parity ^= parity >> 2;
+  parity ^= parity >> 1;
+
+  flags.parity_flag = !(parity & 1);
+  flags.zero_flag   = result == 0;
+  flags.sign_flag   = (result & sign) != 0;
+
+  return result;
+}
+
+// emulate the instruction that caused an EPT violation by performing its
+// memory access from root-mode, so that the page can stay protected. only
+// MOV, MOVZX, MOVSX, MOVSXD, TEST and the ALU instructions (ADD, OR, ADC,
+// SBB, AND, SUB, XOR and CMP) with a memory operand in RAM are supported,
+// and only in 64-bit mode. false is returned, without modifying any guest
+// state, if the instruction can't be emulated.
+// this should only be called from root-mode.
+bool emulate_memory_access(vcpu* const cpu,
+    vmx_exit_qualification_ept_violation const qualification) {
+  // instruction fetches can't be emulated, and the linear address is needed
+  // to make sure that the decoded memory operand is the one that faulted
+  if (qualification.execute_access || !qualification.caused_by_translation ||
+      !qualification.valid_guest_linear_address)
+    return false;
+
+  vmx_segment_access_rights cs_access_rights;
+  cs_access_rights.flags = static_cast<uint32_t>(
+    vmx_vmread(VMCS_GUEST_CS_ACCESS_RIGHTS));
+
+  if (!cs_access_rights.long_mode)
+    return false;
+
+  auto const physical_address = vmx_vmread(VMCS_GUEST_PHYSICAL_ADDRESS);
+
+  // MMIO can't be accessed through the host mapping of physical memory
+  if (!is_ram_address(physical_address))
+    return false;
+
+  // pages that aren't identity-mapped (i.e. hidden pages) have to be
+  // accessed through the EPT, or the access would go to the real page.
+  // large pages always identity-map their memory.
+  auto const pte = get_ept_pte(cpu->ept, physical_address);
+  if (pte && pte->page_frame_number != (physical_address >> 12))
+    return false;
+
+  uint8_t code[32] = {};
+
+  auto const code_size = read_guest_virtual_memory(
+    reinterpret_cast<void*>(vmx_vmread(VMCS_GUEST_RIP)), code, max_instruction_length);
+
+  decoded_instruction insn = {};
+  if (!decode_instruction(cpu->ctx, code, code_size, insn))
+    return false;
+
+  // the decoded memory operand has to be the one that faulted, and it can't
+  // cross into the next page since that page might not even be monitored
+  if (insn.address != vmx_vmread(VMCS_EXIT_GUEST_LINEAR_ADDRESS) ||
+      (insn.address & 0xFFF) + insn.mem_size > 0x1000)
+    return false;
+
+  auto const writes_memory = insn.mem_is_dst &&
+    insn.op != emulated_op_cmp && insn.op != emulated_op_test;
+
+  if (writes_memory) {
+    // the EPT dirty flag can't be set for a write that bypasses the EPT
+    if (cpu->ept.dirty_logging)
+      return false;
+
+    cr3 guest_cr3;
+    guest_cr3.flags = vmx_vmread(VMCS_GUEST_CR3);
+
+    // neither does the write go through the guest page tables
+    if (!set_guest_dirty_flag(guest_cr3, reinterpret_cast<void*>(insn.address)))
+      return false;
+
+    // the snapshot needs a copy of the page before it is modified
+    if (cpu->ept.snapshot_protected)
+      copy_snapshot_page(ghv.snapshot, physical_address >> 12);
+  }
+
+  auto const ctx = cpu->ctx;
+  auto const mem = host_physical_memory_base + physical_address;
+
+  auto const mem_value = (insn.op == emulated_op_mov && insn.mem_is_dst)
+    ? 0 : read_memory(mem, insn.mem_size);
+
+  switch (insn.op) {
+  case emulated_op_mov:
+    if (!insn.mem_is_dst)
+      write_register(ctx, insn, insn.op_size, mem_value);
+    else if (insn.has_imm)
+      write_memory(mem, insn.op_size, insn.imm);
+    else
+      write_memory(mem, insn.op_size, read_register(ctx, insn, insn.op_size));
+    break;
+  case emulated_op_movzx:
+    write_register(ctx, insn, insn.op_size, mem_value);
+    break;
+  case emulated_op_movsx:
+    write_register(ctx, insn, insn.op_size, sign_extend(mem_value, insn.mem_size));
+    break;
+  default: {
+    auto const other = insn.has_imm ? (insn.imm & operand_mask(insn.op_size))
+      : read_register(ctx, insn, insn.op_size);
+
+    rflags flags;
+    flags.flags = vmx_vmread(VMCS_GUEST_RFLAGS);
+
+    auto const result = insn.mem_is_dst
+      ? execute_alu(insn.op, mem_value, other, insn.op_size, flags)
+      : execute_alu(insn.op, other, mem_value, insn.op_size, flags);
+
+    vmx_vmwrite(VMCS_GUEST_RFLAGS, flags.flags);
+
+    if (insn.op == emulated_op_cmp || insn.op == emulated_op_test)
+      break;
+
+    if (insn.mem_is_dst)
+      write_memory(mem, insn.op_size, result);
+    else
+      write_register(ctx, insn, insn.op_size, result);
+    break;
+  }
+  }
+
+  // the vm-exit instruction length isn't valid for EPT violations
+  skip_instruction(insn.length);
+
+  return true;
+}
+
+} // namespace hv
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// emulate the instruction that caused an EPT violation by performing its
+// memory access from root-mode, so that the page can stay protected. only
+// MOV, MOVZX, MOVSX, MOVSXD, TEST and the ALU instructions (ADD, OR, ADC,
+// SBB, AND, SUB, XOR and CMP) with a memory operand in RAM are supported,
+// and only in 64-bit mode. false is returned, without modifying any guest
+// state, if the instruction can't be emulated.
+// this should only be called from root-mode.
+bool emulate_memory_access(vcpu* cpu,
+  vmx_exit_qualification_ept_violation qualification);
+
+} // namespace hv
@@ -3,229 +3,2070 @@
 #include "vcpu.h"
 #include "mtrr.h"
 #include "mm.h"
+#include "hv.h"
 
 namespace hv {
 
-// identity-map the EPT paging structures
-void prepare_ept(vcpu_ept_data& ept) {
+// allocate the memory for the EPT page pool
+bool create_ept_page_pool(ept_page_pool& pool, size_t const page_count) {
+  pool.lock.initialize();
+  pool.page_count = page_count;
+  pool.free_count = 0;
+
+  // allocations that are atleast a page in size are always page-aligned
+  pool.pages = static_cast<uint8_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, page_count * 0x1000, 'fr0g'));
+  pool.free_pfns = static_cast<uint64_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, page_count * sizeof(uint64_t), 'fr0g'));
+
+  if (!pool.pages || !pool.free_pfns) {
+    destroy_ept_page_pool(pool);
+    return false;
+  }
+
+  memset(pool.pages, 0, page_count * 0x1000);
+
+  for (size_t i = 0; i < page_count; ++i) {
+    pool.free_pfns[pool.free_count++] =
+      MmGetPhysicalAddress(pool.pages + i * 0x1000).QuadPart >> 12;
+  }
+
+  return true;
+}
+
+// free the memory that was allocated with create_ept_page_pool()
+void destroy_ept_page_pool(ept_page_pool& pool) {
+  if (pool.pages)
+    ExFreePoolWithTag(pool.pages, 'fr0g');
+
+  if (pool.free_pfns)
+    ExFreePoolWithTag(pool.free_pfns, 'fr0g');
+
+  pool.pages      = nullptr;
+  pool.free_pfns  = nullptr;
+  pool.page_count = 0;
+  pool.free_count = 0;
+}
+
+// allocate a zero-initialized page from the EPT page pool. 0 is returned if
+// the pool is empty. this function should only be called from root-mode.
+uint64_t alloc_ept_page(ept_page_pool& pool) {
+  uint64_t pfn = 0;
+
+  {
+    scoped_spin_lock lock(pool.lock);
+
+    if (pool.free_count > 0)
+      pfn = pool.free_pfns[--pool.free_count];
+  }
+
+  if (pfn)
+    memset(host_physical_memory_base + (pfn << 12), 0, 0x1000);
+
+  return pfn;
+}
+
+// return a page to the EPT page pool
+void free_ept_page(ept_page_pool& pool, uint64_t const pfn) {
+  scoped_spin_lock lock(pool.lock);
+
+  // this should never happen unless a page is freed twice
+  if (pool.free_count >= pool.page_count)
+    return;
+
+  pool.free_pfns[pool.free_count++] = pfn;
+}
+
+// allocate the memory for the shadow page arena
+bool create_ept_shadow_arena(ept_shadow_arena& arena) {
+  arena.lock.initialize();
+  arena.used_count = 0;
+  memset(arena.used, 0, sizeof(arena.used));
+
+  PHYSICAL_ADDRESS highest;
+  highest.QuadPart = MAXULONG64;
+
+  // contiguous memory makes it trivial to check whether a PFN belongs to
+  // the arena (and to hide the whole arena with a single range)
+  arena.pages = static_cast<uint8_t*>(MmAllocateContiguousMemory(
+    ept_shadow_arena_page_count * 0x1000, highest));
+
+  if (!arena.pages)
+    return false;
+
+  memset(arena.pages, 0, ept_shadow_arena_page_count * 0x1000);
+  arena.base_pfn = MmGetPhysicalAddress(arena.pages).QuadPart >> 12;
+
+  return true;
+}
+
+// free the memory that was allocated with create_ept_shadow_arena()
+void destroy_ept_shadow_arena(ept_shadow_arena& arena) {
+  if (arena.pages)
+    MmFreeContiguousMemory(arena.pages);
+
+  arena.pages      = nullptr;
+  arena.base_pfn   = 0;
+  arena.used_count = 0;
+}
+
+// allocate a page from the shadow page arena. the contents of the page are
+// undefined, and 0 is returned if the arena is full.
+uint64_t alloc_ept_shadow_page(ept_shadow_arena& arena) {
+  scoped_spin_lock lock(arena.lock);
+
+  for (size_t i = 0; i < ept_shadow_arena_page_count / 64; ++i) {
+    unsigned long bit = 0;
+    if (!_BitScanForward64(&bit, ~arena.used[i]))
+      continue;
+
+    arena.used[i] |= (1ull << bit);
+    ++arena.used_count;
+
+    return arena.base_pfn + i * 64 + bit;
+  }
+
+  return 0;
+}
+
+// return a page to the shadow page arena. false is returned if the page
+// doesn't belong to the arena or isn't in use.
+bool free_ept_shadow_page(ept_shadow_arena& arena, uint64_t const pfn) {
+  if (!arena.pages || pfn < arena.base_pfn ||
+      pfn >= arena.base_pfn + ept_shadow_arena_page_count)
+    return false;
+
+  auto const idx = pfn - arena.base_pfn;
+
+  scoped_spin_lock lock(arena.lock);
+
+  if (!(arena.used[idx / 64] & (1ull << (idx % 64))))
+    return false;
+
+  arena.used[idx / 64] &= ~(1ull << (idx % 64));
+  --arena.used_count;
+
+  return true;
+}
+
+// check whether an EPT paging structure entry is present
+static bool is_ept_entry_present(uint64_t const flags) {
+  // an entry is present if any of the read, write, or execute bits are set
+  return flags & 0b111;
+}
+
+// check whether an EPT PDPTE maps a 1GB page or points to a PD
+static bool is_ept_pdpte_1gb(ept_pdpte const& pdpte) {
+  return reinterpret_cast<ept_pdpte_1gb const&>(pdpte).large_page;
+}
+
+// get the virtual address of an EPT paging structure in the identity map.
+// this is only used in non-root mode, before the host page tables exist.
+static void* get_identity_table_va(uint64_t const pfn) {
+  PHYSICAL_ADDRESS address;
+  address.QuadPart = pfn << 12;
+  return MmGetVirtualForPhysical(address);
+}
+
+// get the next unused page from the memory that was allocated for the
+// identity map. this is only used in non-root mode.
+static uint64_t alloc_identity_table(ept_identity_map& map) {
+  if (map.used_table_page_count >= map.table_page_count)
+    return 0;
+
+  auto const page = map.table_pages + map.used_table_page_count++ * 0x1000;
+  memset(page, 0, 0x1000);
+
+  return MmGetPhysicalAddress(page).QuadPart >> 12;
+}
+
+// identity-map the 1GB region of RAM that contains the specified address
+static bool map_identity_ram_region(ept_identity_map& map,
+    mtrr_data const& mtrrs, bool const supports_1gb_pages, uint64_t const gb) {
+  auto& pml4e = map.pml4[gb >> 9];
+
+  // allocate a PDPT for this 512GB region
+  if (!is_ept_entry_present(pml4e.flags)) {
+    auto const pdpt_pfn = alloc_identity_table(map);
+    if (!pdpt_pfn)
+      return false;
+
+    pml4e.flags             = 0;
+    pml4e.read_access       = 1;
+    pml4e.write_access      = 1;
+    pml4e.execute_access    = 1;
+    pml4e.accessed          = 0;
+    pml4e.user_mode_execute = 1;
+    pml4e.page_frame_number = pdpt_pfn;
+  }
+
+  auto const pdpt = static_cast<ept_pdpte*>(
+    get_identity_table_va(pml4e.page_frame_number));
+
+  // memory type of every 2MB region in this 1GB region
+  uint8_t memory_types[512];
+  bool uniform = true;
+
+  for (size_t i = 0; i < 512; ++i) {
+    memory_types[i] = calc_mtrr_mem_type(mtrrs,
+      ((gb << 9) + i) << 21, 0x1000 << 9);
+
+    if (memory_types[i] != memory_types[0])
+      uniform = false;
+  }
+
+  // map the whole region with a single 1GB page if possible, the PD
+  // will be created later if the region ever needs to be split
+  if (uniform && supports_1gb_pages) {
+    ept_pdpte_1gb pdpte;
+    pdpte.flags             = 0;
+    pdpte.read_access       = 1;
+    pdpte.write_access      = 1;
+    pdpte.execute_access    = 1;
+    pdpte.memory_type       = memory_types[0];
+    pdpte.ignore_pat        = 0;
+    pdpte.large_page        = 1;
+    pdpte.accessed          = 0;
+    pdpte.dirty             = 0;
+    pdpte.user_mode_execute = 1;
+    pdpte.suppress_ve       = 0;
+    pdpte.page_frame_number = gb;
+
+    pdpt[gb & 0x1FF].flags = pdpte.flags;
+    return true;
+  }
+
+  auto const pd_pfn = alloc_identity_table(map);
+  if (!pd_pfn)
+    return false;
+
+  // point the PDPTE to the PD
+  auto& pdpte             = pdpt[gb & 0x1FF];
+  pdpte.flags             = 0;
+  pdpte.read_access       = 1;
+  pdpte.write_access      = 1;
+  pdpte.execute_access    = 1;
+  pdpte.accessed          = 0;
+  pdpte.user_mode_execute = 1;
+  pdpte.page_frame_number = pd_pfn;
+
+  auto const pd = static_cast<ept_pde_2mb*>(get_identity_table_va(pd_pfn));
+
+  for (size_t i = 0; i < 512; ++i) {
+    // identity-map every GPA to the corresponding HPA
+    auto& pde             = pd[i];
+    pde.flags             = 0;
+    pde.read_access       = 1;
+    pde.write_access      = 1;
+    pde.execute_access    = 1;
+    pde.ignore_pat        = 0;
+    pde.large_page        = 1;
+    pde.accessed          = 0;
+    pde.dirty             = 0;
+    pde.user_mode_execute = 1;
+    pde.suppress_ve       = 0;
+    pde.page_frame_number = (gb << 9) + i;
+    pde.memory_type       = memory_types[i];
+  }
+
+  return true;
+}
+
+// call the specified function for every 1GB region that contains RAM
+template <typename Fn>
+static bool for_each_ram_region(PPHYSICAL_MEMORY_RANGE const ranges, Fn const fn) {
+  // the ranges are sorted, so this is used to skip regions that are
+  // shared between two adjacent ranges
+  uint64_t next_gb = 0;
+
+  for (auto range = ranges; range->BaseAddress.QuadPart ||
+       range->NumberOfBytes.QuadPart; ++range) {
+    auto const start = static_cast<uint64_t>(range->BaseAddress.QuadPart);
+    auto const end   = start + range->NumberOfBytes.QuadPart;
+
+    auto gb = start >> 30;
+    if (gb < next_gb)
+      gb = next_gb;
+
+    for (; gb <= ((end - 1) >> 30); ++gb) {
+      if (!fn(gb))
+        return false;
+
+      next_gb = gb + 1;
+    }
+  }
+
+  return true;
+}
+
+// identity-map the shared EPT paging structures. only physical memory
+// that is backed by RAM is mapped here, while everything else (such as
+// MMIO) is mapped on-demand by map_missing_ept_entry().
+bool prepare_ept_identity_map(ept_identity_map& map) {
+  memset(&map, 0, sizeof(map));
+
+  map.lock.initialize();
+
+  auto const ranges = MmGetPhysicalMemoryRanges();
+  if (!ranges)
+    return false;
+
+  // count the number of paging structures that could possibly be needed
+  uint64_t prev_pml4_idx = ~0ull;
+  for_each_ram_region(ranges, [&](uint64_t const gb) {
+    // PD for this 1GB region
+    ++map.table_page_count;
+
+    // PDPT for the 512GB region that this is in
+    if ((gb >> 9) != prev_pml4_idx)
+      ++map.table_page_count;
+
+    prev_pml4_idx = gb >> 9;
+    return true;
+  });
+
+  // allocations that are atleast a page in size are always page-aligned
+  map.table_pages = static_cast<uint8_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, map.table_page_count * 0x1000, 'fr0g'));
+
+  if (!map.table_pages) {
+    ExFreePool(ranges);
+    return false;
+  }
+
+  ia32_vmx_ept_vpid_cap_register ept_cap;
+  ept_cap.flags = __readmsr(IA32_VMX_EPT_VPID_CAP);
+
+  // MTRR data for setting memory types
+  auto const mtrrs = read_mtrr_data();
+
+  // TODO: allocate a PT for the fixed MTRRs region so that we can get
+  // more accurate memory typing in that area (as opposed to just
+  // mapping the whole PDE as UC).
+
+  auto const success = for_each_ram_region(ranges, [&](uint64_t const gb) {
+    return map_identity_ram_region(map, mtrrs, ept_cap.pdpte_1gb_pages, gb);
+  });
+
+  ExFreePool(ranges);
+
+  if (!success) {
+    destroy_ept_identity_map(map);
+    return false;
+  }
+
+  return true;
+}
+
+// free the memory that was allocated by prepare_ept_identity_map()
+void destroy_ept_identity_map(ept_identity_map& map) {
+  if (map.table_pages)
+    ExFreePoolWithTag(map.table_pages, 'fr0g');
+
+  map.table_pages           = nullptr;
+  map.table_page_count      = 0;
+  map.used_table_page_count = 0;
+}
+
+// initialize the EPT data for a single vcpu
+void prepare_ept(vcpu_ept_data& ept, size_t const vcpu_idx) {
   memset(&ept, 0, sizeof(ept));
 
-  ept.dummy_page_pfn = MmGetPhysicalAddress(ept.dummy_page).QuadPart >> 12;
+  ept.dummy_page_pfn = MmGetPhysicalAddress(ept.dummy_page).QuadPart >> 12;
+  ept.pml4_pfn       = MmGetPhysicalAddress(ept.pml4).QuadPart >> 12;
+  ept.exec_pml4_pfn  = MmGetPhysicalAddress(ept.exec_pml4).QuadPart >> 12;
+
+  // the execute view is built the first time that a hook needs it
+  ept.exec_view_enabled = true;
+  ept.exec_view_stale   = true;
+
+  for (auto& bucket : ept.hooks.buckets)
+    bucket = nullptr;
+
+  ept.hooks.active_count   = 0;
+  ept.hooks.scoped_count   = 0;
+  ept.hooks.free_list_head = &ept.hooks.buffer[0];
+
+  for (size_t i = 0; i < ept.hooks.capacity - 1; ++i)
+    ept.hooks.buffer[i].next = &ept.hooks.buffer[i + 1];
+
+  // the last node points to NULL
+  ept.hooks.buffer[ept.hooks.capacity - 1].next = nullptr;
+
+  // the MMR state of every vcpu is allocated separately
+  auto& pool = ghv.mmr_pool;
+  ept.mmrs        = &pool.mmrs[vcpu_idx];
+  ept.mmr_profile = pool.profiles ? &pool.profiles[vcpu_idx] : nullptr;
+  ept.mmr_trace   = pool.traces ? &pool.traces[vcpu_idx] : nullptr;
+
+  prepare_mmrs(*ept.mmrs);
+
+  if (ept.mmr_profile)
+    prepare_mmr_profile(*ept.mmr_profile);
+
+  if (ept.mmr_trace)
+    prepare_mmr_trace(*ept.mmr_trace);
+
+  ia32_vmx_ept_vpid_cap_register ept_cap;
+  ept_cap.flags = __readmsr(IA32_VMX_EPT_VPID_CAP);
+
+  ept.invept_single_context = ept_cap.invept_single_context;
+
+  // point every PML4E to the shared PDPTs. vcpus that have already been
+  // virtualized might be adding entries concurrently, so each entry is
+  // copied in a single store. anything that gets missed is picked up
+  // later by map_missing_ept_entry().
+  for (size_t i = 0; i < 512; ++i)
+    ept.pml4[i].flags = ghv.ept_identity->pml4[i].flags;
+}
+
+// get the PDPT that is currently being used by this vcpu. this returns null
+// if the specified PML4E isn't present.
+static ept_pdpte* get_vcpu_ept_pdpt(vcpu_ept_data& ept, uint64_t const pml4_idx) {
+  auto const& pml4e = ept.pml4[pml4_idx];
+
+  if (!is_ept_entry_present(pml4e.flags))
+    return nullptr;
+
+  return reinterpret_cast<ept_pdpte*>(host_physical_memory_base
+    + (pml4e.page_frame_number << 12));
+}
+
+// get a shared PDPT. this returns null if the specified PML4E isn't present.
+static ept_pdpte* get_shared_ept_pdpt(uint64_t const pml4_idx) {
+  auto const& pml4e = ghv.ept_identity->pml4[pml4_idx];
+
+  if (!is_ept_entry_present(pml4e.flags))
+    return nullptr;
+
+  return reinterpret_cast<ept_pdpte*>(host_physical_memory_base
+    + (pml4e.page_frame_number << 12));
+}
+
+// check whether one of the vcpu's PDPTs is a private copy
+static bool is_ept_pdpt_private(vcpu_ept_data& ept, uint64_t const pml4_idx) {
+  return ept.pml4[pml4_idx].page_frame_number !=
+    ghv.ept_identity->pml4[pml4_idx].page_frame_number;
+}
+
+// check whether a PDPTE in one of the vcpu's PDPTs points to a private PD
+static bool is_ept_pd_private(ept_pdpte const& pdpte, ept_pdpte const& shared_pdpte) {
+  if (!is_ept_entry_present(pdpte.flags) || is_ept_pdpte_1gb(pdpte))
+    return false;
+
+  // the shared version is a 1GB page, so this PD must've been created when
+  // the 1GB page was split
+  if (is_ept_pdpte_1gb(shared_pdpte))
+    return true;
+
+  return pdpte.page_frame_number != shared_pdpte.page_frame_number;
+}
+
+// make sure that the shared identity map covers the specified physical
+// address. this is used for physical memory that isn't RAM (such as MMIO),
+// which is mapped with 2MB pages as it gets accessed.
+static bool map_shared_ept_entry(uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  auto& map = *ghv.ept_identity;
+
+  scoped_spin_lock lock(map.lock);
+
+  auto& pml4e = map.pml4[addr.pml4_idx];
+
+  // allocate a PDPT for this 512GB region
+  if (!is_ept_entry_present(pml4e.flags)) {
+    auto const pdpt_pfn = alloc_ept_page(ghv.ept_page_pool);
+    if (!pdpt_pfn)
+      return false;
+
+    ept_pml4e new_pml4e;
+    new_pml4e.flags             = 0;
+    new_pml4e.read_access       = 1;
+    new_pml4e.write_access      = 1;
+    new_pml4e.execute_access    = 1;
+    new_pml4e.user_mode_execute = 1;
+    new_pml4e.page_frame_number = pdpt_pfn;
+
+    // other vcpus can read this concurrently, so only write to it once
+    pml4e.flags = new_pml4e.flags;
+  }
+
+  auto& pdpte = get_shared_ept_pdpt(addr.pml4_idx)[addr.pdpt_idx];
+
+  // allocate a PD for this 1GB region
+  if (!is_ept_entry_present(pdpte.flags)) {
+    auto const pd_pfn = alloc_ept_page(ghv.ept_page_pool);
+    if (!pd_pfn)
+      return false;
+
+    ept_pdpte new_pdpte;
+    new_pdpte.flags             = 0;
+    new_pdpte.read_access       = 1;
+    new_pdpte.write_access      = 1;
+    new_pdpte.execute_access    = 1;
+    new_pdpte.user_mode_execute = 1;
+    new_pdpte.page_frame_number = pd_pfn;
+
+    pdpte.flags = new_pdpte.flags;
+  }
+
+  if (is_ept_pdpte_1gb(pdpte))
+    return true;
+
+  auto& pde = reinterpret_cast<ept_pde_2mb*>(host_physical_memory_base
+    + (pdpte.page_frame_number << 12))[addr.pd_idx];
+
+  if (is_ept_entry_present(pde.flags))
+    return true;
+
+  ept_pde_2mb new_pde;
+  new_pde.flags             = 0;
+  new_pde.read_access       = 1;
+  new_pde.write_access      = 1;
+  new_pde.execute_access    = 1;
+  new_pde.large_page        = 1;
+  new_pde.user_mode_execute = 1;
+  new_pde.page_frame_number = physical_address >> 21;
+  new_pde.memory_type       = calc_mtrr_mem_type(read_mtrr_data(),
+    new_pde.page_frame_number << 21, 0x1000 << 9);
+
+  pde.flags = new_pde.flags;
+
+  return true;
+}
+
+// map a physical address that isn't mapped in the vcpu's EPT paging
+// structures yet. returns false if the address was already mapped.
+bool map_missing_ept_entry(vcpu_ept_data& ept, uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  auto& pml4e = ept.pml4[addr.pml4_idx];
+
+  if (!is_ept_entry_present(pml4e.flags)) {
+    if (!map_shared_ept_entry(physical_address))
+      return false;
+
+    // point to the shared PDPT, which now maps this address
+    pml4e.flags = ghv.ept_identity->pml4[addr.pml4_idx].flags;
+    return true;
+  }
+
+  auto& pdpte = get_vcpu_ept_pdpt(ept, addr.pml4_idx)[addr.pdpt_idx];
+
+  if (!is_ept_entry_present(pdpte.flags)) {
+    if (!map_shared_ept_entry(physical_address))
+      return false;
+
+    // copy the entry into the private PDPT (this is a no-op if the
+    // PDPT is shared)
+    pdpte.flags = get_shared_ept_pdpt(addr.pml4_idx)[addr.pdpt_idx].flags;
+    return true;
+  }
+
+  if (is_ept_pdpte_1gb(pdpte))
+    return false;
+
+  auto& pde = reinterpret_cast<ept_pde*>(host_physical_memory_base
+    + (pdpte.page_frame_number << 12))[addr.pd_idx];
+
+  if (!is_ept_entry_present(pde.flags)) {
+    if (!map_shared_ept_entry(physical_address))
+      return false;
+
+    auto const& shared_pdpte = get_shared_ept_pdpt(addr.pml4_idx)[addr.pdpt_idx];
+
+    // copy the entry into the private PD (this is a no-op if the PD is
+    // shared). if the private PD was created by splitting a 1GB page then
+    // it can't have any missing entries in the first place.
+    pde.flags = reinterpret_cast<ept_pde*>(host_physical_memory_base
+      + (shared_pdpte.page_frame_number << 12))[addr.pd_idx].flags;
+    return true;
+  }
+
+  return false;
+}
+
+// call the specified function on every EPT PDPT that this vcpu might be
+// using. this includes the shared PDPTs as well as every private PDPT.
+template <typename Fn>
+static void for_each_ept_pdpt(vcpu_ept_data& ept, Fn const fn) {
+  for (size_t i = 0; i < 512; ++i) {
+    if (auto const pdpt = get_shared_ept_pdpt(i))
+      fn(pdpt);
+
+    if (!is_ept_pdpt_private(ept, i))
+      continue;
+
+    if (auto const pdpt = get_vcpu_ept_pdpt(ept, i))
+      fn(pdpt);
+  }
+}
+
+// call the specified function on every EPT PD that this vcpu might be
+// using. this includes the shared PDs as well as every private PD.
+template <typename Fn>
+static void for_each_ept_pd(vcpu_ept_data& ept, Fn const fn) {
+  for (size_t i = 0; i < 512; ++i) {
+    auto const shared_pdpt = get_shared_ept_pdpt(i);
+    if (!shared_pdpt)
+      continue;
+
+    for (size_t j = 0; j < 512; ++j) {
+      auto const& pdpte = shared_pdpt[j];
+
+      if (!is_ept_entry_present(pdpte.flags) || is_ept_pdpte_1gb(pdpte))
+        continue;
+
+      fn(reinterpret_cast<ept_pde*>(host_physical_memory_base
+        + (pdpte.page_frame_number << 12)));
+    }
+
+    // this vcpu doesn't have any private PDs in this 512GB region
+    if (!is_ept_pdpt_private(ept, i))
+      continue;
+
+    auto const pdpt = get_vcpu_ept_pdpt(ept, i);
+    if (!pdpt)
+      continue;
+
+    for (size_t j = 0; j < 512; ++j) {
+      if (!is_ept_pd_private(pdpt[j], shared_pdpt[j]))
+        continue;
+
+      fn(reinterpret_cast<ept_pde*>(host_physical_memory_base
+        + (pdpt[j].page_frame_number << 12)));
+    }
+  }
+}
+
+// the execute view copies parts of the main view, so it needs to be rebuilt
+// (and can't be used until then) whenever the main view is modified
+static void invalidate_ept_exec_view(vcpu_ept_data& ept) {
+  ept.exec_view_stale = true;
+
+  if (ept.exec_view_active)
+    set_ept_view(ept, false);
+}
+
+// update the memory types in the EPT paging structures based on the MTRRs.
+// this function should only be called from root-mode during vmx-operation.
+// NOTE: this also updates the shared identity map, which affects every vcpu.
+void update_ept_memory_type(vcpu_ept_data& ept) {
+  invalidate_ept_exec_view(ept);
+  // TODO: completely virtualize the guest MTRRs
+  auto const mtrrs = read_mtrr_data();
+
+  for_each_ept_pdpt(ept, [&](ept_pdpte* const pdpt) {
+    for (size_t i = 0; i < 512; ++i) {
+      if (!is_ept_entry_present(pdpt[i].flags) || !is_ept_pdpte_1gb(pdpt[i]))
+        continue;
+
+      auto& pdpte = reinterpret_cast<ept_pdpte_1gb*>(pdpt)[i];
+
+      // update the memory type for this 1GB page
+      pdpte.memory_type = calc_mtrr_mem_type(mtrrs,
+        pdpte.page_frame_number << 30, 0x1000 << 18);
+    }
+  });
+
+  for_each_ept_pd(ept, [&](ept_pde* const pd) {
+    for (size_t i = 0; i < 512; ++i) {
+      auto& pde = reinterpret_cast<ept_pde_2mb*>(pd)[i];
+
+      // this region hasn't been accessed yet
+      if (!is_ept_entry_present(pde.flags))
+        continue;
+
+      // 2MB large page
+      if (pde.large_page) {
+        // update the memory type for this PDE
+        pde.memory_type = calc_mtrr_mem_type(mtrrs,
+          pde.page_frame_number << 21, 0x1000 << 9);
+      }
+      // PDE points to a PT
+      else {
+        auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
+          + (pd[i].page_frame_number << 12));
+
+        // update the memory type for every PTE
+        for (size_t k = 0; k < 512; ++k) {
+          pt[k].memory_type = calc_mtrr_mem_type(mtrrs,
+            pt[k].page_frame_number << 12, 0x1000);
+        }
+      }
+    }
+  });
+}
+
+// set the memory type in every EPT paging structure to the specified value.
+// NOTE: this also updates the shared identity map, which affects every vcpu.
+void set_ept_memory_type(vcpu_ept_data& ept, uint8_t const memory_type) {
+  invalidate_ept_exec_view(ept);
+  for_each_ept_pdpt(ept, [&](ept_pdpte* const pdpt) {
+    for (size_t i = 0; i < 512; ++i) {
+      if (is_ept_entry_present(pdpt[i].flags) && is_ept_pdpte_1gb(pdpt[i]))
+        reinterpret_cast<ept_pdpte_1gb*>(pdpt)[i].memory_type = memory_type;
+    }
+  });
+
+  for_each_ept_pd(ept, [&](ept_pde* const pd) {
+    for (size_t i = 0; i < 512; ++i) {
+      auto& pde = reinterpret_cast<ept_pde_2mb*>(pd)[i];
+
+      // this region hasn't been accessed yet
+      if (!is_ept_entry_present(pde.flags))
+        continue;
+
+      // 2MB large page
+      if (pde.large_page)
+        pde.memory_type = memory_type;
+      // PDE points to a PT
+      else {
+        auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
+          + (pd[i].page_frame_number << 12));
+
+        // update the memory type for every PTE
+        for (size_t k = 0; k < 512; ++k)
+          pt[k].memory_type = memory_type;
+      }
+    }
+  });
+}
+
+// get the corresponding EPT PDPTE for a given physical address.
+// NOTE: this may point into the shared identity map, so it is read-only.
+ept_pdpte const* get_ept_pdpte(vcpu_ept_data& ept, uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  auto const pdpt = get_vcpu_ept_pdpt(ept, addr.pml4_idx);
+  if (!pdpt || !is_ept_entry_present(pdpt[addr.pdpt_idx].flags))
+    return nullptr;
+
+  return &pdpt[addr.pdpt_idx];
+}
+
+// get the corresponding EPT PDE for a given physical address. null is
+// returned if the address is mapped by a 1GB page or isn't mapped at all.
+// NOTE: this may point into the shared identity map, so it is read-only.
+ept_pde const* get_ept_pde(vcpu_ept_data& ept, uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  auto const pdpte = get_ept_pdpte(ept, physical_address);
+  if (!pdpte || is_ept_pdpte_1gb(*pdpte))
+    return nullptr;
+
+  auto const pde = &reinterpret_cast<ept_pde*>(host_physical_memory_base
+    + (pdpte->page_frame_number << 12))[addr.pd_idx];
+
+  if (!is_ept_entry_present(pde->flags))
+    return nullptr;
+
+  return pde;
+}
+
+// get the corresponding EPT PDPTE for a given physical address, creating a
+// private copy of the PDPT if it is still shared with other vcpus
+static ept_pdpte* get_private_ept_pdpte(vcpu_ept_data& ept,
+    uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  // the address might not have been accessed yet (if it isn't RAM)
+  map_missing_ept_entry(ept, physical_address);
+
+  auto const shared_pdpt = get_shared_ept_pdpt(addr.pml4_idx);
+  if (!shared_pdpt || !get_ept_pdpte(ept, physical_address))
+    return nullptr;
+
+  // copy the shared PDPT
+  if (!is_ept_pdpt_private(ept, addr.pml4_idx)) {
+    auto const pdpt_pfn = alloc_ept_page(ghv.ept_page_pool);
+    if (!pdpt_pfn)
+      return nullptr;
+
+    // copy each entry in a single store since other vcpus can be
+    // adding entries to the shared PDPT concurrently
+    auto const pdpt = reinterpret_cast<ept_pdpte*>(
+      host_physical_memory_base + (pdpt_pfn << 12));
+
+    for (size_t i = 0; i < 512; ++i)
+      pdpt[i].flags = shared_pdpt[i].flags;
+
+    ept.pml4[addr.pml4_idx].page_frame_number = pdpt_pfn;
+  }
+
+  return &get_vcpu_ept_pdpt(ept, addr.pml4_idx)[addr.pdpt_idx];
+}
+
+// get the corresponding EPT PDE for a given physical address, creating a
+// private copy of the PDPT and PD if they are still shared with other vcpus.
+// 1GB pages are split into a PD of 2MB pages.
+ept_pde* get_private_ept_pde(vcpu_ept_data& ept, uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  auto const private_pdpte = get_private_ept_pdpte(ept, physical_address);
+  if (!private_pdpte)
+    return nullptr;
+
+  auto& pdpte = *private_pdpte;
+  auto const& shared_pdpte = get_shared_ept_pdpt(addr.pml4_idx)[addr.pdpt_idx];
+
+  if (is_ept_pdpte_1gb(pdpte)) {
+    split_ept_pdpte(ept, reinterpret_cast<ept_pdpte_1gb*>(&pdpte));
+
+    // failed to split the PDPTE
+    if (is_ept_pdpte_1gb(pdpte))
+      return nullptr;
+  }
+  // copy the shared PD
+  else if (!is_ept_pd_private(pdpte, shared_pdpte)) {
+    auto const pd_pfn = alloc_ept_page(ghv.ept_page_pool);
+    if (!pd_pfn)
+      return nullptr;
+
+    auto const pd = reinterpret_cast<ept_pde*>(
+      host_physical_memory_base + (pd_pfn << 12));
+    auto const shared_pd = reinterpret_cast<ept_pde*>(
+      host_physical_memory_base + (shared_pdpte.page_frame_number << 12));
+
+    for (size_t i = 0; i < 512; ++i)
+      pd[i].flags = shared_pd[i].flags;
+
+    pdpte.page_frame_number = pd_pfn;
+  }
+
+  auto const pd = reinterpret_cast<ept_pde*>(host_physical_memory_base
+    + (pdpte.page_frame_number << 12));
+
+  return &pd[addr.pd_idx];
+}
+
+// get the corresponding EPT PTE for a given physical address.
+// PTs are always private to a single vcpu, so this can be modified.
+ept_pte* get_ept_pte(vcpu_ept_data& ept,
+    uint64_t const physical_address, bool const force_split) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  auto const pde = get_ept_pde(ept, physical_address);
+
+  // the address is mapped by a 1GB or 2MB page (or isn't mapped at all)
+  if (!pde || reinterpret_cast<ept_pde_2mb const*>(pde)->large_page) {
+    if (!force_split)
+      return nullptr;
+
+    auto const pde_2mb = reinterpret_cast<ept_pde_2mb*>(
+      get_private_ept_pde(ept, physical_address));
+
+    // failed to allocate the private paging structures
+    if (!pde_2mb)
+      return nullptr;
+
+    split_ept_pde(ept, pde_2mb);
+
+    // failed to split the PDE
+    if (pde_2mb->large_page)
+      return nullptr;
+
+    return get_ept_pte(ept, physical_address, false);
+  }
+
+  auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
+    + (pde->page_frame_number << 12));
+
+  return &pt[addr.pt_idx];
+}
+
+// get the private EPT entry (PTE, 2MB PDE, or 1GB PDPTE) that maps the
+// specified physical address, along with the size of the page that it maps.
+// the permission bits are in the same position at every level, so the result
+// can be used to modify permissions. null is returned if the entry is still
+// part of the shared identity map.
+ept_pte* get_private_ept_leaf(vcpu_ept_data& ept,
+    uint64_t const physical_address, uint64_t& page_size) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  if (auto const pte = get_ept_pte(ept, physical_address)) {
+    page_size = 0x1000;
+    return pte;
+  }
+
+  auto const shared_pdpt = get_shared_ept_pdpt(addr.pml4_idx);
+  if (!shared_pdpt || !get_ept_pdpte(ept, physical_address) ||
+      !is_ept_pdpt_private(ept, addr.pml4_idx))
+    return nullptr;
+
+  auto& pdpte = get_vcpu_ept_pdpt(ept, addr.pml4_idx)[addr.pdpt_idx];
+
+  if (is_ept_pdpte_1gb(pdpte)) {
+    page_size = 0x40000000;
+    return reinterpret_cast<ept_pte*>(&pdpte);
+  }
+
+  if (!is_ept_pd_private(pdpte, shared_pdpt[addr.pdpt_idx]))
+    return nullptr;
+
+  auto const pde = &reinterpret_cast<ept_pde*>(host_physical_memory_base
+    + (pdpte.page_frame_number << 12))[addr.pd_idx];
+
+  if (!is_ept_entry_present(pde->flags))
+    return nullptr;
+
+  page_size = 0x200000;
+  return reinterpret_cast<ept_pte*>(pde);
+}
+
+// split a private 1GB EPT PDPTE so that it points to an EPT PD
+void split_ept_pdpte(vcpu_ept_data&, ept_pdpte_1gb* const pdpte_1gb) {
+  // this PDPTE is already split
+  if (!pdpte_1gb->large_page)
+    return;
+
+  // allocate a page from the pool for the PD
+  auto const pd_pfn = alloc_ept_page(ghv.ept_page_pool);
+  if (!pd_pfn)
+    return;
+
+  auto const pd = reinterpret_cast<ept_pde_2mb*>(
+    host_physical_memory_base + (pd_pfn << 12));
+
+  for (size_t i = 0; i < 512; ++i) {
+    auto& pde = pd[i];
+    pde.flags = 0;
+
+    // copy the parent PDPTE flags
+    pde.read_access             = pdpte_1gb->read_access;
+    pde.write_access            = pdpte_1gb->write_access;
+    pde.execute_access          = pdpte_1gb->execute_access;
+    pde.memory_type             = pdpte_1gb->memory_type;
+    pde.ignore_pat              = pdpte_1gb->ignore_pat;
+    pde.large_page              = 1;
+    pde.accessed                = pdpte_1gb->accessed;
+    pde.dirty                   = pdpte_1gb->dirty;
+    pde.user_mode_execute       = pdpte_1gb->user_mode_execute;
+    pde.verify_guest_paging     = pdpte_1gb->verify_guest_paging;
+    pde.paging_write_access     = pdpte_1gb->paging_write_access;
+    pde.supervisor_shadow_stack = pdpte_1gb->supervisor_shadow_stack;
+    pde.suppress_ve             = pdpte_1gb->suppress_ve;
+    pde.page_frame_number       = (pdpte_1gb->page_frame_number << 9) + i;
+
+    // write access that is withheld for a snapshot stays withheld
+    pde.flags |= pdpte_1gb->flags & (1ull << ept_snapshot_bit);
+  }
+
+  auto const pdpte         = reinterpret_cast<ept_pdpte*>(pdpte_1gb);
+  pdpte->flags             = 0;
+  pdpte->read_access       = 1;
+  pdpte->write_access      = 1;
+  pdpte->execute_access    = 1;
+  pdpte->user_mode_execute = 1;
+  pdpte->page_frame_number = pd_pfn;
+}
+
+// split a private 2MB EPT PDE so that it points to an EPT PT
+void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* const pde_2mb) {
+  // this PDE is already split
+  if (!pde_2mb->large_page)
+    return;
+
+  // allocate a page from the pool for the PT
+  auto const pt_pfn = alloc_ept_page(ghv.ept_page_pool);
+  if (!pt_pfn)
+    return;
+
+  auto const pt = reinterpret_cast<ept_pte*>(
+    host_physical_memory_base + (pt_pfn << 12));
+
+  for (size_t i = 0; i < 512; ++i) {
+    auto& pte = pt[i];
+    pte.flags = 0;
+
+    // copy the parent PDE flags
+    pte.read_access             = pde_2mb->read_access;
+    pte.write_access            = pde_2mb->write_access;
+    pte.execute_access          = pde_2mb->execute_access;
+    pte.memory_type             = pde_2mb->memory_type;
+    pte.ignore_pat              = pde_2mb->ignore_pat;
+    pte.accessed                = pde_2mb->accessed;
+    pte.dirty                   = pde_2mb->dirty;
+    pte.user_mode_execute       = pde_2mb->user_mode_execute;
+    pte.verify_guest_paging     = pde_2mb->verify_guest_paging;
+    pte.paging_write_access     = pde_2mb->paging_write_access;
+    pte.supervisor_shadow_stack = pde_2mb->supervisor_shadow_stack;
+    pte.suppress_ve             = pde_2mb->suppress_ve;
+    pte.page_frame_number       = (pde_2mb->page_frame_number << 9) + i;
+
+    // write access that is withheld for a snapshot stays withheld
+    pte.flags |= pde_2mb->flags & (1ull << ept_snapshot_bit);
+  }
+
+  auto const pde         = reinterpret_cast<ept_pde*>(pde_2mb);
+  pde->flags             = 0;
+  pde->read_access       = 1;
+  pde->write_access      = 1;
+  pde->execute_access    = 1;
+  pde->user_mode_execute = 1;
+  pde->page_frame_number = pt_pfn;
+}
+
+// check whether a PD maps the exact same memory as a 1GB page
+static bool ept_pd_matches_pdpte(ept_pde_2mb const* const pd,
+    ept_pdpte_1gb const& pdpte) {
+  for (size_t i = 0; i < 512; ++i) {
+    auto const& pde = pd[i];
+
+    // this PDE points to a PT or has been remapped
+    if (!pde.large_page ||
+        pde.page_frame_number != (pdpte.page_frame_number << 9) + i)
+      return false;
+
+    // the accessed and dirty flags are intentionally ignored here
+    if (pde.read_access       != pdpte.read_access       ||
+        pde.write_access      != pdpte.write_access      ||
+        pde.execute_access    != pdpte.execute_access    ||
+        pde.memory_type       != pdpte.memory_type       ||
+        pde.ignore_pat        != pdpte.ignore_pat        ||
+        pde.user_mode_execute != pdpte.user_mode_execute ||
+        pde.suppress_ve       != pdpte.suppress_ve       ||
+        ((pde.flags ^ pdpte.flags) & (1ull << ept_snapshot_bit)))
+      return false;
+  }
+
+  return true;
+}
+
+// check whether a private PD or PDPT maps the same memory as the shared one.
+// the accessed flags are set by the processor and are ignored, and so are
+// the dirty flags unless they still have to be collected by dirty logging.
+static bool ept_table_matches_shared(vcpu_ept_data const& ept,
+    uint64_t const* const table, uint64_t const* const shared_table) {
+  // bit 7 is the large page flag, and bits 8 and 9 the accessed and dirty flags
+  for (size_t i = 0; i < 512; ++i) {
+    if (ept.dirty_logging && (table[i] & (1ull << 7)) && (table[i] & (1ull << 9)))
+      return false;
+
+    if ((table[i] ^ shared_table[i]) & ~((1ull << 8) | (1ull << 9)))
+      return false;
+  }
+
+  return true;
+}
+
+// give the private PD and PDPT back to the EPT page pool if they are
+// identical to the shared identity map
+static void release_private_ept_tables(vcpu_ept_data& ept,
+    uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  // the PDPT isn't private, which means that the PD isn't either
+  if (!is_ept_pdpt_private(ept, addr.pml4_idx))
+    return;
+
+  auto const pdpt = get_vcpu_ept_pdpt(ept, addr.pml4_idx);
+  auto const shared_pdpt = get_shared_ept_pdpt(addr.pml4_idx);
+
+  auto& pdpte = pdpt[addr.pdpt_idx];
+  auto const& shared_pdpte = shared_pdpt[addr.pdpt_idx];
+
+  if (is_ept_pd_private(pdpte, shared_pdpte)) {
+    auto const pd_pfn = pdpte.page_frame_number;
+    auto const pd = host_physical_memory_base + (pd_pfn << 12);
+
+    bool dirty = false;
+
+    if (is_ept_pdpte_1gb(shared_pdpte)) {
+      // the PD can't be turned back into a 1GB page yet
+      if (!ept_pd_matches_pdpte(reinterpret_cast<ept_pde_2mb*>(pd),
+          reinterpret_cast<ept_pdpte_1gb const&>(shared_pdpte)))
+        return;
+
+      for (size_t i = 0; i < 512; ++i)
+        dirty |= reinterpret_cast<ept_pde_2mb*>(pd)[i].dirty;
+    }
+    else if (!ept_table_matches_shared(ept, reinterpret_cast<uint64_t*>(pd),
+        reinterpret_cast<uint64_t*>(host_physical_memory_base +
+        (shared_pdpte.page_frame_number << 12))))
+      return;
+
+    pdpte.flags = shared_pdpte.flags;
+    free_ept_page(ghv.ept_page_pool, pd_pfn);
+
+    // keep the PDPT private instead of losing track of written pages
+    if (dirty)
+      reinterpret_cast<ept_pdpte_1gb&>(pdpte).dirty = 1;
+  }
+
+  if (!ept_table_matches_shared(ept, reinterpret_cast<uint64_t const*>(pdpt),
+      reinterpret_cast<uint64_t const*>(shared_pdpt)))
+    return;
+
+  auto const pdpt_pfn = ept.pml4[addr.pml4_idx].page_frame_number;
+  ept.pml4[addr.pml4_idx].flags = ghv.ept_identity->pml4[addr.pml4_idx].flags;
+  free_ept_page(ghv.ept_page_pool, pdpt_pfn);
+}
+
+// merge the PT that maps the specified physical address back into a 2MB
+// PDE. this only happens if every PTE in the PT identity-maps its page with
+// the same permissions and memory type. returns true if the PT was merged.
+bool merge_ept_pde(vcpu_ept_data& ept, uint64_t const physical_address) {
+  // already a 2MB or 1GB page (or out of bounds)
+  if (!get_ept_pte(ept, physical_address, false))
+    return false;
+
+  // PDEs that point to a PT are always in a private PD, so this doesn't
+  // need to allocate anything
+  auto const pde = get_private_ept_pde(ept, physical_address);
+
+  auto const pt_pfn = pde->page_frame_number;
+  auto const pt = reinterpret_cast<ept_pte*>(
+    host_physical_memory_base + (pt_pfn << 12));
+
+  auto const is_in_pt = [pt](ept_pte const* const pte) {
+    return pte >= pt && pte < pt + 512;
+  };
+
+  // the MMR page is written to once the MTF or the access window fires,
+  // which could be long after the PT went back to the pool. re-protecting
+  // it now either keeps the PT from merging or settles the PTE for good.
+  if (is_in_pt(ept.mmr_mtf_pte))
+    rearm_mmr_page(ept);
+
+  // the hook PTE is restored after the next instruction, so the PT has to
+  // stick around until then
+  if (!ept.hook_mtf_exec_view && is_in_pt(ept.hook_mtf_pte))
+    return false;
+
+  // PFN of the first page in this 2MB region
+  auto const base_pfn = (physical_address >> 21) << 9;
+
+  auto const& first = pt[0];
+
+  // the merged PDE is dirty if any of the pages were written to, so that
+  // dirty logging doesn't miss them
+  bool accessed = false, dirty = false;
+
+  for (size_t i = 0; i < 512; ++i) {
+    auto const& pte = pt[i];
+
+    accessed |= pte.accessed;
+    dirty    |= pte.dirty;
+
+    // the page has been remapped (by a hook or by hiding it)
+    if (pte.page_frame_number != base_pfn + i)
+      return false;
+
+    // the accessed and dirty flags are intentionally ignored here
+    if (pte.read_access             != first.read_access             ||
+        pte.write_access            != first.write_access            ||
+        pte.execute_access          != first.execute_access          ||
+        pte.memory_type             != first.memory_type             ||
+        pte.ignore_pat              != first.ignore_pat              ||
+        pte.user_mode_execute       != first.user_mode_execute       ||
+        pte.verify_guest_paging     != first.verify_guest_paging     ||
+        pte.paging_write_access     != first.paging_write_access     ||
+        pte.supervisor_shadow_stack != first.supervisor_shadow_stack ||
+        pte.suppress_ve             != first.suppress_ve             ||
+        ((pte.flags ^ first.flags) & (1ull << ept_snapshot_bit)))
+      return false;
+  }
+
+  ept_pde_2mb new_pde;
+  new_pde.flags                   = 0;
+  new_pde.read_access             = first.read_access;
+  new_pde.write_access            = first.write_access;
+  new_pde.execute_access          = first.execute_access;
+  new_pde.memory_type             = first.memory_type;
+  new_pde.ignore_pat              = first.ignore_pat;
+  new_pde.large_page              = 1;
+  new_pde.accessed                = accessed;
+  new_pde.dirty                   = dirty;
+  new_pde.user_mode_execute       = first.user_mode_execute;
+  new_pde.verify_guest_paging     = first.verify_guest_paging;
+  new_pde.paging_write_access     = first.paging_write_access;
+  new_pde.supervisor_shadow_stack = first.supervisor_shadow_stack;
+  new_pde.suppress_ve             = first.suppress_ve;
+  new_pde.page_frame_number       = physical_address >> 21;
+  new_pde.flags                  |= first.flags & (1ull << ept_snapshot_bit);
+
+  // the PDE is written in a single store so that it is never half-updated
+  pde->flags = new_pde.flags;
+
+  free_ept_page(ghv.ept_page_pool, pt_pfn);
+
+  release_private_ept_tables(ept, physical_address);
+
+  return true;
+}
+
+// try to merge every PT that maps part of the specified physical range
+void merge_ept_range(vcpu_ept_data& ept,
+    uint64_t const physical_address, uint64_t const size) {
+  auto const start = physical_address & ~0x1FFFFFull;
+  auto const end   = physical_address + size;
+
+  for (auto addr = start; addr < end; addr += 0x200000)
+    merge_ept_pde(ept, addr);
+}
+
+// give the private PDs and PDPTs in the specified physical range back to the
+// EPT page pool if they are identical to the shared identity map again
+static void release_private_ept_range(vcpu_ept_data& ept,
+    uint64_t const physical_address, uint64_t const size) {
+  auto const start = physical_address & ~0x3FFFFFFFull;
+  auto const end   = physical_address + size;
+
+  for (auto addr = start; addr < end; addr += 0x40000000)
+    release_private_ept_tables(ept, addr);
+}
+
+// check whether an op can modify the large page at the specified address as
+// a whole, and make the paging structures that map it private if so. returns
+// the size of the large page, or 0 if the page needs to be split instead.
+static uint64_t prepare_ept_txn_large_page(vcpu_ept_data& ept,
+    ept_txn_op const& op, uint64_t const physical_address) {
+  auto const end = op.start + op.size;
+
+  // the address might not have been accessed yet (if it isn't RAM)
+  map_missing_ept_entry(ept, physical_address);
+
+  auto const pdpte = get_ept_pdpte(ept, physical_address);
+  if (!pdpte)
+    return 0;
+
+  // the whole page has to be covered by the op, and every page inside of it
+  // needs to end up with the same permissions
+  auto const fits = [&](uint64_t const page_size) {
+    return (physical_address & (page_size - 1)) == 0 &&
+      physical_address + page_size <= end &&
+      (!op.mmr_permissions || is_mmr_mode_uniform(*ept.mmrs, physical_address, page_size));
+  };
+
+  if (is_ept_pdpte_1gb(*pdpte) && fits(0x40000000))
+    return get_private_ept_pdpte(ept, physical_address) ? 0x40000000 : 0;
+
+  if (!fits(0x200000))
+    return 0;
+
+  // this is either a 1GB page (which gets split into 2MB pages) or a PD
+  auto const pde = get_ept_pde(ept, physical_address);
+  if (pde && !reinterpret_cast<ept_pde_2mb const*>(pde)->large_page)
+    return 0;
+
+  auto const private_pde = reinterpret_cast<ept_pde_2mb*>(
+    get_private_ept_pde(ept, physical_address));
+
+  if (!private_pde || !private_pde->large_page)
+    return 0;
+
+  return 0x200000;
+}
+
+// get the access that an op grants to every page in the specified range, as
+// a combination of mmr_memory_mode flags
+static uint8_t get_ept_txn_access(vcpu_ept_data const& ept,
+    ept_txn_op const& op, uint64_t const physical_address, uint64_t const size) {
+  uint8_t access = 0;
+
+  if (op.read_access)
+    access |= mmr_memory_mode_r;
+  if (op.write_access)
+    access |= mmr_memory_mode_w;
+  if (op.execute_access)
+    access |= mmr_memory_mode_x;
+
+  if (op.mmr_permissions) {
+    access &= ~get_mmr_mode(*ept.mmrs, physical_address, size);
+
+    // write access but no read access will generate an EPT misconfiguration
+    if (!(access & mmr_memory_mode_r))
+      access &= ~mmr_memory_mode_w;
+  }
+
+  return access;
+}
+
+// invalidate the cached translations that were derived from this vcpu's
+// EPT paging structures. this should only be called from root-mode.
+void flush_ept(vcpu_ept_data& ept) {
+  invalidate_ept_exec_view(ept);
+
+  if (!ept.invept_single_context) {
+    vmx_invept(invept_all_context, {});
+    return;
+  }
+
+  invept_descriptor desc = {};
+  desc.ept_pointer = vmx_vmread(VMCS_CTRL_EPT_POINTER);
+  vmx_invept(invept_single_context, desc);
+}
+
+// re-protect the MMR page that was left accessible, either for a single
+// instruction or for an access window, and flush the EPT. nothing happens
+// if every MMR page is protected.
+// this should only be called from root-mode.
+void rearm_mmr_page(vcpu_ept_data& ept) {
+  auto& pte       = ept.mmr_mtf_pte;
+  auto const mode = ept.mmr_mtf_mode;
+
+  ept.mmr_window_deadline = 0;
+
+  if (!pte)
+    return;
+
+  // restore MMR mode
+  pte->read_access    = !(mode & mmr_memory_mode_r);
+  pte->write_access   = !(mode & mmr_memory_mode_w);
+  pte->execute_access = !(mode & mmr_memory_mode_x);
+
+  // write access but no read access will generate an EPT misconfiguration
+  if (pte->write_access && !pte->read_access)
+    pte->write_access = 0;
+
+  pte = nullptr;
+
+  flush_ept(ept);
+}
+
+// check whether the processor supports the EPT accessed and dirty flags
+static bool are_ept_ad_flags_supported() {
+  ia32_vmx_ept_vpid_cap_register ept_cap;
+  ept_cap.flags = __readmsr(IA32_VMX_EPT_VPID_CAP);
+  return ept_cap.ept_accessed_and_dirty_flags;
+}
+
+// enable the EPT accessed and dirty flags in the EPTP while dirty logging
+// or access sampling needs them, and flush the EPT
+static void update_ept_ad_flags(vcpu_ept_data& ept) {
+  ept_pointer eptp;
+  eptp.flags = vmx_vmread(VMCS_CTRL_EPT_POINTER);
+  eptp.enable_access_and_dirty_flags = ept.dirty_logging || ept.access_sampling;
+  vmx_vmwrite(VMCS_CTRL_EPT_POINTER, eptp.flags);
+
+  flush_ept(ept);
+}
+
+// enable or disable dirty logging for the current vcpu. the dirty flag of
+// every EPT entry is cleared when logging is enabled. returns false if the
+// processor doesn't support EPT A/D flags.
+// this should only be called from root-mode.
+bool set_ept_dirty_logging(vcpu_ept_data& ept, bool const enable) {
+  if (enable && !are_ept_ad_flags_supported())
+    return false;
+
+  // the dirty flags that were set before logging was enabled (by splitting
+  // or by a previous logging session) don't mean anything anymore
+  if (enable)
+    collect_ept_dirty_pages(ept, 0, 512ull << 39, nullptr, nullptr);
+
+  ept.dirty_logging = enable;
+  update_ept_ad_flags(ept);
+
+  return true;
+}
+
+// enable or disable access sampling for the current vcpu. returns false if
+// the processor doesn't support EPT A/D flags.
+// this should only be called from root-mode.
+bool set_ept_access_sampling(vcpu_ept_data& ept, bool const enable) {
+  if (enable && !are_ept_ad_flags_supported())
+    return false;
+
+  ept.access_sampling = enable;
+  update_ept_ad_flags(ept);
+
+  return true;
+}
+
+// clear the accessed flag of an EPT entry and return whether it was set
+static bool test_and_clear_ept_accessed(uint64_t& flags) {
+  // the accessed flag is bit 8 in every EPT paging structure entry
+  return _interlockedbittestandreset64(reinterpret_cast<long long volatile*>(&flags), 8);
+}
+
+// clear the accessed flag of every EPT entry in the current view and call
+// fn() for every 2MB region that was accessed. the paging structures that
+// might be shared with other vcpus are harvested by whichever vcpu gets to
+// them first, and subtrees whose non-leaf entry wasn't accessed are skipped.
+// the EPT should be flushed afterwards so that the flags get set again.
+void collect_ept_accessed_regions(vcpu_ept_data& ept,
+    ept_accessed_region_fn const fn, void* const ctx) {
+  for (uint64_t pml4_idx = 0; pml4_idx < 512; ++pml4_idx) {
+    if (!test_and_clear_ept_accessed(ept.pml4[pml4_idx].flags))
+      continue;
+
+    auto const pdpt = get_vcpu_ept_pdpt(ept, pml4_idx);
+    if (!pdpt)
+      continue;
+
+    for (uint64_t pdpt_idx = 0; pdpt_idx < 512; ++pdpt_idx) {
+      auto& pdpte = pdpt[pdpt_idx];
+      auto const gb_address = (pml4_idx << 39) | (pdpt_idx << 30);
+
+      if (!is_ept_entry_present(pdpte.flags) || !test_and_clear_ept_accessed(pdpte.flags))
+        continue;
+
+      if (is_ept_pdpte_1gb(pdpte)) {
+        for (uint64_t i = 0; i < 512; ++i)
+          fn(gb_address + (i << 21), nullptr, ctx);
+        continue;
+      }
+
+      auto const pd = reinterpret_cast<ept_pde*>(host_physical_memory_base
+        + (pdpte.page_frame_number << 12));
+
+      for (uint64_t pd_idx = 0; pd_idx < 512; ++pd_idx) {
+        auto& pde = pd[pd_idx];
+        auto const region_address = gb_address + (pd_idx << 21);
+
+        if (!is_ept_entry_present(pde.flags) || !test_and_clear_ept_accessed(pde.flags))
+          continue;
+
+        if (reinterpret_cast<ept_pde_2mb&>(pde).large_page) {
+          fn(region_address, nullptr, ctx);
+          continue;
+        }
+
+        auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
+          + (pde.page_frame_number << 12));
+
+        uint64_t pages[8] = {};
+
+        for (uint64_t pt_idx = 0; pt_idx < 512; ++pt_idx) {
+          if (is_ept_entry_present(pt[pt_idx].flags) &&
+              test_and_clear_ept_accessed(pt[pt_idx].flags))
+            pages[pt_idx / 64] |= (1ull << (pt_idx % 64));
+        }
+
+        fn(region_address, pages, ctx);
+      }
+    }
+  }
+}
+
+// call fn() for every present leaf EPT entry (PTE, 2MB PDE, or 1GB PDPTE)
+// in the current view that maps part of the specified physical range. fn is
+// called with the flags of the entry and the page that it maps.
+template <typename Fn>
+static void for_each_ept_leaf(vcpu_ept_data& ept,
+    uint64_t const physical_address, uint64_t const size, Fn const fn) {
+  auto const end = physical_address + size;
+
+  // skip to the start of the next page of the specified size
+  auto const next = [](uint64_t const addr, uint64_t const page_size) {
+    return (addr | (page_size - 1)) + 1;
+  };
+
+  for (auto addr = physical_address & ~0xFFFull; addr < end;) {
+    pml4_virtual_address const va = { reinterpret_cast<void*>(addr) };
+
+    auto const pdpt = get_vcpu_ept_pdpt(ept, va.pml4_idx);
+    if (!pdpt) {
+      addr = next(addr, 1ull << 39);
+      continue;
+    }
+
+    auto& pdpte = pdpt[va.pdpt_idx];
+
+    if (!is_ept_entry_present(pdpte.flags)) {
+      addr = next(addr, 0x40000000);
+      continue;
+    }
+
+    if (is_ept_pdpte_1gb(pdpte)) {
+      fn(pdpte.flags, addr & ~0x3FFFFFFFull, 0x40000000ull);
+      addr = next(addr, 0x40000000);
+      continue;
+    }
+
+    auto& pde = reinterpret_cast<ept_pde*>(host_physical_memory_base
+      + (pdpte.page_frame_number << 12))[va.pd_idx];
+
+    if (!is_ept_entry_present(pde.flags)) {
+      addr = next(addr, 0x200000);
+      continue;
+    }
+
+    if (reinterpret_cast<ept_pde_2mb&>(pde).large_page) {
+      fn(pde.flags, addr & ~0x1FFFFFull, 0x200000ull);
+      addr = next(addr, 0x200000);
+      continue;
+    }
+
+    auto& pte = reinterpret_cast<ept_pte*>(host_physical_memory_base
+      + (pde.page_frame_number << 12))[va.pt_idx];
+
+    if (is_ept_entry_present(pte.flags))
+      fn(pte.flags, addr, 0x1000ull);
+
+    addr += 0x1000;
+  }
+}
+
+// clear the dirty flag of a leaf EPT entry and report the range that it maps
+// if the flag was set. the entry might be part of the shared identity map,
+// which is fine since the processor sets the flag atomically as well.
+static void collect_ept_dirty_leaf(uint64_t& flags,
+    uint64_t const page_address, uint64_t const page_size,
+    uint64_t const start, uint64_t const end,
+    ept_dirty_range_fn const fn, void* const ctx) {
+  // the dirty flag is bit 9 in every leaf EPT entry
+  if (!_interlockedbittestandreset64(reinterpret_cast<long long volatile*>(&flags), 9))
+    return;
+
+  if (!fn)
+    return;
+
+  auto const range_start = page_address < start ? start : page_address;
+  auto const range_end   = page_address + page_size > end ? end : page_address + page_size;
+
+  fn(range_start, range_end - range_start, ctx);
+}
+
+// clear the dirty flag of every EPT entry that maps part of the specified
+// physical range and call fn() for every range that was dirty (clamped to
+// the specified range). every page in a dirty 2MB or 1GB page is reported.
+// fn can be null, in which case the dirty flags are only cleared.
+void collect_ept_dirty_pages(vcpu_ept_data& ept, uint64_t const physical_address,
+    uint64_t const size, ept_dirty_range_fn const fn, void* const ctx) {
+  auto const start = physical_address & ~0xFFFull;
+  auto const end   = physical_address + size;
+
+  for_each_ept_leaf(ept, physical_address, size, [&](uint64_t& flags,
+      uint64_t const page_address, uint64_t const page_size) {
+    collect_ept_dirty_leaf(flags, page_address, page_size, start, end, fn, ctx);
+  });
+}
+
+// write-protect a leaf EPT entry for a snapshot, or give its write access
+// back. the entry might be part of the shared identity map, which every vcpu
+// modifies in the same way, so the flags are modified atomically.
+static void set_ept_leaf_snapshot_protection(uint64_t& flags, bool const enable) {
+  auto const bits = reinterpret_cast<long long volatile*>(&flags);
+
+  // the write access flag is bit 1 in every EPT entry
+  if (enable) {
+    if (flags & (1ull << 1)) {
+      _interlockedbittestandset64(bits, ept_snapshot_bit);
+      _interlockedbittestandreset64(bits, 1);
+    }
+  }
+  else if (_interlockedbittestandreset64(bits, ept_snapshot_bit))
+    _interlockedbittestandset64(bits, 1);
+}
+
+// write-protect every EPT leaf that maps part of the specified physical
+// range for a memory snapshot, or give write access back to the leaves that
+// were write-protected. the EPT should be flushed afterwards.
+void set_ept_snapshot_protection(vcpu_ept_data& ept,
+    uint64_t const physical_address, uint64_t const size, bool const enable) {
+  for_each_ept_leaf(ept, physical_address, size, [&](uint64_t& flags, uint64_t, uint64_t) {
+    set_ept_leaf_snapshot_protection(flags, enable);
+  });
+}
+
+// get the leaf EPT entry (PTE, 2MB PDE, or 1GB PDPTE) that maps the specified
+// physical address, along with the size of the page that it maps.
+// NOTE: this may point into the shared identity map, so it is read-only.
+static ept_pte const* get_ept_leaf(vcpu_ept_data& ept,
+    uint64_t const physical_address, uint64_t& page_size) {
+  if (auto const pte = get_ept_pte(ept, physical_address)) {
+    page_size = 0x1000;
+    return pte;
+  }
+
+  if (auto const pde = get_ept_pde(ept, physical_address)) {
+    page_size = 0x200000;
+    return reinterpret_cast<ept_pte const*>(pde);
+  }
+
+  auto const pdpte = get_ept_pdpte(ept, physical_address);
+  if (!pdpte || !is_ept_pdpte_1gb(*pdpte))
+    return nullptr;
+
+  page_size = 0x40000000;
+  return reinterpret_cast<ept_pte const*>(pdpte);
+}
+
+// check whether the page at the specified address is write-protected for a
+// memory snapshot on the current vcpu
+bool is_ept_snapshot_page(vcpu_ept_data& ept, uint64_t const physical_address) {
+  uint64_t page_size = 0;
+  auto const leaf = get_ept_leaf(ept, physical_address, page_size);
+  return leaf && (leaf->flags & (1ull << ept_snapshot_bit));
+}
+
+// give write access back to a page that was write-protected for a memory
+// snapshot. large pages are split so that the rest of the large page stays
+// write-protected, and false is returned if that wasn't possible.
+// this should only be called from root-mode.
+bool release_ept_snapshot_page(vcpu_ept_data& ept, uint64_t const physical_address) {
+  if (!is_ept_snapshot_page(ept, physical_address))
+    return true;
+
+  auto pte = get_ept_pte(ept, physical_address);
+  bool split = false;
+
+  if (!pte) {
+    pte   = get_ept_pte(ept, physical_address, true);
+    split = true;
+
+    if (!pte)
+      return false;
+  }
+
+  pte->flags &= ~(1ull << ept_snapshot_bit);
+
+  // hooked pages that currently map their executable page stay unwritable,
+  // since write access without read access is a misconfiguration
+  pte->write_access = pte->read_access;
+
+  // entries that only gained access don't need to be invalidated, since
+  // the ept-violation already invalidated the translations for this page
+  if (split)
+    flush_ept(ept);
+
+  return true;
+}
+
+// set the write access of a leaf EPT entry. while RAM is write-protected
+// for a memory snapshot, write access is only marked as withheld.
+void set_ept_write_access(vcpu_ept_data const& ept, ept_pte& pte, bool const allowed) {
+  if (allowed && ept.snapshot_protected) {
+    pte.flags       |= (1ull << ept_snapshot_bit);
+    pte.write_access = 0;
+    return;
+  }
+
+  pte.flags       &= ~(1ull << ept_snapshot_bit);
+  pte.write_access = allowed;
+}
+
+// get the EPTP value for one of the views
+static uint64_t get_ept_view_eptp(vcpu_ept_data& ept, bool const exec) {
+  ept_pointer eptp;
+  eptp.flags             = vmx_vmread(VMCS_CTRL_EPT_POINTER);
+  eptp.page_frame_number = exec ? ept.exec_pml4_pfn : ept.pml4_pfn;
+  return eptp.flags;
+}
+
+// give every paging structure that the execute view copied back to the pool
+static void release_ept_exec_view(vcpu_ept_data& ept) {
+  for (size_t i = 0; i < ept.exec_view_table_count; ++i)
+    free_ept_page(ghv.ept_page_pool, ept.exec_view_tables[i]);
+
+  ept.exec_view_table_count = 0;
 
-  ept.num_used_free_pages = 0;
+  // the PTE is gone along with the rest of the copies
+  if (ept.hook_mtf_exec_view)
+    ept.hook_mtf_pte = nullptr;
+}
 
-  for (size_t i = 0; i < ept_free_page_count; ++i)
-    ept.free_page_pfns[i] = MmGetPhysicalAddress(&ept.free_pages[i]).QuadPart >> 12;
+// make an entry in the execute view point to a copy of the paging structure
+// that it currently points to, and return the copy. leaves in the copy are
+// write-protected while dirty logging, so that writes are redirected to the
+// main view (where the dirty flags are collected from).
+template <typename Entry>
+static uint64_t* get_ept_exec_table(vcpu_ept_data& ept, Entry& entry, bool const is_pt) {
+  auto const table = [](uint64_t const pfn) {
+    return reinterpret_cast<uint64_t*>(host_physical_memory_base + (pfn << 12));
+  };
+
+  // this structure has already been copied
+  for (size_t i = 0; i < ept.exec_view_table_count; ++i) {
+    if (ept.exec_view_tables[i] == entry.page_frame_number)
+      return table(entry.page_frame_number);
+  }
 
-  ept.hooks.active_list_head = nullptr;
-  ept.hooks.free_list_head   = &ept.hooks.buffer[0];
+  if (ept.exec_view_table_count >= ept_exec_view_max_tables)
+    return nullptr;
 
-  for (size_t i = 0; i < ept.hooks.capacity - 1; ++i)
-    ept.hooks.buffer[i].next = &ept.hooks.buffer[i + 1];
+  auto const pfn = alloc_ept_page(ghv.ept_page_pool);
+  if (!pfn)
+    return nullptr;
 
-  // the last node points to NULL
-  ept.hooks.buffer[ept.hooks.capacity - 1].next = nullptr;
+  ept.exec_view_tables[ept.exec_view_table_count++] = pfn;
 
-  // setup the first PML4E so that it points to our PDPT
-  auto& pml4e             = ept.pml4[0];
-  pml4e.flags             = 0;
-  pml4e.read_access       = 1;
-  pml4e.write_access      = 1;
-  pml4e.execute_access    = 1;
-  pml4e.accessed          = 0;
-  pml4e.user_mode_execute = 1;
-  pml4e.page_frame_number = MmGetPhysicalAddress(&ept.pdpt).QuadPart >> 12;
+  auto const src = table(entry.page_frame_number);
+  auto const dst = table(pfn);
 
-  // MTRR data for setting memory types
-  auto const mtrrs = read_mtrr_data();
+  for (size_t i = 0; i < 512; ++i) {
+    ept_pte leaf;
+    leaf.flags = src[i];
 
-  // TODO: allocate a PT for the fixed MTRRs region so that we can get
-  // more accurate memory typing in that area (as opposed to just
-  // mapping the whole PDE as UC).
+    // bit 7 is the large page flag in PDEs and PDPTEs
+    if (ept.dirty_logging && is_ept_entry_present(leaf.flags) &&
+        (is_pt || (leaf.flags & (1 << 7))))
+      leaf.write_access = 0;
 
-  for (size_t i = 0; i < ept_pd_count; ++i) {
-    // point each PDPTE to the corresponding PD
-    auto& pdpte             = ept.pdpt[i];
-    pdpte.flags             = 0;
-    pdpte.read_access       = 1;
-    pdpte.write_access      = 1;
-    pdpte.execute_access    = 1;
-    pdpte.accessed          = 0;
-    pdpte.user_mode_execute = 1;
-    pdpte.page_frame_number = MmGetPhysicalAddress(&ept.pds[i]).QuadPart >> 12;
+    dst[i] = leaf.flags;
+  }
 
-    for (size_t j = 0; j < 512; ++j) {
-      // identity-map every GPA to the corresponding HPA
-      auto& pde             = ept.pds_2mb[i][j];
-      pde.flags             = 0;
-      pde.read_access       = 1;
-      pde.write_access      = 1;
-      pde.execute_access    = 1;
-      pde.ignore_pat        = 0;
-      pde.large_page        = 1;
-      pde.accessed          = 0;
-      pde.dirty             = 0;
-      pde.user_mode_execute = 1;
-      pde.suppress_ve       = 0;
-      pde.page_frame_number = (i << 9) + j;
-      pde.memory_type       = calc_mtrr_mem_type(mtrrs,
-        pde.page_frame_number << 21, 0x1000 << 9);
+  entry.page_frame_number = pfn;
+
+  return dst;
+}
+
+// rebuild the execute view from the main view. every hooked page is mapped
+// to its executable page with execute-only access, and everything else is
+// the same as in the main view.
+static bool build_ept_exec_view(vcpu_ept_data& ept) {
+  auto const start_tsc = __rdtsc();
+
+  release_ept_exec_view(ept);
+
+  for (size_t i = 0; i < 512; ++i)
+    ept.exec_pml4[i].flags = ept.pml4[i].flags;
+
+  for (auto bucket : ept.hooks.buckets) {
+    for (auto hook = bucket; hook; hook = hook->next) {
+      auto const physical_address = static_cast<uint64_t>(hook->orig_pfn) << 12;
+      pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+      // hooked pages are always mapped by a PT in the main view
+      if (!get_ept_pte(ept, physical_address))
+        continue;
+
+      auto const pdpt = reinterpret_cast<ept_pdpte*>(
+        get_ept_exec_table(ept, ept.exec_pml4[addr.pml4_idx], false));
+      if (!pdpt)
+        return false;
+
+      auto const pd = reinterpret_cast<ept_pde*>(
+        get_ept_exec_table(ept, pdpt[addr.pdpt_idx], false));
+      if (!pd)
+        return false;
+
+      auto const pt = reinterpret_cast<ept_pte*>(
+        get_ept_exec_table(ept, pd[addr.pd_idx], true));
+      if (!pt)
+        return false;
+
+      // the copy is still made for inactive hooks so that their PTE can be
+      // modified in place once they become active
+      if (!hook->scope_active)
+        continue;
+
+      auto& pte = pt[addr.pt_idx];
+      pte.read_access       = 0;
+      pte.write_access      = 0;
+      pte.execute_access    = 1;
+      pte.page_frame_number = hook->exec_pfn;
     }
   }
-}
 
-// update the memory types in the EPT paging structures based on the MTRRs.
-// this function should only be called from root-mode during vmx-operation.
-void update_ept_memory_type(vcpu_ept_data& ept) {
-  // TODO: completely virtualize the guest MTRRs
-  auto const mtrrs = read_mtrr_data();
+  // get rid of any translations that were cached from the previous build
+  if (ept.invept_single_context) {
+    invept_descriptor desc = {};
+    desc.ept_pointer = get_ept_view_eptp(ept, true);
+    vmx_invept(invept_single_context, desc);
+  }
+  else
+    vmx_invept(invept_all_context, {});
 
-  for (size_t i = 0; i < ept_pd_count; ++i) {
-    for (size_t j = 0; j < 512; ++j) {
-      auto& pde = ept.pds_2mb[i][j];
+  ept.exec_view_stale = false;
 
-      // 2MB large page
-      if (pde.large_page) {
-        // update the memory type for this PDE
-        pde.memory_type = calc_mtrr_mem_type(mtrrs,
-          pde.page_frame_number << 21, 0x1000 << 9);
-      }
-      // PDE points to a PT
-      else {
-        auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
-          + (ept.pds[i][j].page_frame_number << 12));
+  ++ept.hook_stats.view_build_count;
+  ept.hook_stats.view_build_tsc += __rdtsc() - start_tsc;
 
-        // update the memory type for every PTE
-        for (size_t k = 0; k < 512; ++k) {
-          pt[k].memory_type = calc_mtrr_mem_type(mtrrs,
-            pt[k].page_frame_number << 12, 0x1000);
-        }
-      }
+  return true;
+}
+
+// switch the EPTP of the current vcpu to the main view or to the execute
+// view, rebuilding the execute view first if needed. returns false if the
+// execute view is disabled or couldn't be built.
+// this should only be called from root-mode.
+bool set_ept_view(vcpu_ept_data& ept, bool const exec) {
+  if (exec) {
+    if (!ept.exec_view_enabled)
+      return false;
+
+    if (ept.exec_view_stale && !build_ept_exec_view(ept)) {
+      // don't hold on to a partial copy
+      release_ept_exec_view(ept);
+      return false;
     }
   }
-}
 
-// set the memory type in every EPT paging structure to the specified value
-void set_ept_memory_type(vcpu_ept_data& ept, uint8_t const memory_type) {
-  for (size_t i = 0; i < ept_pd_count; ++i) {
-    for (size_t j = 0; j < 512; ++j) {
-      auto& pde = ept.pds_2mb[i][j];
+  // each view has its own EPTP, so cached translations don't need to be
+  // flushed when switching between them
+  vmx_vmwrite(VMCS_CTRL_EPT_POINTER, get_ept_view_eptp(ept, exec));
+  ept.exec_view_active = exec;
 
-      // 2MB large page
-      if (pde.large_page)
-        pde.memory_type = memory_type;
-      // PDE points to a PT
-      else {
-        auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
-          + (ept.pds[i][j].page_frame_number << 12));
+  return true;
+}
 
-        // update the memory type for every PTE
-        for (size_t k = 0; k < 512; ++k)
-          pt[k].memory_type = memory_type;
-      }
-    }
+// allow or disallow hooks to use the execute view on the current vcpu.
+// this should only be called from root-mode.
+void set_ept_exec_view_enabled(vcpu_ept_data& ept, bool const enabled) {
+  if (!enabled) {
+    set_ept_view(ept, false);
+    release_ept_exec_view(ept);
   }
+
+  ept.exec_view_enabled = enabled;
+  ept.exec_view_stale   = true;
 }
 
-// get the corresponding EPT PDPTE for a given physical address
-ept_pdpte* get_ept_pdpte(vcpu_ept_data& ept, uint64_t const physical_address) {
+// get the PTE that maps the specified physical address in the execute view.
+// this is only a copy for pages that have been hooked.
+ept_pte* get_ept_exec_view_pte(vcpu_ept_data& ept, uint64_t const physical_address) {
   pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
 
-  if (addr.pml4_idx != 0)
+  auto const& pml4e = ept.exec_pml4[addr.pml4_idx];
+  if (!is_ept_entry_present(pml4e.flags))
+    return nullptr;
+
+  auto const& pdpte = reinterpret_cast<ept_pdpte*>(host_physical_memory_base
+    + (pml4e.page_frame_number << 12))[addr.pdpt_idx];
+  if (!is_ept_entry_present(pdpte.flags) || is_ept_pdpte_1gb(pdpte))
     return nullptr;
 
-  if (addr.pdpt_idx >= ept_pd_count)
+  auto const& pde = reinterpret_cast<ept_pde*>(host_physical_memory_base
+    + (pdpte.page_frame_number << 12))[addr.pd_idx];
+  if (!is_ept_entry_present(pde.flags) ||
+      reinterpret_cast<ept_pde_2mb const&>(pde).large_page)
     return nullptr;
 
-  return &ept.pdpt[addr.pdpt_idx];
+  return &reinterpret_cast<ept_pte*>(host_physical_memory_base
+    + (pde.page_frame_number << 12))[addr.pt_idx];
 }
 
-// get the corresponding EPT PDE for a given physical address
-ept_pde* get_ept_pde(vcpu_ept_data& ept, uint64_t const physical_address) {
-  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+// invalidate the cached translations of both views, without causing the
+// execute view to be rebuilt. this is only safe when no paging structures
+// were added or removed. this should only be called from root-mode.
+void flush_ept_views(vcpu_ept_data& ept) {
+  if (!ept.invept_single_context) {
+    vmx_invept(invept_all_context, {});
+    return;
+  }
 
-  if (addr.pml4_idx != 0)
-    return nullptr;
+  invept_descriptor desc = {};
 
-  if (addr.pdpt_idx >= ept_pd_count)
-    return nullptr;
+  desc.ept_pointer = get_ept_view_eptp(ept, false);
+  vmx_invept(invept_single_context, desc);
 
-  return &ept.pds[addr.pdpt_idx][addr.pd_idx];
+  desc.ept_pointer = get_ept_view_eptp(ept, true);
+  vmx_invept(invept_single_context, desc);
 }
 
-// get the corresponding EPT PTE for a given physical address
-ept_pte* get_ept_pte(vcpu_ept_data& ept,
-    uint64_t const physical_address, bool const force_split) {
-  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+// start a new EPT transaction, discarding anything that was queued before
+void begin_ept_txn(vcpu_ept_data& ept) {
+  ept.txn.op_count = 0;
+  ept.txn.failed   = false;
+}
 
-  if (addr.pml4_idx != 0)
-    return nullptr;
+// queue a modification of every PTE in the specified physical range. the
+// PDEs are split right away (unless the op allows large pages and covers
+// them), and the transaction fails if that isn't possible.
+bool queue_ept_txn_op(vcpu_ept_data& ept, ept_txn_op const& op) {
+  auto& txn = ept.txn;
 
-  if (addr.pdpt_idx >= ept_pd_count)
-    return nullptr;
+  if (txn.failed)
+    return false;
 
-  auto& pde_2mb = ept.pds_2mb[addr.pdpt_idx][addr.pd_idx];
+  if (txn.op_count >= txn.capacity) {
+    txn.failed = true;
+    return false;
+  }
 
-  if (pde_2mb.large_page) {
-    if (!force_split)
-      return nullptr;
+  // the op is added before splitting so that a partial split gets merged
+  // again when the transaction is rolled back
+  auto& queued = txn.ops[txn.op_count++];
+  queued       = op;
+  queued.start = op.start & ~0xFFFull;
+  queued.size  = ((op.start + op.size + 0xFFF) & ~0xFFFull) - queued.start;
+
+  for (auto addr = queued.start; addr < queued.start + queued.size;) {
+    if (queued.large_pages) {
+      if (auto const page_size = prepare_ept_txn_large_page(ept, queued, addr)) {
+        addr += page_size;
+        continue;
+      }
+    }
 
-    split_ept_pde(ept, &pde_2mb);
+    if (!get_ept_pte(ept, addr, true)) {
+      txn.failed = true;
+      return false;
+    }
 
-    // failed to split the PDE
-    if (pde_2mb.large_page)
-      return nullptr;
+    addr += 0x1000;
   }
 
-  auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
-    + (ept.pds[addr.pdpt_idx][addr.pd_idx].page_frame_number << 12));
+  return true;
+}
 
-  return &pt[addr.pt_idx];
+// apply every queued modification and flush the EPT once. if anything failed
+// to be queued, nothing is applied and the PDEs that were split are merged.
+bool commit_ept_txn(vcpu_ept_data& ept) {
+  auto& txn = ept.txn;
+
+  // roll back by getting rid of any paging structures that aren't needed anymore
+  if (txn.failed) {
+    for (size_t i = 0; i < txn.op_count; ++i) {
+      merge_ept_range(ept, txn.ops[i].start, txn.ops[i].size);
+      release_private_ept_range(ept, txn.ops[i].start, txn.ops[i].size);
+    }
+
+    txn.op_count = 0;
+    return false;
+  }
+
+  for (size_t i = 0; i < txn.op_count; ++i) {
+    auto const& op = txn.ops[i];
+
+    for (auto addr = op.start; addr < op.start + op.size;) {
+      uint64_t page_size = 0x1000;
+      auto const pte = get_private_ept_leaf(ept, addr, page_size);
+
+      // this should NOT fail since everything was split or made private
+      // when queueing. large pages are only ever modified as a whole.
+      if (!pte || (page_size > 0x1000 && (!op.large_pages ||
+          (addr & (page_size - 1)) != 0 || addr + page_size > op.start + op.size))) {
+        addr += 0x1000;
+        continue;
+      }
+
+      // large pages always identity-map their memory, so they never match
+      if (op.match_pfn && (page_size > 0x1000 || pte->page_frame_number != op.pfn)) {
+        addr += page_size;
+        continue;
+      }
+
+      auto const access = get_ept_txn_access(ept, op, addr, page_size);
+
+      if (op.execute_only) {
+        pte->execute_access = (access & mmr_memory_mode_x) != 0;
+        addr += page_size;
+        continue;
+      }
+
+      if (!op.keep_permissions) {
+        pte->read_access    = (access & mmr_memory_mode_r) != 0;
+        pte->execute_access = (access & mmr_memory_mode_x) != 0;
+        set_ept_write_access(ept, *pte, (access & mmr_memory_mode_w) != 0);
+      }
+
+      // large pages always identity-map their memory
+      if (page_size == 0x1000) {
+        if (op.remap == ept_txn_remap_identity)
+          pte->page_frame_number = addr >> 12;
+        else if (op.remap == ept_txn_remap_fixed)
+          pte->page_frame_number = op.pfn;
+      }
+
+      addr += page_size;
+    }
+
+    // get rid of the paging structures if they aren't needed anymore
+    if (op.remap == ept_txn_remap_identity || op.large_pages || op.execute_only) {
+      merge_ept_range(ept, op.start, op.size);
+      release_private_ept_range(ept, op.start, op.size);
+    }
+  }
+
+  txn.op_count = 0;
+
+  flush_ept(ept);
+
+  return true;
 }
 
-// split a 2MB EPT PDE so that it points to an EPT PT
-void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* const pde_2mb) {
-  // this PDE is already split
-  if (!pde_2mb->large_page)
-    return;
+// get the hook directory bucket that a PFN belongs to
+static vcpu_ept_hook_node*& ept_hook_bucket(vcpu_ept_data& ept, uint64_t const pfn) {
+  // fibonacci hashing spreads out PFNs that are close to each other (i.e.
+  // a bunch of pages in the same image) across the whole directory
+  auto const hash = (pfn * 0x9E3779B97F4A7C15ull) >> 32;
+  return ept.hooks.buckets[hash & (ept.hooks.bucket_count - 1)];
+}
 
-  // no available free pages
-  if (ept.num_used_free_pages >= ept_free_page_count)
-    return;
+// get the txn op that hooks or unhooks a page. only the execute permission
+// is touched, so that hidden and MMR pages stay the way they are.
+static ept_txn_op get_ept_hook_txn_op(uint64_t const original_page_pfn, bool const hooked) {
+  ept_txn_op op = {};
+  op.start           = original_page_pfn << 12;
+  op.size            = 0x1000;
+  op.remap           = ept_txn_remap_none;
+  op.execute_access  = !hooked;
+  op.mmr_permissions = 1;
+  op.execute_only    = 1;
+  return op;
+}
 
-  // allocate a free page for the PT
-  auto const pt_pfn = ept.free_page_pfns[ept.num_used_free_pages];
-  auto const pt = reinterpret_cast<ept_pte*>(
-    &ept.free_pages[ept.num_used_free_pages]);
-  ++ept.num_used_free_pages;
+// take a node from the free list and insert it into the hook directory
+static vcpu_ept_hook_node* link_ept_hook_node(vcpu_ept_data& ept,
+    uint64_t const original_page_pfn, uint64_t const executable_page_pfn) {
+  // remove a hook node from the free list
+  auto const hook_node = ept.hooks.free_list_head;
+  ept.hooks.free_list_head = hook_node->next;
 
-  for (size_t i = 0; i < 512; ++i) {
-    auto& pte = pt[i];
-    pte.flags = 0;
+  // insert the hook node into its directory bucket
+  auto& bucket = ept_hook_bucket(ept, original_page_pfn);
+  hook_node->next = bucket;
+  bucket = hook_node;
 
-    // copy the parent PDE flags
-    pte.read_access             = pde_2mb->read_access;
-    pte.write_access            = pde_2mb->write_access;
-    pte.execute_access          = pde_2mb->execute_access;
-    pte.memory_type             = pde_2mb->memory_type;
-    pte.ignore_pat              = pde_2mb->ignore_pat;
-    pte.accessed                = pde_2mb->accessed;
-    pte.dirty                   = pde_2mb->dirty;
-    pte.user_mode_execute       = pde_2mb->user_mode_execute;
-    pte.verify_guest_paging     = pde_2mb->verify_guest_paging;
-    pte.paging_write_access     = pde_2mb->paging_write_access;
-    pte.supervisor_shadow_stack = pde_2mb->supervisor_shadow_stack;
-    pte.suppress_ve             = pde_2mb->suppress_ve;
-    pte.page_frame_number       = (pde_2mb->page_frame_number << 9) + i;
+  ++ept.hooks.active_count;
+
+  // initialize the hook node
+  hook_node->orig_pfn          = static_cast<uint32_t>(original_page_pfn);
+  hook_node->exec_pfn          = static_cast<uint32_t>(executable_page_pfn);
+  hook_node->exit_count        = 0;
+  hook_node->flip_count        = 0;
+  hook_node->window_start_tsc  = __rdtsc();
+  hook_node->window_exit_count = 0;
+  hook_node->hot               = false;
+  hook_node->scope_count       = 0;
+  hook_node->scope_active      = true;
+
+  return hook_node;
+}
+
+// loads of the System CR3 normally don't cause vm-exits, but every address
+// space switch has to be seen while any hook is scoped, or System threads
+// would keep the hook state of the previous process
+static void update_cr3_target_count(vcpu_ept_data const& ept) {
+  vmx_vmwrite(VMCS_CTRL_CR3_TARGET_COUNT, ept.hooks.scoped_count > 0 ? 0 : 1);
+}
+
+// remove a hook from the list of scoped hooks, if it is in there
+static void unlink_scoped_ept_hook(vcpu_ept_data& ept, vcpu_ept_hook_node const& hook) {
+  auto& hooks = ept.hooks;
+
+  for (size_t i = 0; i < hooks.scoped_count; ++i) {
+    if (hooks.scoped[i] == &hook) {
+      hooks.scoped[i] = hooks.scoped[--hooks.scoped_count];
+
+      if (hooks.scoped_count == 0)
+        update_cr3_target_count(ept);
+
+      return;
+    }
   }
+}
 
-  auto const pde         = reinterpret_cast<ept_pde*>(pde_2mb);
-  pde->flags             = 0;
-  pde->read_access       = 1;
-  pde->write_access      = 1;
-  pde->execute_access    = 1;
-  pde->user_mode_execute = 1;
-  pde->page_frame_number = pt_pfn;
+// remove a node from the hook directory and give it back to the free list.
+// returns false if the page isn't hooked.
+static bool unlink_ept_hook_node(vcpu_ept_data& ept, uint64_t const original_page_pfn) {
+  // search the bucket for the link that points to the target node
+  auto link = &ept_hook_bucket(ept, original_page_pfn);
+  while (*link && (*link)->orig_pfn != original_page_pfn)
+    link = &(*link)->next;
+
+  // this page isn't hooked
+  if (!*link)
+    return false;
+
+  auto const hook_node = *link;
+
+  unlink_scoped_ept_hook(ept, *hook_node);
+
+  // remove from the directory
+  *link = hook_node->next;
+  --ept.hooks.active_count;
+
+  // add to the free list
+  hook_node->next = ept.hooks.free_list_head;
+  ept.hooks.free_list_head = hook_node;
+
+  return true;
 }
 
 // memory read/written will use the original page while code
@@ -233,104 +2074,260 @@ void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* const pde_2mb) {
 bool install_ept_hook(vcpu_ept_data& ept,
     uint64_t const original_page_pfn,
     uint64_t const executable_page_pfn) {
+  // an instruction fetch to this physical address will trigger an
+  // ept-violation vm-exit where the real "meat" of the ept hook is
+  auto const op = get_ept_hook_txn_op(original_page_pfn, true);
+
+  // this page is already hooked, just update the executable page
+  if (auto const existing = find_ept_hook(ept, original_page_pfn)) {
+    existing->exec_pfn = static_cast<uint32_t>(executable_page_pfn);
+
+    // the new executable page is used once the hook becomes active again
+    if (!existing->scope_active)
+      return true;
+
+    // make sure the next instruction fetch causes an ept-violation so that
+    // the new executable page actually gets used
+    begin_ept_txn(ept);
+    queue_ept_txn_op(ept, op);
+    commit_ept_txn(ept);
+
+    return true;
+  }
+
   // we ran out of EPT hooks :(
   if (!ept.hooks.free_list_head)
     return false;
 
-  // get the EPT PTE, and possible split an existing PDE if needed
-  auto const pte = get_ept_pte(ept, original_page_pfn << 12, true);
-  if (!pte)
+  // this will split the PDE if needed
+  begin_ept_txn(ept);
+  if (!queue_ept_txn_op(ept, op)) {
+    commit_ept_txn(ept);
     return false;
+  }
 
-  // remove a hook node from the free list
-  auto const hook_node = ept.hooks.free_list_head;
-  ept.hooks.free_list_head = hook_node->next;
+  link_ept_hook_node(ept, original_page_pfn, executable_page_pfn);
 
-  // insert the hook node into the active list
-  hook_node->next = ept.hooks.active_list_head;
-  ept.hooks.active_list_head = hook_node;
+  return commit_ept_txn(ept);
+}
 
-  // initialize the hook node
-  hook_node->orig_pfn = static_cast<uint32_t>(original_page_pfn);
-  hook_node->exec_pfn = static_cast<uint32_t>(executable_page_pfn);
+// install a set of EPT hooks with a single EPT commit. nothing is installed
+// if any of the pages is already hooked or if there aren't enough hook nodes.
+bool install_ept_hooks(vcpu_ept_data& ept, uint64_t const* const original_page_pfns,
+    uint64_t const* const executable_page_pfns, size_t const count) {
+  if (ept.hooks.active_count + count > ept.hooks.capacity)
+    return false;
 
-  // an instruction fetch to this physical address will now trigger
-  // an ept-violation vm-exit where the real "meat" of the ept hook is
-  pte->execute_access = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (find_ept_hook(ept, original_page_pfns[i]))
+      return false;
+  }
 
-  vmx_invept(invept_all_context, {});
+  // every PDE is split before anything is modified
+  begin_ept_txn(ept);
 
-  return true;
+  for (size_t i = 0; i < count; ++i) {
+    if (!queue_ept_txn_op(ept, get_ept_hook_txn_op(original_page_pfns[i], true))) {
+      commit_ept_txn(ept);
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i)
+    link_ept_hook_node(ept, original_page_pfns[i], executable_page_pfns[i]);
+
+  return commit_ept_txn(ept);
 }
 
 // remove an EPT hook that was installed with install_ept_hook()
 void remove_ept_hook(vcpu_ept_data& ept, uint64_t const original_page_pfn) {
-  if (!ept.hooks.active_list_head)
+  if (!unlink_ept_hook_node(ept, original_page_pfn))
     return;
 
-  // the head is the target node
-  if (ept.hooks.active_list_head->orig_pfn == original_page_pfn) {
-    auto const new_head = ept.hooks.active_list_head->next;
+  // restore original EPT page attributes
+  begin_ept_txn(ept);
+  queue_ept_txn_op(ept, get_ept_hook_txn_op(original_page_pfn, false));
+  commit_ept_txn(ept);
+}
+
+// remove a set of EPT hooks with a single EPT commit
+void remove_ept_hooks(vcpu_ept_data& ept,
+    uint64_t const* const original_page_pfns, size_t const count) {
+  begin_ept_txn(ept);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (unlink_ept_hook_node(ept, original_page_pfns[i]))
+      queue_ept_txn_op(ept, get_ept_hook_txn_op(original_page_pfns[i], false));
+  }
+
+  commit_ept_txn(ept);
+}
+
+// find the EPT hook for the specified PFN
+vcpu_ept_hook_node* find_ept_hook(vcpu_ept_data& ept,
+    uint64_t const original_page_pfn) {
+  // buckets are usually only a single node long
+  for (auto curr = ept_hook_bucket(ept, original_page_pfn); curr; curr = curr->next) {
+    if (curr->orig_pfn == original_page_pfn)
+      return curr;
+  }
+
+  return nullptr;
+}
+
+// check whether a hook is active in the address space of the specified CR3
+static bool is_ept_hook_in_scope(vcpu_ept_hook_node const& hook, uint64_t const cr3_pfn) {
+  if (hook.scope_count == 0)
+    return true;
+
+  for (size_t i = 0; i < hook.scope_count; ++i) {
+    if (hook.scope_cr3_pfns[i] == cr3_pfn)
+      return true;
+  }
+
+  return false;
+}
+
+// modify the EPT entries of a hook so that it is active or inactive. returns
+// true if paging structures had to be added, in which case the whole EPT
+// needs to be flushed instead of only the cached translations.
+static bool set_ept_hook_active(vcpu_ept_data& ept,
+    vcpu_ept_hook_node& hook, bool const active) {
+  auto const physical_address = static_cast<uint64_t>(hook.orig_pfn) << 12;
+
+  hook.scope_active = active;
+
+  bool split = false;
+  auto pte = get_ept_pte(ept, physical_address);
+
+  // the PT might have been merged into a 2MB page while the hook was inactive
+  if (!pte && active) {
+    pte   = get_ept_pte(ept, physical_address, true);
+    split = true;
+  }
+
+  if (pte) {
+    auto op = get_ept_hook_txn_op(hook.orig_pfn, active);
 
-    // add to the free list
-    ept.hooks.active_list_head->next = ept.hooks.free_list_head;
-    ept.hooks.free_list_head = ept.hooks.active_list_head;
+    // the PTE was flipped to the executable page by an ept-violation, so
+    // the original page has to be mapped back in with the permissions that
+    // the MMRs on it allow
+    if (pte->page_frame_number == hook.exec_pfn) {
+      op.read_access  = 1;
+      op.write_access = 1;
 
-    // remove from the active list
-    ept.hooks.active_list_head = new_head;
-  } else {
-    auto prev = ept.hooks.active_list_head;
+      auto const access = get_ept_txn_access(ept, op, physical_address, 0x1000);
 
-    // search for the node BEFORE the target node (prev if this was doubly)
-    while (prev->next) {
-      if (prev->next->orig_pfn == original_page_pfn)
-        break;
+      pte->read_access       = (access & mmr_memory_mode_r) != 0;
+      pte->page_frame_number = hook.orig_pfn;
 
-      prev = prev->next;
+      set_ept_write_access(ept, *pte, (access & mmr_memory_mode_w) != 0);
     }
 
-    if (!prev->next)
-      return;
+    // otherwise only the execute bit changes, the same way as when the hook
+    // is installed, so that hidden and MMR pages stay the way they are
+    auto const access = get_ept_txn_access(ept, op, physical_address, 0x1000);
+    pte->execute_access = (access & mmr_memory_mode_x) != 0;
+  }
+
+  // a stale execute view is rebuilt from scratch before it is used again
+  if (!ept.exec_view_stale) {
+    if (auto const exec_pte = get_ept_exec_view_pte(ept, physical_address)) {
+      if (active) {
+        exec_pte->read_access       = 0;
+        exec_pte->write_access      = 0;
+        exec_pte->execute_access    = 1;
+        exec_pte->page_frame_number = hook.exec_pfn;
+      }
+      // an inactive hook looks the same in both views
+      else if (pte)
+        exec_pte->flags = pte->flags;
+
+      // writes are redirected to the main view, where dirty pages are tracked
+      if (ept.dirty_logging || ept.snapshot_protected)
+        exec_pte->write_access = 0;
+    }
+  }
+
+  return split;
+}
+
+// limit an EPT hook to the address spaces of the specified CR3 PFNs, or make
+// it global again if the count is 0. the hook is immediately (de)activated
+// for the current CR3. this should only be called from root-mode.
+bool set_ept_hook_scope(vcpu_ept_data& ept, uint64_t const original_page_pfn,
+    uint64_t const* const cr3_pfns, size_t const count, uint64_t const current_cr3_pfn) {
+  auto const hook = find_ept_hook(ept, original_page_pfn);
+  if (!hook || count > ept_hook_max_scopes)
+    return false;
+
+  auto& hooks = ept.hooks;
 
-    auto const new_next = prev->next->next;
+  if (count == 0)
+    unlink_scoped_ept_hook(ept, *hook);
+  else if (hook->scope_count == 0) {
+    // too many scoped hooks on this vcpu
+    if (hooks.scoped_count >= hooks.scoped_capacity)
+      return false;
 
-    // add to the free list
-    prev->next->next = ept.hooks.free_list_head;
-    ept.hooks.free_list_head = prev->next;
+    hooks.scoped[hooks.scoped_count++] = hook;
 
-    // remove from the active list
-    prev->next = new_next;
+    if (hooks.scoped_count == 1)
+      update_cr3_target_count(ept);
   }
 
-  auto const pte = get_ept_pte(ept, original_page_pfn << 12, false);
+  for (size_t i = 0; i < count; ++i)
+    hook->scope_cr3_pfns[i] = cr3_pfns[i];
 
-  // this should NOT fail
-  if (!pte)
-    return;
+  hook->scope_count = static_cast<uint32_t>(count);
 
-  // restore original EPT page attributes
-  pte->read_access       = 1;
-  pte->write_access      = 1;
-  pte->execute_access    = 1;
-  pte->page_frame_number = original_page_pfn;
+  if (set_ept_hook_active(ept, *hook, is_ept_hook_in_scope(*hook, current_cr3_pfn)))
+    flush_ept(ept);
+  else
+    flush_ept_views(ept);
 
-  vmx_invept(invept_all_context, {});
+  return true;
 }
 
-// find the EPT hook for the specified PFN
-vcpu_ept_hook_node* find_ept_hook(vcpu_ept_data& ept,
-    uint64_t const original_page_pfn) {
-  // TODO:
-  //   maybe use a more optimal data structure to handle a large
-  //   amount of EPT hooks?
+// activate or deactivate every scoped EPT hook after the guest loaded a new
+// CR3. this should only be called from root-mode.
+void update_ept_hook_scopes(vcpu_ept_data& ept, uint64_t const cr3_pfn) {
+  bool changed = false, split = false;
 
-  // linear search through the active hook list
-  for (auto curr = ept.hooks.active_list_head; curr; curr = curr->next) {
-    if (curr->orig_pfn == original_page_pfn)
-      return curr;
+  for (size_t i = 0; i < ept.hooks.scoped_count; ++i) {
+    auto& hook = *ept.hooks.scoped[i];
+
+    // most address space switches don't affect any hook
+    auto const active = is_ept_hook_in_scope(hook, cr3_pfn);
+    if (active == hook.scope_active)
+      continue;
+
+    split  |= set_ept_hook_active(ept, hook, active);
+    changed = true;
   }
 
-  return nullptr;
+  if (split)
+    flush_ept(ept);
+  else if (changed)
+    flush_ept_views(ept);
+}
+
+// count an ept-violation that was caused by an EPT hook and update whether
+// the hook is hot
+void record_ept_hook_exit(vcpu_ept_hook_node& hook) {
+  auto const tsc = __rdtsc();
+
+  // a hook stays hot for as long as every window has enough exits
+  if (tsc - hook.window_start_tsc > ept_hook_hot_window_tsc) {
+    hook.hot               = hook.window_exit_count >= ept_hook_hot_exit_count;
+    hook.window_start_tsc  = tsc;
+    hook.window_exit_count = 0;
+  }
+
+  ++hook.exit_count;
+
+  if (++hook.window_exit_count >= ept_hook_hot_exit_count)
+    hook.hot = true;
 }
 
 } // namespace hv
@@ -2,120 +2,498 @@
 
 #include <ia32.hpp>
 
+#include "spin-lock.h"
+#include "mmr.h"
+
 namespace hv {
 
 struct vcpu;
 
-// number of PDs in the EPT paging structures
-inline constexpr size_t ept_pd_count = 512;
-inline constexpr size_t ept_free_page_count = 100;
+// number of pages that are added to the EPT page pool for every vcpu
+inline constexpr size_t ept_pool_pages_per_vcpu = 100;
+
+// number of pages in the shadow page arena (the executable side of EPT hooks)
+inline constexpr size_t ept_shadow_arena_page_count = 512;
+
+// maximum number of paging structures that a vcpu's execute view can copy
+inline constexpr size_t ept_exec_view_max_tables = 64;
+
+// an EPT hook becomes hot once it causes this many ept-violations within a
+// single window (which is roughly a second on most processors)
+inline constexpr uint32_t ept_hook_hot_exit_count = 1000;
+inline constexpr uint64_t ept_hook_hot_window_tsc = 1ull << 31;
+
+// maximum number of address spaces that a single EPT hook can be scoped to
+inline constexpr size_t ept_hook_max_scopes = 4;
+
+// number of EPT hook groups, and the maximum number of pages in each group
+inline constexpr size_t ept_hook_group_count     = 16;
+inline constexpr size_t ept_hook_group_max_pages = 64;
+
+// ignored bit in leaf EPT entries that marks pages whose write access is
+// withheld by a memory snapshot until the page has been copied
+inline constexpr uint64_t ept_snapshot_bit = 11;
+
+// pages that are used for EPT paging structures (such as the PTs that are
+// created when splitting a 2MB PDE). this is shared between every vcpu, and
+// pages are given back to the pool when a PT is merged back into a 2MB PDE.
+struct ept_page_pool {
+  spin_lock lock;
+
+  // the memory that backs this pool
+  uint8_t* pages;
+  size_t page_count;
+
+  // stack of PFNs that are currently unused
+  uint64_t* free_pfns;
+  size_t free_count;
+};
 
-// max number of MMRs
-inline constexpr size_t ept_mmr_count = 100;
+// physically contiguous pages that hold the executable copies of hooked
+// pages. the hypervisor allocates these in root-mode so that clients don't
+// need to allocate, lock, and copy a page for every hook themselves.
+struct ept_shadow_arena {
+  spin_lock lock;
+
+  // the memory that backs this arena
+  uint8_t* pages;
+  uint64_t base_pfn;
+
+  // bitmap of pages that are currently in use
+  uint64_t used[ept_shadow_arena_page_count / 64];
+  size_t used_count;
+};
 
 struct vcpu_ept_hook_node {
+  // next node in the same directory bucket (or in the free list)
   vcpu_ept_hook_node* next;
 
   // these can be stored as 32-bit integers to conserve space since
   // nobody is going to have more than 16,000 GB of physical memory
   uint32_t orig_pfn;
   uint32_t exec_pfn;
+
+  // number of ept-violations that were caused by this hook, and how many
+  // of them switched between the original and the executable page
+  uint64_t exit_count;
+  uint64_t flip_count;
+
+  // ept-violations in the current window, used to detect thrashing
+  uint64_t window_start_tsc;
+  uint32_t window_exit_count;
+
+  // hot hooks let code in the hooked page read the executable page for a
+  // single instruction, instead of flipping back to the original page
+  bool hot;
+
+  // CR3 PFNs of the address spaces that this hook is limited to. a hook
+  // without any scope is active in every address space.
+  uint64_t scope_cr3_pfns[ept_hook_max_scopes];
+  uint32_t scope_count;
+
+  // whether the current guest CR3 is in scope. inactive hooks leave the
+  // original page fully accessible so that it runs at native speed.
+  bool scope_active;
+};
+
+// a set of EPT hooks that is built up-front and then activated or
+// deactivated as a whole, with a single EPT commit on every vcpu
+struct ept_hook_group {
+  uint64_t orig_pfns[ept_hook_group_max_pages];
+  uint64_t exec_pfns[ept_hook_group_max_pages];
+
+  // number of pages in the group, a value of 0 indicates that this group isn't being used
+  size_t page_count;
+
+  // whether the hooks are currently installed
+  bool active;
 };
 
-// TODO: refactor this to just use an array instead of a linked list
+// EPT hooks are stored in a hash directory that is keyed by the original
+// PFN so that the ept-violation handler can find a hook in O(1) time.
 struct vcpu_ept_hooks {
   // buffer of nodes (there can be unused nodes in the middle
   // of the buffer if a hook was removed for example)
-  static constexpr size_t capacity = 64;
+  static constexpr size_t capacity = 1024;
   vcpu_ept_hook_node buffer[capacity];
 
-  // list of currently active EPT hooks
-  vcpu_ept_hook_node* active_list_head;
+  // each bucket is a list of active hooks whose PFN hashes to that bucket
+  static constexpr size_t bucket_count = 1024;
+  static_assert((bucket_count & (bucket_count - 1)) == 0,
+    "EPT hook bucket count must be a power of two!");
+  vcpu_ept_hook_node* buckets[bucket_count];
 
   // list of unused nodes
   vcpu_ept_hook_node* free_list_head;
+
+  // number of currently active EPT hooks
+  size_t active_count;
+
+  // hooks that are scoped to specific address spaces, which need to be
+  // re-evaluated whenever the guest loads a new CR3
+  static constexpr size_t scoped_capacity = 64;
+  vcpu_ept_hook_node* scoped[scoped_capacity];
+  size_t scoped_count;
 };
 
-// TODO: make this a bitfield instead
-enum mmr_memory_mode {
-  mmr_memory_mode_r = 0b001,
-  mmr_memory_mode_w = 0b010,
-  mmr_memory_mode_x = 0b100
+// counters for comparing the cost of the two ways that an EPT hook can
+// switch between its original page and its executable page
+struct ept_hook_stats {
+  // EPTP switches between the main view and the execute view
+  uint64_t view_switch_count;
+  uint64_t view_switch_tsc;
+
+  // PTE modifications, which are used when the execute view is disabled
+  // or can't be built
+  uint64_t pte_flip_count;
+  uint64_t pte_flip_tsc;
+
+  // rebuilds of the execute view after the main view was modified
+  uint64_t view_build_count;
+  uint64_t view_build_tsc;
 };
 
-// monitored memory ranges
-struct vcpu_ept_mmr_entry {
-  // start physical address
+// identity map that is shared between every vcpu. a vcpu that needs to
+// modify part of it (to split a PDE, for example) gets a private copy of the
+// PDPT and PD from the EPT page pool, while everything else stays shared.
+// only RAM is mapped up-front, everything else is mapped on-demand.
+struct ept_identity_map {
+  // EPT PML4 - every vcpu's PML4 points to the same PDPTs as this one
+  alignas(0x1000) ept_pml4e pml4[512];
+
+  // lock that is held while adding entries to the identity map from root-mode
+  spin_lock lock;
+
+  // memory for the paging structures that map RAM (entries that are
+  // added later are allocated from the EPT page pool instead)
+  uint8_t* table_pages;
+  size_t table_page_count;
+  size_t used_table_page_count;
+};
+
+// how the PFN of each PTE is modified by an EPT transaction op
+enum ept_txn_remap_mode : uint8_t {
+  // keep the PFN that the PTE currently points to
+  ept_txn_remap_none,
+
+  // point the PTE back to the page that it identity-maps
+  ept_txn_remap_identity,
+
+  // point every PTE in the range to the same PFN
+  ept_txn_remap_fixed
+};
+
+// a modification of every PTE in a physical memory range
+struct ept_txn_op {
+  // page-aligned physical address and size of the range
   uint64_t start;
+  uint64_t size;
+
+  // only used with ept_txn_remap_fixed and match_pfn
+  uint64_t pfn;
+  ept_txn_remap_mode remap;
+
+  // the new PTE permissions
+  uint8_t read_access    : 1;
+  uint8_t write_access   : 1;
+  uint8_t execute_access : 1;
+
+  // if set, the permissions above are further restricted by the combined
+  // mode of every MMR that overlaps each page
+  uint8_t mmr_permissions : 1;
 
-  // size of the range in bytes, a value of 0 indicates that this entry isn't being used
-  uint32_t size;
+  // if set, 2MB and 1GB pages that are completely covered by the range are
+  // modified as a whole instead of being split. this can't be used with
+  // ept_txn_remap_fixed.
+  uint8_t large_pages : 1;
 
-  // the memory access type that we are monitoring for
-  uint8_t mode;
+  // if set, only the execute permission is modified and the PFN, as well
+  // as the read and write permissions, are left as they are
+  uint8_t execute_only : 1;
+
+  // if set, only the PFN is modified and the permissions are left as they are
+  uint8_t keep_permissions : 1;
+
+  // if set, only PTEs that currently point to pfn are modified. this is
+  // used with ept_txn_remap_identity to undo ept_txn_remap_fixed.
+  uint8_t match_pfn : 1;
 };
 
-struct vcpu_ept_data {
-  // EPT PML4
-  alignas(0x1000) ept_pml4e pml4[512];
+// a batch of EPT modifications that are applied all at once
+struct ept_txn {
+  static constexpr size_t capacity = 128;
+  ept_txn_op ops[capacity];
 
-  // EPT PDPT - a single one covers 512GB of physical memory
-  alignas(0x1000) ept_pdpte pdpt[512];
-  static_assert(ept_pd_count <= 512, "Only 512 EPT PDs are supported!");
+  // number of ops that have been queued
+  size_t op_count;
 
-  // an array of EPT PDs - each PD covers 1GB
-  union {
-    alignas(0x1000) ept_pde     pds[ept_pd_count][512];
-    alignas(0x1000) ept_pde_2mb pds_2mb[ept_pd_count][512];
-  };
+  // set if an op couldn't be queued, in which case nothing is applied
+  bool failed;
+};
 
-  // free pages that can be used to split PDEs or for other purposes
-  alignas(0x1000) uint8_t free_pages[ept_free_page_count][0x1000];
+struct vcpu_ept_data {
+  // EPT PML4 - each PML4E points to either a shared PDPT or
+  // to a private copy that was allocated from the EPT page pool
+  alignas(0x1000) ept_pml4e pml4[512];
 
   // a dummy page that hidden pages are pointed to
   alignas(0x1000) uint8_t dummy_page[0x1000];
   uint64_t dummy_page_pfn;
 
-  // an array of PFNs that point to each free page in the free page array
-  uint64_t free_page_pfns[ept_free_page_count];
-
-  // # of free pages that are currently in use
-  size_t num_used_free_pages;
-
   // EPT hooks
   vcpu_ept_hooks hooks;
 
-  // monitored memory ranges
-  vcpu_ept_mmr_entry mmr[ept_mmr_count];
+  // monitored memory ranges, which live in the MMR pool
+  vcpu_ept_mmrs* mmrs;
+
+  // access counts of the MMRs that aggregate instead of logging, or null
+  // if profiling is disabled
+  vcpu_mmr_profile* mmr_profile;
+
+  // events of the MMRs that trace instead of logging, or null if tracing
+  // is disabled
+  vcpu_mmr_trace* mmr_trace;
 
   // PTE of the page that we should re-enable memory monitoring on
   ept_pte* mmr_mtf_pte;
   uint8_t  mmr_mtf_mode;
+
+  // TSC at which the page above is re-protected if it was left accessible
+  // for an access window, or 0 if it is re-protected after one instruction
+  uint64_t mmr_window_deadline;
+
+  // PTE of a hot hook that was made readable for a single instruction, and
+  // whether it belongs to the execute view
+  ept_pte* hook_mtf_pte;
+  bool     hook_mtf_exec_view;
+
+  // the transaction that is currently being built
+  ept_txn txn;
+
+  // PML4 of the execute view, which is only used while executing code in a
+  // hooked page. it points to the same paging structures as the main view,
+  // except for the ones that lead to a hooked page, which are copied so
+  // that hooked pages can map their executable page instead.
+  alignas(0x1000) ept_pml4e exec_pml4[512];
+
+  // physical addresses of the PML4 of each view
+  uint64_t pml4_pfn;
+  uint64_t exec_pml4_pfn;
+
+  // paging structures (from the EPT page pool) that the execute view copied
+  uint64_t exec_view_tables[ept_exec_view_max_tables];
+  size_t exec_view_table_count;
+
+  // whether hooks switch to the execute view instead of modifying their PTE
+  bool exec_view_enabled;
+
+  // whether the execute view is currently in the EPTP
+  bool exec_view_active;
+
+  // whether the main view was modified after the execute view was built
+  bool exec_view_stale;
+
+  ept_hook_stats hook_stats;
+
+  // whether INVEPT can be used to only flush this vcpu's EPT context
+  bool invept_single_context;
+
+  // the EPT accessed and dirty flags are enabled in the EPTP while either
+  // of these are set
+  bool dirty_logging;
+  bool access_sampling;
+
+  // whether RAM is write-protected for a memory snapshot. write access that
+  // is given to a page while this is set is withheld until it is copied.
+  bool snapshot_protected;
 };
 
-// identity-map the EPT paging structures
-void prepare_ept(vcpu_ept_data& ept);
+// called with every dirty range that collect_ept_dirty_pages() finds
+using ept_dirty_range_fn = void(*)(uint64_t physical_address, uint64_t size, void* ctx);
+
+// called with every 2MB region that collect_ept_accessed_regions() finds.
+// pages is a bitmap of the 4KB pages that were accessed, or null if the
+// region isn't mapped by a PT (in which case only the region is known).
+using ept_accessed_region_fn = void(*)(uint64_t physical_address,
+  uint64_t const* pages, void* ctx);
+
+// allocate the memory for the EPT page pool
+bool create_ept_page_pool(ept_page_pool& pool, size_t page_count);
+
+// free the memory that was allocated with create_ept_page_pool()
+void destroy_ept_page_pool(ept_page_pool& pool);
+
+// allocate a zero-initialized page from the EPT page pool. 0 is returned if
+// the pool is empty. this function should only be called from root-mode.
+uint64_t alloc_ept_page(ept_page_pool& pool);
+
+// return a page to the EPT page pool
+void free_ept_page(ept_page_pool& pool, uint64_t pfn);
+
+// allocate the memory for the shadow page arena
+bool create_ept_shadow_arena(ept_shadow_arena& arena);
+
+// free the memory that was allocated with create_ept_shadow_arena()
+void destroy_ept_shadow_arena(ept_shadow_arena& arena);
+
+// allocate a page from the shadow page arena. the contents of the page are
+// undefined, and 0 is returned if the arena is full.
+uint64_t alloc_ept_shadow_page(ept_shadow_arena& arena);
+
+// return a page to the shadow page arena. false is returned if the page
+// doesn't belong to the arena or isn't in use.
+bool free_ept_shadow_page(ept_shadow_arena& arena, uint64_t pfn);
+
+// identity-map the shared EPT paging structures. only physical memory
+// that is backed by RAM is mapped here, while everything else (such as
+// MMIO) is mapped on-demand by map_missing_ept_entry().
+bool prepare_ept_identity_map(ept_identity_map& map);
+
+// free the memory that was allocated by prepare_ept_identity_map()
+void destroy_ept_identity_map(ept_identity_map& map);
+
+// initialize the EPT data for a single vcpu
+void prepare_ept(vcpu_ept_data& ept, size_t vcpu_idx);
 
 // update the memory types in the EPT paging structures based on the MTRRs.
 // this function should only be called from root-mode during vmx-operation.
+// NOTE: this also updates the shared identity map, which affects every vcpu.
 void update_ept_memory_type(vcpu_ept_data& ept);
 
-// set the memory type in every EPT paging structure to the specified value
+// set the memory type in every EPT paging structure to the specified value.
+// NOTE: this also updates the shared identity map, which affects every vcpu.
 void set_ept_memory_type(vcpu_ept_data& ept, uint8_t memory_type);
 
-// get the corresponding EPT PDPTE for a given physical address
-ept_pdpte* get_ept_pdpte(vcpu_ept_data& ept, uint64_t physical_address);
+// map a physical address that isn't mapped in the vcpu's EPT paging
+// structures yet. returns false if the address was already mapped.
+bool map_missing_ept_entry(vcpu_ept_data& ept, uint64_t physical_address);
 
-// get the corresponding EPT PDE for a given physical address
-ept_pde* get_ept_pde(vcpu_ept_data& ept, uint64_t physical_address);
+// get the corresponding EPT PDPTE for a given physical address.
+// NOTE: this may point into the shared identity map, so it is read-only.
+ept_pdpte const* get_ept_pdpte(vcpu_ept_data& ept, uint64_t physical_address);
 
-// get the corresponding EPT PTE for a given physical address
+// get the corresponding EPT PDE for a given physical address. null is
+// returned if the address is mapped by a 1GB page or isn't mapped at all.
+// NOTE: this may point into the shared identity map, so it is read-only.
+ept_pde const* get_ept_pde(vcpu_ept_data& ept, uint64_t physical_address);
+
+// get the corresponding EPT PDE for a given physical address, creating a
+// private copy of the PDPT and PD if they are still shared with other vcpus.
+// 1GB pages are split into a PD of 2MB pages.
+ept_pde* get_private_ept_pde(vcpu_ept_data& ept, uint64_t physical_address);
+
+// get the corresponding EPT PTE for a given physical address.
+// PTs are always private to a single vcpu, so this can be modified.
 ept_pte* get_ept_pte(vcpu_ept_data& ept,
     uint64_t physical_address, bool force_split = false);
 
-// split a 2MB EPT PDE so that it points to an EPT PT
+// get the private EPT entry (PTE, 2MB PDE, or 1GB PDPTE) that maps the
+// specified physical address, along with the size of the page that it maps.
+// the permission bits are in the same position at every level, so the result
+// can be used to modify permissions. null is returned if the entry is still
+// part of the shared identity map.
+ept_pte* get_private_ept_leaf(vcpu_ept_data& ept,
+    uint64_t physical_address, uint64_t& page_size);
+
+// split a private 1GB EPT PDPTE so that it points to an EPT PD
+void split_ept_pdpte(vcpu_ept_data& ept, ept_pdpte_1gb* pdpte_1gb);
+
+// split a private 2MB EPT PDE so that it points to an EPT PT
 void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* pde_2mb);
 
+// merge the PT that maps the specified physical address back into a 2MB
+// PDE. this only happens if every PTE in the PT identity-maps its page with
+// the same permissions and memory type. returns true if the PT was merged.
+// private paging structures that end up identical to the shared identity
+// map are given back to the EPT page pool as well.
+bool merge_ept_pde(vcpu_ept_data& ept, uint64_t physical_address);
+
+// try to merge every PT that maps part of the specified physical range
+void merge_ept_range(vcpu_ept_data& ept, uint64_t physical_address, uint64_t size);
+
+// invalidate the cached translations that were derived from this vcpu's
+// EPT paging structures. this should only be called from root-mode.
+void flush_ept(vcpu_ept_data& ept);
+
+// re-protect the MMR page that was left accessible, either for a single
+// instruction or for an access window, and flush the EPT. nothing happens
+// if every MMR page is protected.
+// this should only be called from root-mode.
+void rearm_mmr_page(vcpu_ept_data& ept);
+
+// enable or disable dirty logging for the current vcpu. the dirty flag of
+// every EPT entry is cleared when logging is enabled. returns false if the
+// processor doesn't support EPT A/D flags.
+// this should only be called from root-mode.
+bool set_ept_dirty_logging(vcpu_ept_data& ept, bool enable);
+
+// enable or disable access sampling for the current vcpu. returns false if
+// the processor doesn't support EPT A/D flags.
+// this should only be called from root-mode.
+bool set_ept_access_sampling(vcpu_ept_data& ept, bool enable);
+
+// clear the accessed flag of every EPT entry in the current view and call
+// fn() for every 2MB region that was accessed. the EPT should be flushed
+// afterwards so that the flags get set again.
+void collect_ept_accessed_regions(vcpu_ept_data& ept, ept_accessed_region_fn fn, void* ctx);
+
+// clear the dirty flag of every EPT entry that maps part of the specified
+// physical range and call fn() for every range that was dirty (clamped to
+// the specified range). every page in a dirty 2MB or 1GB page is reported.
+// fn can be null, in which case the dirty flags are only cleared.
+void collect_ept_dirty_pages(vcpu_ept_data& ept, uint64_t physical_address,
+  uint64_t size, ept_dirty_range_fn fn, void* ctx);
+
+// write-protect every EPT leaf that maps part of the specified physical
+// range for a memory snapshot, or give write access back to the leaves that
+// were write-protected. the EPT should be flushed afterwards.
+void set_ept_snapshot_protection(vcpu_ept_data& ept,
+  uint64_t physical_address, uint64_t size, bool enable);
+
+// check whether the page at the specified address is write-protected for a
+// memory snapshot on the current vcpu
+bool is_ept_snapshot_page(vcpu_ept_data& ept, uint64_t physical_address);
+
+// give write access back to a page that was write-protected for a memory
+// snapshot. large pages are split so that the rest of the large page stays
+// write-protected, and false is returned if that wasn't possible.
+// this should only be called from root-mode.
+bool release_ept_snapshot_page(vcpu_ept_data& ept, uint64_t physical_address);
+
+// set the write access of a leaf EPT entry. while RAM is write-protected
+// for a memory snapshot, write access is only marked as withheld.
+void set_ept_write_access(vcpu_ept_data const& ept, ept_pte& pte, bool allowed);
+
+// switch the EPTP of the current vcpu to the main view or to the execute
+// view, rebuilding the execute view first if needed. returns false if the
+// execute view is disabled or couldn't be built.
+// this should only be called from root-mode.
+bool set_ept_view(vcpu_ept_data& ept, bool exec);
+
+// allow or disallow hooks to use the execute view on the current vcpu.
+// this should only be called from root-mode.
+void set_ept_exec_view_enabled(vcpu_ept_data& ept, bool enabled);
+
+// get the PTE that maps the specified physical address in the execute view.
+// this is only a copy for pages that have been hooked.
+ept_pte* get_ept_exec_view_pte(vcpu_ept_data& ept, uint64_t physical_address);
+
+// invalidate the cached translations of both views, without causing the
+// execute view to be rebuilt. this is only safe when no paging structures
+// were added or removed. this should only be called from root-mode.
+void flush_ept_views(vcpu_ept_data& ept);
+
+// start a new EPT transaction, discarding anything that was queued before
+void begin_ept_txn(vcpu_ept_data& ept);
+
+// queue a modification of every PTE in the specified physical range. the
+// PDEs are split right away, and the transaction fails if that isn't possible.
+bool queue_ept_txn_op(vcpu_ept_data& ept, ept_txn_op const& op);
+
+// apply every queued modification and flush the EPT once. if anything failed
+// to be queued, nothing is applied and the PDEs that were split are merged.
+bool commit_ept_txn(vcpu_ept_data& ept);
+
 // memory read/written will use the original page while code
 // being executed will use the executable page instead
 bool install_ept_hook(vcpu_ept_data& ept,
@@ -124,8 +502,30 @@ bool install_ept_hook(vcpu_ept_data& ept,
 // remove an EPT hook that was installed with install_ept_hook()
 void remove_ept_hook(vcpu_ept_data& ept, uint64_t original_page_pfn);
 
+// install a set of EPT hooks with a single EPT commit. nothing is installed
+// if any of the pages is already hooked or if there aren't enough hook nodes.
+bool install_ept_hooks(vcpu_ept_data& ept, uint64_t const* original_page_pfns,
+  uint64_t const* executable_page_pfns, size_t count);
+
+// remove a set of EPT hooks with a single EPT commit
+void remove_ept_hooks(vcpu_ept_data& ept, uint64_t const* original_page_pfns, size_t count);
+
 // find the EPT hook for the specified PFN
 vcpu_ept_hook_node* find_ept_hook(vcpu_ept_data& ept, uint64_t original_page_pfn);
 
+// limit an EPT hook to the address spaces of the specified CR3 PFNs, or make
+// it global again if the count is 0. the hook is immediately (de)activated
+// for the current CR3. this should only be called from root-mode.
+bool set_ept_hook_scope(vcpu_ept_data& ept, uint64_t original_page_pfn,
+  uint64_t const* cr3_pfns, size_t count, uint64_t current_cr3_pfn);
+
+// activate or deactivate every scoped EPT hook after the guest loaded a new
+// CR3. this should only be called from root-mode.
+void update_ept_hook_scopes(vcpu_ept_data& ept, uint64_t cr3_pfn);
+
+// count an ept-violation that was caused by an EPT hook and update whether
+// the hook is hot
+void record_ept_hook_exit(vcpu_ept_hook_node& hook);
+
 } // namespace hv
 
@@ -1,5 +1,6 @@
 #include "exit-handlers.h"
 #include "guest-context.h"
+#include "emulator.h"
 #include "exception-routines.h"
 #include "introspection.h"
 #include "hypercalls.h"
@@ -193,29 +194,65 @@ void emulate_vmcall(vcpu* const cpu) {
 
   // handle the hypercall
   switch (code) {
-  case hypercall_ping:                 hc::ping(cpu);                 return;
-  case hypercall_test:                 hc::test(cpu);                 return;
-  case hypercall_unload:               hc::unload(cpu);               return;
-  case hypercall_read_phys_mem:        hc::read_phys_mem(cpu);        return;
-  case hypercall_write_phys_mem:       hc::write_phys_mem(cpu);       return;
-  case hypercall_read_virt_mem:        hc::read_virt_mem(cpu);        return;
-  case hypercall_write_virt_mem:       hc::write_virt_mem(cpu);       return;
-  case hypercall_query_process_cr3:    hc::query_process_cr3(cpu);    return;
-  case hypercall_install_ept_hook:     hc::install_ept_hook(cpu);     return;
-  case hypercall_remove_ept_hook:      hc::remove_ept_hook(cpu);      return;
-  case hypercall_flush_logs:           hc::flush_logs(cpu);           return;
-  case hypercall_get_physical_address: hc::get_physical_address(cpu); return;
-  case hypercall_hide_physical_page:   hc::hide_physical_page(cpu);   return;
-  case hypercall_unhide_physical_page: hc::unhide_physical_page(cpu); return;
-  case hypercall_get_hv_base:          hc::get_hv_base(cpu);          return;
-  case hypercall_install_mmr:          hc::install_mmr(cpu);          return;
-  case hypercall_remove_mmr:           hc::remove_mmr(cpu);           return;
-  case hypercall_remove_all_mmrs:      hc::remove_all_mmrs(cpu);      return;
-  case hypercall_send_message:         hc::send_message(cpu);         return;
-  case hypercall_get_message:          hc::get_message(cpu);          return;
-  case hypercall_get_message_type:     hc::get_message_type(cpu);     return;
-  case hypercall_get_message_time:     hc::get_message_time(cpu);     return;
-  case hypercall_get_message_sender:   hc::get_message_sender(cpu);   return;
+  case hypercall_ping:                         hc::ping(cpu);                         return;
+  case hypercall_test:                         hc::test(cpu);                         return;
+  case hypercall_unload:                       hc::unload(cpu);                       return;
+  case hypercall_read_phys_mem:                hc::read_phys_mem(cpu);                return;
+  case hypercall_write_phys_mem:               hc::write_phys_mem(cpu);               return;
+  case hypercall_read_virt_mem:                hc::read_virt_mem(cpu);                return;
+  case hypercall_write_virt_mem:               hc::write_virt_mem(cpu);               return;
+  case hypercall_query_process_cr3:            hc::query_process_cr3(cpu);            return;
+  case hypercall_install_ept_hook:             hc::install_ept_hook(cpu);             return;
+  case hypercall_remove_ept_hook:              hc::remove_ept_hook(cpu);              return;
+  case hypercall_flush_logs:                   hc::flush_logs(cpu);                   return;
+  case hypercall_get_physical_address:         hc::get_physical_address(cpu);         return;
+  case hypercall_hide_physical_page:           hc::hide_physical_page(cpu);           return;
+  case hypercall_unhide_physical_page:         hc::unhide_physical_page(cpu);         return;
+  case hypercall_get_hv_base:                  hc::get_hv_base(cpu);                  return;
+  case hypercall_install_mmr:                  hc::install_mmr(cpu);                  return;
+  case hypercall_remove_mmr:                   hc::remove_mmr(cpu);                   return;
+  case hypercall_remove_all_mmrs:              hc::remove_all_mmrs(cpu);              return;
+  case hypercall_send_message:                 hc::send_message(cpu);                 return;
+  case hypercall_get_message:                  hc::get_message(cpu);                  return;
+  case hypercall_get_message_type:             hc::get_message_type(cpu);             return;
+  case hypercall_get_message_time:             hc::get_message_time(cpu);             return;
+  case hypercall_get_message_sender:           hc::get_message_sender(cpu);           return;
+  case hypercall_install_ept_hook_global:      hc::install_ept_hook_global(cpu);      return;
+  case hypercall_remove_ept_hook_global:       hc::remove_ept_hook_global(cpu);       return;
+  case hypercall_hide_physical_page_global:    hc::hide_physical_page_global(cpu);    return;
+  case hypercall_unhide_physical_page_global:  hc::unhide_physical_page_global(cpu);  return;
+  case hypercall_install_mmr_global:           hc::install_mmr_global(cpu);           return;
+  case hypercall_remove_mmr_global:            hc::remove_mmr_global(cpu);            return;
+  case hypercall_remove_all_mmrs_global:       hc::remove_all_mmrs_global(cpu);       return;
+  case hypercall_hide_physical_range:          hc::hide_physical_range(cpu);          return;
+  case hypercall_unhide_physical_range:        hc::unhide_physical_range(cpu);        return;
+  case hypercall_start_dirty_log:              hc::start_dirty_log(cpu);              return;
+  case hypercall_stop_dirty_log:               hc::stop_dirty_log(cpu);               return;
+  case hypercall_fetch_and_clear_dirty_bitmap: hc::fetch_and_clear_dirty_bitmap(cpu); return;
+  case hypercall_set_ept_exec_view:            hc::set_ept_exec_view(cpu);            return;
+  case hypercall_query_ept_hook_stats:         hc::query_ept_hook_stats(cpu);         return;
+  case hypercall_query_ept_hooks:              hc::query_ept_hooks(cpu);              return;
+  case hypercall_install_shadow_ept_hooks:     hc::install_shadow_ept_hooks(cpu);     return;
+  case hypercall_remove_shadow_ept_hooks:      hc::remove_shadow_ept_hooks(cpu);      return;
+  case hypercall_set_ept_hook_scope:           hc::set_ept_hook_scope(cpu);           return;
+  case hypercall_create_ept_hook_group:        hc::create_ept_hook_group(cpu);        return;
+  case hypercall_activate_ept_hook_group:      hc::activate_ept_hook_group(cpu);      return;
+  case hypercall_deactivate_ept_hook_group:    hc::deactivate_ept_hook_group(cpu);    return;
+  case hypercall_destroy_ept_hook_group:       hc::destroy_ept_hook_group(cpu);       return;
+  case hypercall_start_ept_access_sampling:    hc::start_ept_access_sampling(cpu);    return;
+  case hypercall_stop_ept_access_sampling:     hc::stop_ept_access_sampling(cpu);     return;
+  case hypercall_sample_ept_access:            hc::sample_ept_access(cpu);            return;
+  case hypercall_query_ept_access_map:         hc::query_ept_access_map(cpu);         return;
+  case hypercall_start_memory_snapshot:        hc::start_memory_snapshot(cpu);        return;
+  case hypercall_stop_memory_snapshot:         hc::stop_memory_snapshot(cpu);         return;
+  case hypercall_read_memory_snapshot:         hc::read_memory_snapshot(cpu);         return;
+  case hypercall_query_memory_snapshot_stats:  hc::query_memory_snapshot_stats(cpu);  return;
+  case hypercall_hash_physical_pages:          hc::hash_physical_pages(cpu);          return;
+  case hypercall_read_mmr_profile:             hc::read_mmr_profile(cpu);             return;
+  case hypercall_set_mmr_filter:               hc::set_mmr_filter(cpu);               return;
+  case hypercall_install_mmr_watch:            hc::install_mmr_watch(cpu);            return;
+  case hypercall_set_mmr_window:               hc::set_mmr_window(cpu);               return;
+  case hypercall_read_mmr_trace:               hc::read_mmr_trace(cpu);               return;
   }
 
   HV_LOG_VERBOSE("Unhandled VMCALL. RIP=%p.", vmx_vmread(VMCS_GUEST_RIP));
@@ -224,7 +261,7 @@ void emulate_vmcall(vcpu* const cpu) {
 }
 
 void handle_vmx_preemption(vcpu*) {
-  // do nothing.
+  // do nothing. MMR access windows are closed right before vm-entry.
 }
 
 void emulate_mov_to_cr0(vcpu* const cpu, uint64_t const gpr) {
@@ -343,6 +380,10 @@ void emulate_mov_to_cr3(vcpu* const cpu, uint64_t const gpr) {
   // it is now safe to write the new guest cr3
   vmx_vmwrite(VMCS_GUEST_CR3, new_cr3.flags);
 
+  // scoped EPT hooks are only active in the address spaces they belong to
+  if (cpu->ept.hooks.scoped_count > 0)
+    update_ept_hook_scopes(cpu->ept, new_cr3.address_of_page_directory);
+
   cpu->hide_vm_exit_overhead = true;
   skip_instruction();
 }
@@ -512,11 +553,69 @@ void handle_mov_cr(vcpu* const cpu) {
   }
 }
 
+void handle_mov_dr(vcpu* const cpu) {
+  vmx_exit_qualification_mov_dr qualification;
+  qualification.flags = vmx_vmread(VMCS_EXIT_QUALIFICATION);
+
+  auto idx = qualification.debug_register;
+
+  // DR4 and DR5 are aliases of DR6 and DR7 unless debug extensions are enabled
+  if (idx == 4 || idx == 5) {
+    if (read_effective_guest_cr4().debugging_extensions) {
+      inject_hw_exception(invalid_opcode);
+      return;
+    }
+
+    idx += 2;
+  }
+
+  // general detection is emulated since it isn't enabled in hardware
+  dr7 guest_dr7;
+  guest_dr7.flags = read_guest_dr(cpu, 7);
+
+  if (guest_dr7.general_detect) {
+    dr6 guest_dr6;
+    guest_dr6.flags = read_guest_dr(cpu, 6);
+    guest_dr6.debug_register_access_detected = 1;
+    write_guest_dr(cpu, 6, guest_dr6.flags);
+
+    guest_dr7.general_detect = 0;
+    write_guest_dr(cpu, 7, guest_dr7.flags);
+
+    inject_hw_exception(debug);
+    return;
+  }
+
+  // MOV XXX, DRn
+  if (qualification.direction_of_access == VMX_EXIT_QUALIFICATION_DIRECTION_MOV_FROM_DR) {
+    write_guest_gpr(cpu->ctx, qualification.general_purpose_register,
+      read_guest_dr(cpu, idx));
+    skip_instruction();
+    return;
+  }
+
+  // MOV DRn, XXX
+  auto const value = read_guest_gpr(cpu->ctx, qualification.general_purpose_register);
+
+  // the upper 32 bits of DR6 and DR7 are reserved
+  if (idx >= 6 && (value >> 32)) {
+    inject_hw_exception(general_protection, 0);
+    return;
+  }
+
+  write_guest_dr(cpu, idx, value);
+
+  skip_instruction();
+}
+
 void handle_nmi_window(vcpu* const cpu) {
-  --cpu->queued_nmis;
+  // NMI-window exiting might have only been enabled to force a vm-exit
+  if (cpu->queued_nmis > 0) {
+    --cpu->queued_nmis;
 
-  // inject the NMI into the guest
-  inject_nmi();
+    // inject the NMI into the guest
+    inject_nmi();
+  }
 
   if (cpu->queued_nmis == 0) {
     // disable NMI-window exiting since we have no more NMIs to inject
@@ -534,7 +633,285 @@ void handle_nmi_window(vcpu* const cpu) {
   }
 }
 
+void handle_vmx_instruction(vcpu*) {
+  // inject #UD for every VMX instruction since we
+  // don't allow the guest to ever enter VMX operation.
+  inject_hw_exception(invalid_opcode);
+}
+
+// let code in a hot hook's page read the executable page for a single
+// instruction, instead of flipping to the original page. this is only done
+// for reads that come from the hooked page itself (such as jump tables or
+// RIP-relative constants), so everything else still sees the original page.
+static bool single_step_hot_ept_hook(vcpu* const cpu,
+    vcpu_ept_hook_node const& hook, vmx_exit_qualification_ept_violation const qualification,
+    ept_pte* const pte, bool const exec_view) {
+  if (!hook.hot || !pte || qualification.write_access || qualification.execute_access)
+    return false;
+
+  // the page has to currently be mapped to the executable page
+  if (pte->page_frame_number != hook.exec_pfn || !pte->execute_access)
+    return false;
+
+  auto const rip = reinterpret_cast<void*>(vmx_vmread(VMCS_GUEST_RIP));
+  if ((gva2gpa(rip) >> 12) != hook.orig_pfn)
+    return false;
+
+  pte->read_access = 1;
+
+  cpu->ept.hook_mtf_pte       = pte;
+  cpu->ept.hook_mtf_exec_view = exec_view;
+
+  enable_monitor_trap_flag();
+
+  return true;
+}
+
+// check whether an access to an MMR passes the filter of the MMR. the
+// conditions are checked from cheapest to most expensive.
+static bool mmr_filter_allows(mmr_filter const& filter, uint8_t const access) {
+  if (filter.access_mask && !(filter.access_mask & access))
+    return false;
+
+  if (filter.cpl_mask && !(filter.cpl_mask & (1ull << current_guest_cpl())))
+    return false;
+
+  if (filter.rip_range_count > 0) {
+    auto const rip = vmx_vmread(VMCS_GUEST_RIP);
+
+    bool allowed = false;
+    for (size_t i = 0; i < filter.rip_range_count && !allowed; ++i)
+      allowed = rip >= filter.rip_ranges[i].start && rip < filter.rip_ranges[i].end;
+
+    if (!allowed)
+      return false;
+  }
+
+  if (filter.cr3_count > 0) {
+    auto const cr3 = vmx_vmread(VMCS_GUEST_CR3) & ~0xFFFull;
+
+    bool allowed = false;
+    for (size_t i = 0; i < filter.cr3_count && !allowed; ++i)
+      allowed = cr3 == (filter.cr3[i] & ~0xFFFull);
+
+    if (!allowed)
+      return false;
+  }
+
+  // the PID has to be read from guest memory
+  if (filter.pid_count > 0) {
+    auto const pid = current_guest_pid();
+
+    bool allowed = false;
+    for (size_t i = 0; i < filter.pid_count && !allowed; ++i)
+      allowed = pid == filter.pid[i];
+
+    if (!allowed)
+      return false;
+  }
+
+  return true;
+}
+
+// write an access to an MMR, and the guest state at the time, to the MMR
+// trace of the vcpu. the access is dropped if the trace is full.
+static void trace_mmr_access(vcpu* const cpu, vcpu_ept_mmr_entry const& entry,
+    uint64_t const physical_address, uint8_t const access) {
+  auto& trace = *cpu->ept.mmr_trace;
+
+  auto const event = begin_mmr_event(trace);
+  if (!event)
+    return;
+
+  event->tsc              = __rdtsc();
+  event->physical_address = physical_address;
+  event->cr3              = vmx_vmread(VMCS_GUEST_CR3);
+  event->pid              = current_guest_pid();
+  event->rip              = vmx_vmread(VMCS_GUEST_RIP);
+  event->vcpu             = static_cast<uint16_t>(cpu - ghv.vcpus);
+  event->mmr              = static_cast<uint16_t>(&entry - cpu->ept.mmrs->entries);
+  event->access           = access;
+  event->cpl              = static_cast<uint8_t>(current_guest_cpl());
+
+  // the RSP slot of the guest context isn't used, since RSP is in the VMCS
+  memcpy(event->gpr, cpu->ctx->gpr, sizeof(event->gpr));
+  event->gpr[4] = vmx_vmread(VMCS_GUEST_RSP);
+
+  commit_mmr_event(trace);
+}
+
+// apply the filter of an MMR to an access, and count or trace the access if
+// the MMR is aggregating or tracing. returns true if the access needs to be
+// logged.
+static bool process_mmr_access(vcpu* const cpu, vcpu_ept_mmr_entry const& entry,
+    uint64_t const physical_address, uint8_t const access) {
+  // accesses that don't pass the filter of the MMR don't produce anything
+  auto const filter = get_mmr_filter(*cpu->ept.mmrs, entry);
+  if (filter && !mmr_filter_allows(*filter, access))
+    return false;
+
+  // aggregating MMRs only count the access instead of logging it
+  if (entry.mode & mmr_memory_mode_aggregate) {
+    record_mmr_access(*cpu->ept.mmr_profile, &entry - cpu->ept.mmrs->entries,
+      physical_address, vmx_vmread(VMCS_GUEST_RIP), vmx_vmread(VMCS_GUEST_CR3), access);
+    return false;
+  }
+
+  // tracing MMRs write a binary record instead of logging the access
+  if (entry.mode & mmr_memory_mode_trace) {
+    trace_mmr_access(cpu, entry, physical_address, access);
+    return false;
+  }
+
+  return true;
+}
+
+// write an access to an MMR, and the guest state at the time, to the logger
+static void log_mmr_access(vcpu* const cpu,
+    uint64_t const physical_address, uint8_t const access) {
+  char name[16] = {};
+  current_guest_image_file_name(name);
+
+  char mode[4] = "---";
+  if (access & mmr_memory_mode_r)
+    mode[0] = 'r';
+  if (access & mmr_memory_mode_w)
+    mode[1] = 'w';
+  if (access & mmr_memory_mode_x)
+    mode[2] = 'x';
+
+  HV_LOG_MMR_ACCESS("[%s] accessed memory at physical address <%p>:", name, physical_address);
+  HV_LOG_MMR_ACCESS("    MODE: %s", mode);
+  HV_LOG_MMR_ACCESS("    PID:  %p", current_guest_pid());
+  HV_LOG_MMR_ACCESS("    CPL:  %i", current_guest_cpl());
+  HV_LOG_MMR_ACCESS("    RIP:  %p", vmx_vmread(VMCS_GUEST_RIP));
+  HV_LOG_MMR_ACCESS("    RSP:  %p", vmx_vmread(VMCS_GUEST_RSP));
+  HV_LOG_MMR_ACCESS("    RAX:  %p", cpu->ctx->rax);
+  HV_LOG_MMR_ACCESS("    RCX:  %p", cpu->ctx->rcx);
+  HV_LOG_MMR_ACCESS("    RDX:  %p", cpu->ctx->rdx);
+  HV_LOG_MMR_ACCESS("    RBX:  %p", cpu->ctx->rbx);
+  HV_LOG_MMR_ACCESS("    RBP:  %p", cpu->ctx->rbp);
+  HV_LOG_MMR_ACCESS("    RSI:  %p", cpu->ctx->rsi);
+  HV_LOG_MMR_ACCESS("    RDI:  %p", cpu->ctx->rdi);
+  HV_LOG_MMR_ACCESS("    R8:   %p", cpu->ctx->r8);
+  HV_LOG_MMR_ACCESS("    R9:   %p", cpu->ctx->r9);
+  HV_LOG_MMR_ACCESS("    R10:  %p", cpu->ctx->r10);
+  HV_LOG_MMR_ACCESS("    R11:  %p", cpu->ctx->r11);
+  HV_LOG_MMR_ACCESS("    R12:  %p", cpu->ctx->r12);
+  HV_LOG_MMR_ACCESS("    R13:  %p", cpu->ctx->r13);
+  HV_LOG_MMR_ACCESS("    R14:  %p", cpu->ctx->r14);
+  HV_LOG_MMR_ACCESS("    R15:  %p", cpu->ctx->r15);
+}
+
+// handle an access to an MMR that is served by a debug register
+static void handle_watchpoint_hit(vcpu* const cpu, size_t const i) {
+  auto const& wp    = cpu->watchpoints;
+  auto const& entry = cpu->ept.mmrs->entries[wp.mmrs[i] - 1];
+
+  uint8_t access = mmr_memory_mode_w;
+
+  if (entry.mode & mmr_memory_mode_x) {
+    access = mmr_memory_mode_x;
+
+    // instruction breakpoints are faults, so the instruction would hit the
+    // breakpoint again unless RF is set
+    rflags guest_rflags;
+    guest_rflags.flags       = vmx_vmread(VMCS_GUEST_RFLAGS);
+    guest_rflags.resume_flag = 1;
+    vmx_vmwrite(VMCS_GUEST_RFLAGS, guest_rflags.flags);
+  }
+  // debug registers can't tell reads and writes apart
+  else if (entry.mode & mmr_memory_mode_r)
+    access = mmr_memory_mode_r | mmr_memory_mode_w;
+
+  // the same linear address can belong to a different physical address in
+  // another address space
+  auto const physical_address = gva2gpa(reinterpret_cast<void*>(wp.addresses[i]));
+  if (physical_address != entry.start)
+    return;
+
+  if (process_mmr_access(cpu, entry, physical_address, access))
+    log_mmr_access(cpu, physical_address, access);
+}
+
+// handle a #DB while debug registers serve MMRs. hits of those debug
+// registers are handled like any other MMR access, and everything else is
+// passed on to the guest as if the #DB hadn't been intercepted.
+static void handle_debug_exception(vcpu* const cpu,
+    vmexit_interrupt_information const info) {
+  // ICEBP doesn't depend on the debug registers
+  if (info.interruption_type == privileged_software_exception) {
+    vmentry_interrupt_information interrupt_info;
+    interrupt_info.flags              = 0;
+    interrupt_info.vector             = debug;
+    interrupt_info.interruption_type  = privileged_software_exception;
+    interrupt_info.deliver_error_code = 0;
+    interrupt_info.valid              = 1;
+    vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interrupt_info.flags);
+    vmx_vmwrite(VMCS_CTRL_VMENTRY_INSTRUCTION_LENGTH,
+      vmx_vmread(VMCS_VMEXIT_INSTRUCTION_LENGTH));
+    return;
+  }
+
+  vmx_exit_qualification_debug_exception qualification;
+  qualification.flags = vmx_vmread(VMCS_EXIT_QUALIFICATION);
+
+  auto& wp = cpu->watchpoints;
+
+  // breakpoint conditions of the debug registers that the guest owns
+  uint64_t guest_conditions = 0;
+
+  for (size_t i = 0; i < watchpoint_capacity; ++i) {
+    if (!(qualification.breakpoint_condition & (1 << i)))
+      continue;
+
+    if (wp.mmrs[i])
+      handle_watchpoint_hit(cpu, i);
+    else
+      guest_conditions |= (1ull << i);
+  }
+
+  // conditions are reported for disabled breakpoints as well, so only the
+  // enabled ones could have raised the #DB
+  auto guest_hit = qualification.single_instruction != 0;
+  for (size_t i = 0; i < watchpoint_capacity; ++i) {
+    if ((guest_conditions & (1ull << i)) && (wp.guest_dr7 & (0b11ull << (i * 2))))
+      guest_hit = true;
+  }
+
+  if (!guest_hit)
+    return;
+
+  dr6 guest_dr6;
+  guest_dr6.flags                = wp.guest_dr6;
+  guest_dr6.breakpoint_condition = guest_conditions;
+  guest_dr6.single_instruction  |= qualification.single_instruction;
+  wp.guest_dr6 = guest_dr6.flags;
+
+  // the processor clears DR7.GD when it delivers a #DB
+  dr7 guest_dr7;
+  guest_dr7.flags          = wp.guest_dr7;
+  guest_dr7.general_detect = 0;
+  wp.guest_dr7 = guest_dr7.flags;
+
+  inject_hw_exception(debug);
+}
+
 void handle_exception_or_nmi(vcpu* const cpu) {
+  vmexit_interrupt_information info;
+  info.flags = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INTERRUPTION_INFORMATION));
+
+  // #DB is the only exception that is intercepted, and only while debug
+  // registers serve MMRs
+  if (info.interruption_type != non_maskable_interrupt) {
+    handle_debug_exception(cpu, info);
+    return;
+  }
+
+  // this NMI was only sent to get us to drain our work queue
+  if (consume_work_queue_kick(cpu))
+    return;
+
   // enqueue an NMI to be injected into the guest later on
   ++cpu->queued_nmis;
 
@@ -543,12 +920,6 @@ void handle_exception_or_nmi(vcpu* const cpu) {
   write_ctrl_proc_based(ctrl);
 }
 
-void handle_vmx_instruction(vcpu*) {
-  // inject #UD for every VMX instruction since we
-  // don't allow the guest to ever enter VMX operation.
-  inject_hw_exception(invalid_opcode);
-}
-
 void handle_ept_violation(vcpu* const cpu) {
   vmx_exit_qualification_ept_violation qualification;
   qualification.flags = vmx_vmread(VMCS_EXIT_QUALIFICATION);
@@ -557,64 +928,135 @@ void handle_ept_violation(vcpu* const cpu) {
   auto const physical_address = vmx_vmread(qualification.caused_by_translation ?
     VMCS_GUEST_PHYSICAL_ADDRESS : VMCS_EXIT_GUEST_LINEAR_ADDRESS);
 
-  auto const pte = get_ept_pte(cpu->ept, physical_address);
+  // the execute view is only meant for instruction fetches from hooked
+  // pages, so anything else is retried (and handled) in the main view
+  if (cpu->ept.exec_view_active) {
+    auto const start_tsc = __rdtsc();
 
-  for (auto const& entry : cpu->ept.mmr) {
-    // ignore pages that aren't being monitored
-    if (physical_address < (entry.start & ~0xFFFull))
-      continue;
-    if (physical_address >= ((entry.start + entry.size + 0xFFF) & ~0xFFFull))
-      continue;
+    if (auto const hook = find_ept_hook(cpu->ept, physical_address >> 12)) {
+      record_ept_hook_exit(*hook);
 
-    pte->read_access    = 1;
-    pte->write_access   = 1;
-    pte->execute_access = 1;
+      if (single_step_hot_ept_hook(cpu, *hook, qualification,
+          get_ept_exec_view_pte(cpu->ept, physical_address), true))
+        return;
+
+      ++hook->flip_count;
+    }
+
+    set_ept_view(cpu->ept, false);
+
+    ++cpu->ept.hook_stats.view_switch_count;
+    cpu->ept.hook_stats.view_switch_tsc += __rdtsc() - start_tsc;
+    return;
+  }
+
+  // the guest accessed physical memory that hasn't been mapped yet (such as
+  // MMIO that isn't covered by the RAM ranges that were mapped up-front)
+  if (map_missing_ept_entry(cpu->ept, vmx_vmread(VMCS_GUEST_PHYSICAL_ADDRESS))) {
+    flush_ept(cpu->ept);
+    return;
+  }
+
+  // the first write to a page after a snapshot was taken copies the page
+  // before the guest is allowed to modify it
+  if (qualification.write_access && handle_snapshot_write(ghv.snapshot,
+      cpu->ept, vmx_vmread(VMCS_GUEST_PHYSICAL_ADDRESS)))
+    return;
+
+  auto pte = get_ept_pte(cpu->ept, physical_address);
+
+  // find every MMR that this page belongs to (there can be more than one
+  // since MMRs are allowed to overlap)
+  bool is_monitored = false, is_relevant = false;
+  uint8_t page_mode = 0;
+
+  // the page is only left accessible for a window if every MMR on it has one
+  uint64_t window = ~0ull;
+
+  // the read, write, and execute bits of the qualification match the MMR modes
+  auto const access = static_cast<uint8_t>(qualification.flags & 0b111);
+
+  for_each_mmr(*cpu->ept.mmrs, physical_address & ~0xFFFull, 0x1000,
+      [&](vcpu_ept_mmr_entry const& entry) {
+    is_monitored = true;
+    page_mode   |= entry.mode;
+    window       = min(window, entry.window);
 
     auto const is_relevant_mode =
          (qualification.read_access    && (entry.mode & mmr_memory_mode_r))
       || (qualification.write_access   && (entry.mode & mmr_memory_mode_w))
       || (qualification.execute_access && (entry.mode & mmr_memory_mode_x));
 
-    if (is_relevant_mode &&
-        physical_address >= entry.start &&
-        physical_address < (entry.start + entry.size)) {
-
-      char name[16] = {};
-      current_guest_image_file_name(name);
-
-      char mode[4] = "---";
-      if (qualification.read_access)
-        mode[0] = 'r';
-      if (qualification.write_access)
-        mode[1] = 'w';
-      if (qualification.execute_access)
-        mode[2] = 'x';
-
-      HV_LOG_MMR_ACCESS("[%s] accessed memory at physical address <%p>:", name, physical_address);
-      HV_LOG_MMR_ACCESS("    MODE: %s", mode);
-      HV_LOG_MMR_ACCESS("    PID:  %p", current_guest_pid());
-      HV_LOG_MMR_ACCESS("    CPL:  %i", current_guest_cpl());
-      HV_LOG_MMR_ACCESS("    RIP:  %p", vmx_vmread(VMCS_GUEST_RIP));
-      HV_LOG_MMR_ACCESS("    RSP:  %p", vmx_vmread(VMCS_GUEST_RSP));
-      HV_LOG_MMR_ACCESS("    RAX:  %p", cpu->ctx->rax);
-      HV_LOG_MMR_ACCESS("    RCX:  %p", cpu->ctx->rcx);
-      HV_LOG_MMR_ACCESS("    RDX:  %p", cpu->ctx->rdx);
-      HV_LOG_MMR_ACCESS("    RBX:  %p", cpu->ctx->rbx);
-      HV_LOG_MMR_ACCESS("    RBP:  %p", cpu->ctx->rbp);
-      HV_LOG_MMR_ACCESS("    RSI:  %p", cpu->ctx->rsi);
-      HV_LOG_MMR_ACCESS("    RDI:  %p", cpu->ctx->rdi);
-      HV_LOG_MMR_ACCESS("    R8:   %p", cpu->ctx->r8);
-      HV_LOG_MMR_ACCESS("    R9:   %p", cpu->ctx->r9);
-      HV_LOG_MMR_ACCESS("    R10:  %p", cpu->ctx->r10);
-      HV_LOG_MMR_ACCESS("    R11:  %p", cpu->ctx->r11);
-      HV_LOG_MMR_ACCESS("    R12:  %p", cpu->ctx->r12);
-      HV_LOG_MMR_ACCESS("    R13:  %p", cpu->ctx->r13);
-      HV_LOG_MMR_ACCESS("    R14:  %p", cpu->ctx->r14);
-      HV_LOG_MMR_ACCESS("    R15:  %p", cpu->ctx->r15);
+    if (!is_relevant_mode ||
+        physical_address <  entry.start ||
+        physical_address >= (entry.start + entry.size))
+      return;
+
+    if (process_mmr_access(cpu, entry, physical_address, access))
+      is_relevant = true;
+  });
+
+  if (is_monitored) {
+    if (is_relevant)
+      log_mmr_access(cpu, physical_address, access);
+
+    // most data accesses can be emulated from root-mode, which keeps the page
+    // protected and avoids the MTF vm-exit (and EPT flush) that follows.
+    // pages with an access window are opened up instead, so that the rest of
+    // a burst of accesses doesn't cause any vm-exits.
+    if (!window && emulate_memory_access(cpu, qualification))
+      return;
+
+    // only a single page is left accessible at a time
+    rearm_mmr_page(cpu->ept);
+
+    // large MMRs are protected with 2MB or 1GB pages, which are only split
+    // once they are actually accessed
+    if (!pte) {
+      pte = get_ept_pte(cpu->ept, physical_address, true);
+
+      // the PTEs inherit the permissions of the large page, so the other
+      // pages in the same region are still protected
+      if (pte)
+        flush_ept(cpu->ept);
+      else {
+        // out of EPT pages, so the whole large page is unprotected until
+        // the instruction has been executed. every page inside of it has
+        // the same mode, so it can be restored in the same way.
+        uint64_t page_size = 0;
+        pte = get_private_ept_leaf(cpu->ept, physical_address, page_size);
+
+        if (!pte) {
+          HV_LOG_ERROR("Failed to get MMR EPT entry. PhysAddr = %p.", physical_address);
+          inject_hw_exception(general_protection, 0);
+          return;
+        }
+
+        // the other pages in the large page can be written to without being
+        // copied first, so the snapshot can't be trusted anymore
+        if (page_size > 0x1000 && cpu->ept.snapshot_protected)
+          ghv.snapshot.overflowed = true;
+      }
     }
 
+    // the page is writable until the instruction has been executed, so the
+    // snapshot needs a copy of it first
+    if (cpu->ept.snapshot_protected)
+      copy_snapshot_page(ghv.snapshot, physical_address >> 12);
+
+    pte->read_access    = 1;
+    pte->write_access   = 1;
+    pte->execute_access = 1;
+
     cpu->ept.mmr_mtf_pte  = pte;
-    cpu->ept.mmr_mtf_mode = entry.mode;
+    cpu->ept.mmr_mtf_mode = page_mode;
+
+    // the page is re-protected before the vm-entry that follows the deadline,
+    // and the preemption timer makes sure that there is such a vm-entry
+    if (window) {
+      cpu->ept.mmr_window_deadline = __rdtsc() + window;
+      return;
+    }
 
     enable_monitor_trap_flag();
 
@@ -636,6 +1078,23 @@ void handle_ept_violation(vcpu* const cpu) {
     return;
   }
 
+  record_ept_hook_exit(*hook);
+
+  if (single_step_hot_ept_hook(cpu, *hook, qualification, pte, false))
+    return;
+
+  ++hook->flip_count;
+
+  auto const start_tsc = __rdtsc();
+
+  // switching to the execute view doesn't modify any paging structures, and
+  // the main view stays the same, so nothing needs to be flipped back later
+  if (qualification.execute_access && set_ept_view(cpu->ept, true)) {
+    ++cpu->ept.hook_stats.view_switch_count;
+    cpu->ept.hook_stats.view_switch_tsc += __rdtsc() - start_tsc;
+    return;
+  }
+
   if (qualification.execute_access) {
     pte->read_access       = 0;
     pte->write_access      = 0;
@@ -643,10 +1102,14 @@ void handle_ept_violation(vcpu* const cpu) {
     pte->page_frame_number = hook->exec_pfn;
   } else {
     pte->read_access       = 1;
-    pte->write_access      = 1;
     pte->execute_access    = 0;
     pte->page_frame_number = hook->orig_pfn;
+
+    set_ept_write_access(cpu->ept, *pte, true);
   }
+
+  ++cpu->ept.hook_stats.pte_flip_count;
+  cpu->ept.hook_stats.pte_flip_tsc += __rdtsc() - start_tsc;
 }
 
 void emulate_rdtsc(vcpu* const cpu) {
@@ -672,22 +1135,16 @@ void emulate_rdtscp(vcpu* const cpu) {
 }
 
 void handle_monitor_trap_flag(vcpu* const cpu) {
-  auto& pte       = cpu->ept.mmr_mtf_pte;
-  auto const mode = cpu->ept.mmr_mtf_mode;
-
-  // restore MMR mode
-  if (pte) {
-    pte->read_access    = !(mode & mmr_memory_mode_r);
-    pte->write_access   = !(mode & mmr_memory_mode_w);
-    pte->execute_access = !(mode & mmr_memory_mode_x);
+  // pages with an access window are re-protected once the window is over
+  if (!cpu->ept.mmr_window_deadline)
+    rearm_mmr_page(cpu->ept);
 
-    // write access but no read access will generate an EPT misconfiguration
-    if (pte->write_access && !pte->read_access)
-      pte->write_access = 0;
+  // hide the executable page from reads again
+  if (cpu->ept.hook_mtf_pte) {
+    cpu->ept.hook_mtf_pte->read_access = 0;
+    cpu->ept.hook_mtf_pte = nullptr;
 
-    pte = nullptr;
-
-    vmx_invept(invept_all_context, {});
+    flush_ept_views(cpu->ept);
   }
 
   disable_monitor_trap_flag();
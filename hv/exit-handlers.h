@@ -38,6 +38,8 @@ void emulate_lmsw(vcpu* cpu, uint16_t value);
 
 void handle_mov_cr(vcpu* cpu);
 
+void handle_mov_dr(vcpu* cpu);
+
 void handle_nmi_window(vcpu* cpu);
 
 void handle_exception_or_nmi(vcpu* cpu);
@@ -95,6 +95,27 @@ static bool find_offsets() {
   return true;
 }
 
+// remember which ranges of physical memory are backed by RAM
+static bool query_ram_ranges() {
+  auto const ranges = MmGetPhysicalMemoryRanges();
+  if (!ranges)
+    return false;
+
+  for (auto range = ranges; range->BaseAddress.QuadPart ||
+       range->NumberOfBytes.QuadPart; ++range) {
+    if (ghv.ram_range_count >= max_ram_range_count)
+      break;
+
+    auto& r = ghv.ram_ranges[ghv.ram_range_count++];
+    r.start = static_cast<uint64_t>(range->BaseAddress.QuadPart);
+    r.end   = r.start + static_cast<uint64_t>(range->NumberOfBytes.QuadPart);
+  }
+
+  ExFreePool(ranges);
+
+  return true;
+}
+
 // allocate the hypervisor and vcpus
 static bool create() {
   memset(&ghv, 0, sizeof(ghv));
@@ -120,6 +141,68 @@ static bool create() {
 
   DbgPrint("[hv] Allocated %u VCPUs (0x%zX bytes).\n", ghv.vcpu_count, arr_size);
 
+  if (!query_ram_ranges()) {
+    DbgPrint("[hv] Failed to query the physical memory ranges.\n");
+    return false;
+  }
+
+  // allocate the pages that are used for splitting EPT PDEs
+  if (!create_ept_page_pool(ghv.ept_page_pool,
+      ept_pool_pages_per_vcpu * ghv.vcpu_count)) {
+    DbgPrint("[hv] Failed to allocate the EPT page pool.\n");
+    return false;
+  }
+
+  DbgPrint("[hv] Allocated %zu EPT pool pages.\n", ghv.ept_page_pool.page_count);
+
+  // allocate the pages that shadow hooked pages
+  if (!create_ept_shadow_arena(ghv.ept_shadow_arena)) {
+    DbgPrint("[hv] Failed to allocate the EPT shadow arena.\n");
+    return false;
+  }
+
+  DbgPrint("[hv] Allocated %zu EPT shadow pages.\n", ept_shadow_arena_page_count);
+
+  ghv.vcpu_barrier_lock.initialize();
+  ghv.ept_hook_group_lock.initialize();
+
+  if (!create_access_sampler(ghv.access_sampler)) {
+    DbgPrint("[hv] Failed to allocate the access sampler.\n");
+    return false;
+  }
+
+  // allocate the pages that hold the original contents of written pages
+  if (!create_snapshot(ghv.snapshot)) {
+    DbgPrint("[hv] Failed to allocate the memory snapshot.\n");
+    return false;
+  }
+
+  DbgPrint("[hv] Allocated %zu snapshot pages.\n", snapshot_pool_page_count);
+
+  // allocate the MMR state outside of the vcpus, so that profiles and
+  // traces don't take up any memory unless they are enabled
+  if (!create_mmr_pool(ghv.mmr_pool, ghv.vcpu_count)) {
+    DbgPrint("[hv] Failed to allocate the MMR pool.\n");
+    return false;
+  }
+
+  // allocate the EPT identity map that is shared between vcpus
+  ghv.ept_identity = static_cast<ept_identity_map*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sizeof(ept_identity_map), 'fr0g'));
+
+  if (!ghv.ept_identity) {
+    DbgPrint("[hv] Failed to allocate the EPT identity map.\n");
+    return false;
+  }
+
+  if (!prepare_ept_identity_map(*ghv.ept_identity)) {
+    DbgPrint("[hv] Failed to prepare the EPT identity map.\n");
+    return false;
+  }
+
+  DbgPrint("[hv] Prepared the EPT identity map (%zu pages).\n",
+    ghv.ept_identity->table_page_count);
+
   if (!find_offsets()) {
     DbgPrint("[hv] Failed to find offsets.\n");
     return false;
@@ -185,6 +268,26 @@ void stop() {
   }
 
   ExFreePoolWithTag(ghv.vcpus, 'fr0g');
+
+  destroy_ept_page_pool(ghv.ept_page_pool);
+  destroy_ept_shadow_arena(ghv.ept_shadow_arena);
+  destroy_access_sampler(ghv.access_sampler);
+  destroy_snapshot(ghv.snapshot);
+  destroy_mmr_pool(ghv.mmr_pool);
+
+  destroy_ept_identity_map(*ghv.ept_identity);
+  ExFreePoolWithTag(ghv.ept_identity, 'fr0g');
+}
+
+// check whether a physical address is backed by RAM
+bool is_ram_address(uint64_t const physical_address) {
+  for (size_t i = 0; i < ghv.ram_range_count; ++i) {
+    auto const& range = ghv.ram_ranges[i];
+    if (physical_address >= range.start && physical_address < range.end)
+      return true;
+  }
+
+  return false;
 }
 
 } // namespace hv
@@ -4,6 +4,9 @@
 #include "hypercalls.h"
 #include "logger.h"
 #include "vmx.h"
+#include "ept.h"
+#include "access-sampler.h"
+#include "snapshot.h"
 
 #include <ntddk.h>
 
@@ -12,6 +15,15 @@ namespace hv {
 // signature that is returned by the ping hypercall
 inline constexpr uint64_t hypervisor_signature = 'fr0g';
 
+// maximum number of physical memory ranges that are backed by RAM
+inline constexpr size_t max_ram_range_count = 64;
+
+// a range of physical memory that is backed by RAM
+struct ram_range {
+  uint64_t start;
+  uint64_t end;
+};
+
 struct hypervisor {
   // host page tables that are shared between vcpus
   host_page_tables host_page_tables;
@@ -19,6 +31,37 @@ struct hypervisor {
   // logger that can be used in root-mode
   logger logger;
 
+  // pages that are used for EPT paging structures
+  ept_page_pool ept_page_pool;
+
+  // pages that are used as the executable side of EPT hooks
+  ept_shadow_arena ept_shadow_arena;
+
+  // held while vcpus wait on each other at a barrier, since two barriers
+  // that are waited on at the same time would deadlock
+  spin_lock vcpu_barrier_lock;
+
+  // EPT hook groups, which are switched on every vcpu at once
+  spin_lock ept_hook_group_lock;
+  ept_hook_group ept_hook_groups[ept_hook_group_count];
+
+  // histogram of the pages that the guest accesses
+  access_sampler access_sampler;
+
+  // copy-on-write snapshot of RAM
+  memory_snapshot snapshot;
+
+  // MMR index, profile, and trace of every vcpu
+  mmr_pool mmr_pool;
+
+  // EPT identity map that is shared between vcpus
+  ept_identity_map* ept_identity;
+
+  // physical memory that is backed by RAM, since MmGetPhysicalMemoryRanges()
+  // can't be called from root-mode
+  ram_range ram_ranges[max_ram_range_count];
+  size_t ram_range_count;
+
   // dynamically allocated array of vcpus
   unsigned long vcpu_count;
   struct vcpu* vcpus;
@@ -56,5 +99,8 @@ bool start();
 // devirtualize the current system
 void stop();
 
+// check whether a physical address is backed by RAM
+bool is_ram_address(uint64_t physical_address);
+
 } // namespace hv
 
@@ -5,6 +5,7 @@
 #include "hv.h"
 #include "exception-routines.h"
 #include "introspection.h"
+#include "work-queue.h"
 
 // first byte at the start of the image
 extern "C" uint8_t __ImageBase;
@@ -30,9 +31,9 @@ void test(vcpu* const cpu) {
   HV_LOG_INFO("ETHREAD:        %p.", current_guest_ethread());
   HV_LOG_INFO("PID:            %p.", current_guest_pid());
   HV_LOG_INFO("CPL:            %u.", current_guest_cpl());
-  HV_LOG_INFO("EPT USED PAGES: %u / %u.", 
-    static_cast<uint32_t>(cpu->ept.num_used_free_pages),
-    static_cast<uint32_t>(ept_free_page_count));
+  HV_LOG_INFO("EPT USED PAGES: %u / %u.",
+    static_cast<uint32_t>(ghv.ept_page_pool.page_count - ghv.ept_page_pool.free_count),
+    static_cast<uint32_t>(ghv.ept_page_pool.page_count));
 
   skip_instruction();
 }
@@ -453,38 +454,203 @@ void get_physical_address(vcpu* const cpu) {
   skip_instruction();
 }
 
-// hide a physical page from the guest
-void hide_physical_page(vcpu* const cpu) {
-  auto const pfn = cpu->ctx->rcx;
-  auto const pte = get_ept_pte(cpu->ept, pfn << 12, true);
+// get the txn op that redirects a physical range to the dummy page. the
+// permissions are kept so that MMRs and hooks in the range stay intact.
+static ept_txn_op get_hide_txn_op(vcpu_ept_data const& ept,
+    uint64_t const start, uint64_t const size) {
+  ept_txn_op op = {};
+  op.start            = start;
+  op.size             = size;
+  op.pfn              = ept.dummy_page_pfn;
+  op.remap            = ept_txn_remap_fixed;
+  op.keep_permissions = 1;
+  return op;
+}
 
-  // this can occur if we failed to split the PDE
-  if (!pte) {
-    cpu->ctx->rax = 0;
-    skip_instruction();
+// get the txn op that restores the identity mapping of every page in a
+// physical range that points to the dummy page
+static ept_txn_op get_unhide_txn_op(vcpu_ept_data const& ept,
+    uint64_t const start, uint64_t const size) {
+  ept_txn_op op = {};
+  op.start            = start;
+  op.size             = size;
+  op.pfn              = ept.dummy_page_pfn;
+  op.remap            = ept_txn_remap_identity;
+  op.keep_permissions = 1;
+  op.match_pfn        = 1;
+  return op;
+}
+
+// check whether a physical page is redirected to the dummy page
+static bool is_page_hidden(vcpu_ept_data& ept, uint64_t const physical_address) {
+  auto const pte = get_ept_pte(ept, physical_address);
+  return pte && pte->page_frame_number == ept.dummy_page_pfn;
+}
+
+// redirect a physical page to the dummy page
+static bool hide_page(vcpu_ept_data& ept, uint64_t const pfn) {
+  // this can fail if we failed to split the PDE
+  begin_ept_txn(ept);
+  queue_ept_txn_op(ept, get_hide_txn_op(ept, pfn << 12, 0x1000));
+  return commit_ept_txn(ept);
+}
+
+// restore the identity mapping of a physical page
+static void unhide_page(vcpu_ept_data& ept, uint64_t const pfn) {
+  // this can occur if we never hid the page in the first place
+  if (!is_page_hidden(ept, pfn << 12))
     return;
+
+  auto const op = get_unhide_txn_op(ept, pfn << 12, 0x1000);
+
+  begin_ept_txn(ept);
+  queue_ept_txn_op(ept, op);
+  commit_ept_txn(ept);
+}
+
+// add an MMR to the index and apply its EPT permissions. a specific entry
+// can be requested with idx, otherwise the first unused entry is taken.
+static vcpu_ept_mmr_entry* install_mmr_entry(vcpu_ept_data& ept, uint64_t const phys,
+    uint64_t const size, uint8_t const mode, size_t const idx = vcpu_ept_mmrs::capacity) {
+  // the page that was left accessible might not survive the transaction
+  rearm_mmr_page(ept);
+
+  auto const entry = insert_mmr(*ept.mmrs, phys, size, mode, idx);
+  if (!entry)
+    return nullptr;
+
+  // the permissions of every page are derived from the MMR index, so
+  // pages that are shared with other MMRs keep monitoring their modes too.
+  // large pages are only split when they are accessed (in the ept-violation
+  // handler), so huge MMRs don't need a PT for every 2MB of memory.
+  ept_txn_op op = {};
+  op.start           = phys;
+  op.size            = size;
+  op.remap           = ept_txn_remap_none;
+  op.read_access     = 1;
+  op.write_access    = 1;
+  op.execute_access  = 1;
+  op.mmr_permissions = 1;
+  op.large_pages     = 1;
+
+  // nothing is modified if any of the PDEs fail to be split
+  begin_ept_txn(ept);
+  queue_ept_txn_op(ept, op);
+
+  if (!commit_ept_txn(ept)) {
+    erase_mmr(*ept.mmrs, *entry);
+    return nullptr;
+  }
+
+  // the entry might have been used by an aggregating MMR before
+  if (ept.mmr_profile)
+    reset_mmr_profile(*ept.mmr_profile, entry - ept.mmrs->entries);
+
+  return entry;
+}
+
+// remove an MMR from the index and restore the EPT permissions of its pages
+static void remove_mmr_entry(vcpu_ept_data& ept, vcpu_ept_mmr_entry& entry) {
+  rearm_mmr_page(ept);
+
+  ept_txn_op op = {};
+  op.start           = entry.start;
+  op.size            = entry.size;
+  op.remap           = ept_txn_remap_identity;
+  op.read_access     = 1;
+  op.write_access    = 1;
+  op.execute_access  = 1;
+  op.mmr_permissions = 1;
+  op.large_pages     = 1;
+
+  auto const removed = entry;
+
+  // the filter is freed together with the entry
+  mmr_filter filter = {};
+  auto const filtered = entry.filter != 0;
+  if (filtered)
+    filter = *get_mmr_filter(*ept.mmrs, entry);
+
+  erase_mmr(*ept.mmrs, entry);
+
+  begin_ept_txn(ept);
+  queue_ept_txn_op(ept, op);
+
+  // put the MMR back since its pages are still being monitored
+  if (!commit_ept_txn(ept)) {
+    auto const restored = insert_mmr(*ept.mmrs, removed.start,
+      removed.size, removed.mode, &entry - ept.mmrs->entries);
+
+    if (restored && filtered)
+      attach_mmr_filter(*ept.mmrs, *restored, &filter);
+
+    if (restored)
+      restored->window = removed.window;
+  }
+}
+
+// restore the EPT permissions of every MMR and free every entry
+static void remove_all_mmr_entries(vcpu_ept_data& ept) {
+  auto& mmrs = *ept.mmrs;
+
+  rearm_mmr_page(ept);
+
+  while (mmrs.count > 0) {
+    begin_ept_txn(ept);
+
+    // removing from the end of the sorted array is the cheapest
+    for (size_t i = 0; i < ept_txn::capacity && mmrs.count > 0; ++i) {
+      auto& entry = mmrs.entries[mmrs.sorted[mmrs.count - 1]];
+
+      ept_txn_op op = {};
+      op.start           = entry.start;
+      op.size            = entry.size;
+      op.remap           = ept_txn_remap_identity;
+      op.read_access     = 1;
+      op.write_access    = 1;
+      op.execute_access  = 1;
+      op.mmr_permissions = 1;
+      op.large_pages     = 1;
+
+      // the entry is erased first so that large pages which only belonged
+      // to this MMR don't need to be split
+      erase_mmr(mmrs, entry);
+      queue_ept_txn_op(ept, op);
+    }
+
+    // every MMR in the batch is removed with a single flush
+    commit_ept_txn(ept);
+  }
+}
+
+// free the debug register of an MMR and free its entry
+static void remove_mmr_watch_entry(vcpu* const cpu, vcpu_ept_mmr_entry& entry) {
+  disarm_watchpoint(cpu, &entry - cpu->ept.mmrs->entries);
+  erase_mmr(*cpu->ept.mmrs, entry);
+}
+
+// free every debug register that serves an MMR and free their entries
+static void remove_all_mmr_watch_entries(vcpu* const cpu) {
+  for (size_t i = 0; i < watchpoint_capacity; ++i) {
+    if (auto const mmr = cpu->watchpoints.mmrs[i])
+      remove_mmr_watch_entry(cpu, cpu->ept.mmrs->entries[mmr - 1]);
   }
+}
 
-  pte->page_frame_number = cpu->ept.dummy_page_pfn;
-  vmx_invept(invept_all_context, {});
+// hide a physical page from the guest
+void hide_physical_page(vcpu* const cpu) {
+  auto const pfn = cpu->ctx->rcx;
+
+  cpu->ctx->rax = hide_page(cpu->ept, pfn);
 
-  cpu->ctx->rax = 1;
   skip_instruction();
 }
 
 // unhide a physical page from the guest
 void unhide_physical_page(vcpu* const cpu) {
   auto const pfn = cpu->ctx->rcx;
-  auto const pte = get_ept_pte(cpu->ept, pfn << 12, false);
-
-  // this can occur if we never hid the page in the first place
-  if (!pte) {
-    skip_instruction();
-    return;
-  }
 
-  pte->page_frame_number = pfn;
-  vmx_invept(invept_all_context, {});
+  unhide_page(cpu->ept, pfn);
 
   skip_instruction();
 }
@@ -498,103 +664,37 @@ void get_hv_base(vcpu* const cpu) {
 // write to the logger whenever a certain physical memory range is accessed
 void install_mmr(vcpu* const cpu) {
   auto const phys = cpu->ctx->rcx;
-  auto const size = static_cast<uint32_t>(cpu->ctx->rdx);
-  auto const mode = static_cast<uint8_t>(cpu->ctx->r8 & 0b111);
+  auto const size = cpu->ctx->rdx;
+  auto const mode = static_cast<uint8_t>(cpu->ctx->r8 & mmr_memory_mode_mask);
 
   // return null by default
   cpu->ctx->rax = 0;
 
   // TODO: check for overlap with EPT hooking
 
-  vcpu_ept_mmr_entry* entry = nullptr;
-
-  for (auto& e : cpu->ept.mmr) {
-    if (e.size != 0)
-      continue;
-
-    entry = &e;
-    break;
-  }
-
-  // all entries are in use
-  if (!entry) {
-    skip_instruction();
-    return;
-  }
-
-  entry->mode  = mode;
-  entry->start = phys;
-  entry->size  = size;
-
-  for (auto addr = phys; addr < phys + size; addr += 0x1000) {
-    auto const pte = get_ept_pte(cpu->ept, addr, true);
-    if (!pte) {
-      // TODO: properly handle errors, i.e. restore previous PTE permissions
-      skip_instruction();
-      return;
-    }
-
-    pte->read_access    = !(mode & mmr_memory_mode_r);
-    pte->write_access   = !(mode & mmr_memory_mode_w);
-    pte->execute_access = !(mode & mmr_memory_mode_x);
-
-    // write access but no read access will generate an EPT misconfiguration
-    if (pte->write_access && !pte->read_access)
-      pte->write_access = 0;
-  }
-
-  vmx_invept(invept_all_context, {});
+  cpu->ctx->rax = reinterpret_cast<uint64_t>(
+    install_mmr_entry(cpu->ept, phys, size, mode));
 
-  cpu->ctx->rax = reinterpret_cast<uint64_t>(entry);
   skip_instruction();
 }
 
 // remove a monitored memory range
 void remove_mmr(vcpu* cpu) {
-  auto const entry = reinterpret_cast<vcpu_ept_mmr_entry*>(cpu->ctx->rcx);
-
-  for (auto addr = entry->start; addr < entry->start + entry->size; addr += 0x1000) {
-    auto const pte = get_ept_pte(cpu->ept, addr, true);
-    if (!pte) {
-      // TODO: properly handle errors, i.e. restore previous PTE permissions
-      skip_instruction();
-      return;
-    }
-
-    pte->read_access    = 1;
-    pte->write_access   = 1;
-    pte->execute_access = 1;
-  }
+  auto const entry = get_mmr(*cpu->ept.mmrs, cpu->ctx->rcx);
 
-  entry->size = 0;
-  vmx_invept(invept_all_context, {});
+  if (entry && entry->watched)
+    remove_mmr_watch_entry(cpu, *entry);
+  else if (entry)
+    remove_mmr_entry(cpu->ept, *entry);
 
   skip_instruction();
 }
 
 // remove every installed MMR
 void remove_all_mmrs(vcpu* const cpu) {
-  for (auto& entry : cpu->ept.mmr) {
-    if (entry.size == 0)
-      continue;
-
-    for (auto addr = entry.start; addr < entry.start + entry.size; addr += 0x1000) {
-      auto const pte = get_ept_pte(cpu->ept, addr, true);
-      if (!pte) {
-        // TODO: properly handle errors, i.e. restore previous PTE permissions
-        skip_instruction();
-        return;
-      }
+  remove_all_mmr_entries(cpu->ept);
+  remove_all_mmr_watch_entries(cpu);
 
-      pte->read_access    = 1;
-      pte->write_access   = 1;
-      pte->execute_access = 1;
-    }
-
-    entry.size = 0;
-  }
-
-  vmx_invept(invept_all_context, {});
   skip_instruction();
 }
 
@@ -637,5 +737,1799 @@ void get_message_sender(vcpu* const cpu) {
   skip_instruction();
 }
 
+// arguments for an EPT operation that is applied on every vcpu
+struct global_ept_op {
+  uint64_t args[4];
+
+  // set by any vcpu that failed to apply the operation
+  long volatile failed;
+};
+
+// copy a buffer to guest virtual memory (in the current address space).
+// returns false if part of the destination isn't mapped.
+static bool write_guest_buffer(uint64_t const gva,
+    void const* const src, size_t const size) {
+  for (size_t bytes_written = 0; bytes_written < size;) {
+    size_t dst_remaining = 0;
+
+    auto const dst = gva2hva(reinterpret_cast<void*>(gva + bytes_written), &dst_remaining);
+    if (!dst)
+      return false;
+
+    auto const curr_size = min(size - bytes_written, dst_remaining);
+
+    host_exception_info e;
+    memcpy_safe(e, dst, static_cast<uint8_t const*>(src) + bytes_written, curr_size);
+
+    if (e.exception_occurred)
+      return false;
+
+    bytes_written += curr_size;
+  }
+
+  return true;
+}
+
+// copy a buffer from guest virtual memory (in the current address space).
+// returns false if part of the source isn't mapped.
+static bool read_guest_buffer(uint64_t const gva,
+    void* const dst, size_t const size) {
+  for (size_t bytes_read = 0; bytes_read < size;) {
+    size_t src_remaining = 0;
+
+    auto const src = gva2hva(reinterpret_cast<void*>(gva + bytes_read), &src_remaining);
+    if (!src)
+      return false;
+
+    auto const curr_size = min(size - bytes_read, src_remaining);
+
+    host_exception_info e;
+    memcpy_safe(e, static_cast<uint8_t*>(dst) + bytes_read, src, curr_size);
+
+    if (e.exception_occurred)
+      return false;
+
+    bytes_read += curr_size;
+  }
+
+  return true;
+}
+
+// write the shootdown latency of a global operation to the guest, if requested
+static void write_shootdown_latency(uint64_t const gva, uint64_t const latency) {
+  if (!gva)
+    return;
+
+  size_t remaining = 0;
+  auto const hva = gva2hva(reinterpret_cast<void*>(gva), &remaining);
+
+  // the operation has already been applied at this point, so don't
+  // bother injecting a #PF
+  if (!hva || remaining < sizeof(latency))
+    return;
+
+  host_exception_info e;
+  memcpy_safe(e, hva, &latency, sizeof(latency));
+}
+
+// get the index of an MMR entry that belongs to any vcpu
+static bool get_mmr_index(uint64_t const handle, size_t& idx) {
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    auto const first = reinterpret_cast<uint64_t>(&ghv.mmr_pool.mmrs[i].entries[0]);
+    auto const last  = first + sizeof(ghv.mmr_pool.mmrs[i].entries);
+
+    if (handle < first || handle >= last)
+      continue;
+
+    if ((handle - first) % sizeof(vcpu_ept_mmr_entry) != 0)
+      return false;
+
+    idx = (handle - first) / sizeof(vcpu_ept_mmr_entry);
+    return true;
+  }
+
+  return false;
+}
+
+static void install_ept_hook_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op = static_cast<global_ept_op*>(ctx);
+  if (!install_ept_hook(cpu->ept, op->args[0], op->args[1]))
+    _InterlockedExchange(&op->failed, 1);
+}
+
+static void remove_ept_hook_on_vcpu(vcpu* const cpu, void* const ctx) {
+  remove_ept_hook(cpu->ept, static_cast<global_ept_op*>(ctx)->args[0]);
+}
+
+static void hide_page_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op = static_cast<global_ept_op*>(ctx);
+  if (!hide_page(cpu->ept, op->args[0]))
+    _InterlockedExchange(&op->failed, 1);
+}
+
+static void unhide_page_on_vcpu(vcpu* const cpu, void* const ctx) {
+  unhide_page(cpu->ept, static_cast<global_ept_op*>(ctx)->args[0]);
+}
+
+// args: slot index, physical address, size, mode
+static void install_mmr_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op = static_cast<global_ept_op*>(ctx);
+
+  // this also fails if the slot was taken by a local MMR on this vcpu
+  if (!install_mmr_entry(cpu->ept, op->args[1], op->args[2],
+      static_cast<uint8_t>(op->args[3]), op->args[0]))
+    _InterlockedExchange(&op->failed, 1);
+}
+
+// args: slot index, physical address, size, mode
+static void rollback_mmr_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op    = static_cast<global_ept_op*>(ctx);
+  auto&      entry = cpu->ept.mmrs->entries[op->args[0]];
+
+  // only remove the entry if it was installed by install_mmr_on_vcpu()
+  if (!entry.watched &&
+      entry.size  == op->args[2] &&
+      entry.mode  == op->args[3] &&
+      entry.start == op->args[1])
+    remove_mmr_entry(cpu->ept, entry);
+}
+
+static void remove_mmr_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto& entry = cpu->ept.mmrs->entries[static_cast<global_ept_op*>(ctx)->args[0]];
+  if (entry.size != 0 && entry.watched)
+    remove_mmr_watch_entry(cpu, entry);
+  else if (entry.size != 0)
+    remove_mmr_entry(cpu->ept, entry);
+}
+
+static void remove_all_mmrs_on_vcpu(vcpu* const cpu, void*) {
+  remove_all_mmr_entries(cpu->ept);
+  remove_all_mmr_watch_entries(cpu);
+}
+
+// install an EPT hook on every logical processor
+void install_ept_hook_global(vcpu* const cpu) {
+  global_ept_op op = {};
+  op.args[0] = cpu->ctx->rcx;
+  op.args[1] = cpu->ctx->rdx;
+
+  auto latency = run_on_all_vcpus(cpu, install_ept_hook_on_vcpu, &op);
+
+  // don't leave the hook installed on only some of the vcpus
+  if (op.failed)
+    latency += run_on_all_vcpus(cpu, remove_ept_hook_on_vcpu, &op);
+
+  write_shootdown_latency(cpu->ctx->r8, latency);
+
+  cpu->ctx->rax = !op.failed;
+  skip_instruction();
+}
+
+// remove an EPT hook from every logical processor
+void remove_ept_hook_global(vcpu* const cpu) {
+  global_ept_op op = {};
+  op.args[0] = cpu->ctx->rcx;
+
+  write_shootdown_latency(cpu->ctx->rdx,
+    run_on_all_vcpus(cpu, remove_ept_hook_on_vcpu, &op));
+
+  skip_instruction();
+}
+
+// hide a physical page from the guest on every logical processor
+void hide_physical_page_global(vcpu* const cpu) {
+  global_ept_op op = {};
+  op.args[0] = cpu->ctx->rcx;
+
+  auto latency = run_on_all_vcpus(cpu, hide_page_on_vcpu, &op);
+
+  if (op.failed)
+    latency += run_on_all_vcpus(cpu, unhide_page_on_vcpu, &op);
+
+  write_shootdown_latency(cpu->ctx->rdx, latency);
+
+  cpu->ctx->rax = !op.failed;
+  skip_instruction();
+}
+
+// unhide a physical page from the guest on every logical processor
+void unhide_physical_page_global(vcpu* const cpu) {
+  global_ept_op op = {};
+  op.args[0] = cpu->ctx->rcx;
+
+  write_shootdown_latency(cpu->ctx->rdx,
+    run_on_all_vcpus(cpu, unhide_page_on_vcpu, &op));
+
+  skip_instruction();
+}
+
+// install an MMR on every logical processor. the same slot is used on
+// every vcpu, so the returned handle works with remove_mmr_global().
+void install_mmr_global(vcpu* const cpu) {
+  auto const phys = cpu->ctx->rcx;
+  auto const size = cpu->ctx->rdx;
+  auto const mode = static_cast<uint8_t>(cpu->ctx->r8 & mmr_memory_mode_mask);
+
+  // return null by default
+  cpu->ctx->rax = 0;
+
+  auto const idx = find_free_mmr(*cpu->ept.mmrs);
+
+  // all entries are in use
+  if (idx >= vcpu_ept_mmrs::capacity || size == 0) {
+    skip_instruction();
+    return;
+  }
+
+  global_ept_op op = {};
+  op.args[0] = idx;
+  op.args[1] = phys;
+  op.args[2] = size;
+  op.args[3] = mode;
+
+  auto latency = run_on_all_vcpus(cpu, install_mmr_on_vcpu, &op);
+
+  if (op.failed)
+    latency += run_on_all_vcpus(cpu, rollback_mmr_on_vcpu, &op);
+  else
+    cpu->ctx->rax = reinterpret_cast<uint64_t>(&cpu->ept.mmrs->entries[idx]);
+
+  write_shootdown_latency(cpu->ctx->r9, latency);
+
+  skip_instruction();
+}
+
+// remove an MMR that was installed with install_mmr_global()
+void remove_mmr_global(vcpu* const cpu) {
+  global_ept_op op = {};
+
+  // ignore handles that don't point to an MMR entry
+  if (!get_mmr_index(cpu->ctx->rcx, op.args[0])) {
+    skip_instruction();
+    return;
+  }
+
+  write_shootdown_latency(cpu->ctx->rdx,
+    run_on_all_vcpus(cpu, remove_mmr_on_vcpu, &op));
+
+  skip_instruction();
+}
+
+// remove every installed MMR on every logical processor
+void remove_all_mmrs_global(vcpu* const cpu) {
+  write_shootdown_latency(cpu->ctx->rcx,
+    run_on_all_vcpus(cpu, remove_all_mmrs_on_vcpu, nullptr));
+
+  skip_instruction();
+}
+
+// physically contiguous ranges that are hidden/unhidden on every vcpu with
+// a single EPT transaction (and a single flush) per vcpu
+struct physical_range_batch {
+  struct {
+    uint64_t start;
+    uint64_t size;
+  } runs[ept_txn::capacity];
+
+  size_t run_count;
+  size_t page_count;
+
+  // set by any vcpu that failed to commit the batch
+  long volatile failed;
+};
+
+static void hide_range_batch_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const batch = static_cast<physical_range_batch*>(ctx);
+
+  begin_ept_txn(cpu->ept);
+
+  for (size_t i = 0; i < batch->run_count; ++i) {
+    queue_ept_txn_op(cpu->ept, get_hide_txn_op(cpu->ept,
+      batch->runs[i].start, batch->runs[i].size));
+  }
+
+  if (!commit_ept_txn(cpu->ept))
+    _InterlockedExchange(&batch->failed, 1);
+}
+
+static void unhide_range_batch_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const batch = static_cast<physical_range_batch*>(ctx);
+
+  begin_ept_txn(cpu->ept);
+
+  for (size_t i = 0; i < batch->run_count; ++i) {
+    queue_ept_txn_op(cpu->ept, get_unhide_txn_op(cpu->ept,
+      batch->runs[i].start, batch->runs[i].size));
+  }
+
+  if (!commit_ept_txn(cpu->ept))
+    _InterlockedExchange(&batch->failed, 1);
+}
+
+// apply a batch on every vcpu and start a new one. returns false if the
+// batch couldn't be applied, in which case nothing from it is left behind.
+static bool flush_physical_range_batch(vcpu* const cpu,
+    physical_range_batch& batch, bool const hide, uint64_t& latency) {
+  if (batch.run_count > 0) {
+    latency += run_on_all_vcpus(cpu, hide ?
+      hide_range_batch_on_vcpu : unhide_range_batch_on_vcpu, &batch);
+
+    // don't leave the batch applied on only some of the vcpus. pages that
+    // were already hidden aren't part of the batch, so this only unhides
+    // the pages that the batch hid.
+    if (batch.failed && hide)
+      latency += run_on_all_vcpus(cpu, unhide_range_batch_on_vcpu, &batch);
+  }
+
+  batch.run_count  = 0;
+  batch.page_count = 0;
+
+  return !batch.failed;
+}
+
+// hide or unhide every page in a GPA range or a (cr3, gva) range on every
+// vcpu. returns the number of pages that were modified.
+static uint64_t apply_physical_range(vcpu* const cpu, bool const hide) {
+  auto const ctx = cpu->ctx;
+
+  // arguments
+  cr3 guest_cr3 = ghv.system_cr3;
+  if (ctx->rcx)
+    guest_cr3.flags = ctx->rcx;
+
+  auto const start      = ctx->rdx & ~0xFFFull;
+  auto const end        = (ctx->rdx + ctx->r8 + 0xFFF) & ~0xFFFull;
+  auto const is_virtual = (ctx->r9 & 1) != 0;
+
+  physical_range_batch batch;
+  batch.run_count  = 0;
+  batch.page_count = 0;
+  batch.failed     = 0;
+
+  uint64_t latency = 0, modified_pages = 0;
+
+  for (auto addr = start; addr < end; addr += 0x1000) {
+    auto gpa = addr;
+
+    if (is_virtual) {
+      gpa = gva2gpa(guest_cr3, reinterpret_cast<void*>(addr)) & ~0xFFFull;
+
+      // pages that aren't mapped in have no physical memory to hide
+      if (!gpa)
+        continue;
+    }
+
+    // pages that are already in the requested state are left out, so that
+    // a failed batch can be rolled back without touching them
+    if (is_page_hidden(cpu->ept, gpa) == hide)
+      continue;
+
+    // extend the previous run if this page is physically contiguous
+    if (batch.run_count > 0) {
+      auto& run = batch.runs[batch.run_count - 1];
+
+      if (run.start + run.size == gpa) {
+        run.size += 0x1000;
+        ++batch.page_count;
+        continue;
+      }
+    }
+
+    if (batch.run_count >= ept_txn::capacity) {
+      auto const page_count = batch.page_count;
+
+      if (!flush_physical_range_batch(cpu, batch, hide, latency))
+        break;
+
+      modified_pages += page_count;
+    }
+
+    batch.runs[batch.run_count].start = gpa;
+    batch.runs[batch.run_count].size  = 0x1000;
+    ++batch.run_count;
+    ++batch.page_count;
+  }
+
+  auto const page_count = batch.page_count;
+  if (!batch.failed && flush_physical_range_batch(cpu, batch, hide, latency))
+    modified_pages += page_count;
+
+  write_shootdown_latency(ctx->r10, latency);
+
+  return modified_pages;
+}
+
+// hide a GPA range or a (cr3, gva) range from the guest on every logical processor
+void hide_physical_range(vcpu* const cpu) {
+  cpu->ctx->rax = apply_physical_range(cpu, true);
+  skip_instruction();
+}
+
+// unhide a GPA range or a (cr3, gva) range on every logical processor
+void unhide_physical_range(vcpu* const cpu) {
+  cpu->ctx->rax = apply_physical_range(cpu, false);
+  skip_instruction();
+}
+
+// maximum number of guest pages that a single dirty bitmap can span. this
+// covers 2GB of physical memory per hypercall.
+inline constexpr size_t dirty_bitmap_max_pages = 16;
+
+// the guest's dirty bitmap, which every vcpu reports its dirty pages into
+struct dirty_bitmap_op {
+  // page-aligned physical range that the bitmap covers
+  uint64_t start;
+  uint64_t size;
+
+  // HVAs of the guest pages that the bitmap lives in
+  uint8_t* pages[dirty_bitmap_max_pages];
+
+  // offset of the bitmap into the first page
+  uint64_t offset;
+};
+
+// get the byte in the guest's dirty bitmap that holds the specified bit
+static uint8_t volatile* get_dirty_bitmap_byte(dirty_bitmap_op const& op, uint64_t const bit) {
+  auto const offset = op.offset + (bit >> 3);
+  return op.pages[offset >> 12] + (offset & 0xFFF);
+}
+
+// set the bit of every page in a dirty range
+static void set_dirty_bits(uint64_t const physical_address,
+    uint64_t const size, void* const ctx) {
+  auto const& op = *static_cast<dirty_bitmap_op*>(ctx);
+
+  auto bit       = (physical_address - op.start) >> 12;
+  auto const end = (physical_address + size - op.start) >> 12;
+
+  // other vcpus are writing to the same bitmap
+  while (bit < end) {
+    if ((bit & 7) == 0 && bit + 8 <= end) {
+      _InterlockedOr8(reinterpret_cast<char volatile*>(get_dirty_bitmap_byte(op, bit)),
+        static_cast<char>(0xFF));
+      bit += 8;
+    }
+    else {
+      _InterlockedOr8(reinterpret_cast<char volatile*>(get_dirty_bitmap_byte(op, bit)),
+        static_cast<char>(1 << (bit & 7)));
+      ++bit;
+    }
+  }
+}
+
+static void start_dirty_log_on_vcpu(vcpu* const cpu, void* const ctx) {
+  if (!set_ept_dirty_logging(cpu->ept, true))
+    _InterlockedExchange(&static_cast<global_ept_op*>(ctx)->failed, 1);
+}
+
+static void stop_dirty_log_on_vcpu(vcpu* const cpu, void*) {
+  set_ept_dirty_logging(cpu->ept, false);
+}
+
+// the flush makes sure that the next write to a page that was reported
+// sets its dirty flag again, instead of using a cached translation
+static void fetch_dirty_bitmap_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op = static_cast<dirty_bitmap_op*>(ctx);
+
+  collect_ept_dirty_pages(cpu->ept, op->start, op->size, set_dirty_bits, op);
+  flush_ept(cpu->ept);
+}
+
+// enable the EPT dirty flags on every logical processor
+void start_dirty_log(vcpu* const cpu) {
+  global_ept_op op = {};
+
+  auto latency = run_on_all_vcpus(cpu, start_dirty_log_on_vcpu, &op);
+
+  // don't leave some of the vcpus logging
+  if (op.failed)
+    latency += run_on_all_vcpus(cpu, stop_dirty_log_on_vcpu, &op);
+
+  write_shootdown_latency(cpu->ctx->rcx, latency);
+
+  cpu->ctx->rax = !op.failed;
+  skip_instruction();
+}
+
+// disable the EPT dirty flags on every logical processor
+void stop_dirty_log(vcpu* const cpu) {
+  write_shootdown_latency(cpu->ctx->rcx,
+    run_on_all_vcpus(cpu, stop_dirty_log_on_vcpu, nullptr));
+
+  skip_instruction();
+}
+
+// write a bitmap of the pages in a GPA range that were written to since
+// the last call, and clear their dirty flags on every logical processor.
+// at most 2GB are processed at once, and the number of bytes of the range
+// that were processed is returned (0 on failure).
+void fetch_and_clear_dirty_bitmap(vcpu* const cpu) {
+  auto const ctx    = cpu->ctx;
+  auto const bitmap = ctx->r8;
+
+  // return 0 by default
+  ctx->rax = 0;
+
+  dirty_bitmap_op op = {};
+  op.start  = ctx->rcx & ~0xFFFull;
+  op.size   = ((ctx->rcx + ctx->rdx + 0xFFF) & ~0xFFFull) - op.start;
+  op.offset = bitmap & 0xFFF;
+
+  // limit the range to what fits in the bitmap pages. this is always a
+  // multiple of 8 pages so that the next call starts on a new byte.
+  auto const max_size = (dirty_bitmap_max_pages * 0x1000 - op.offset) * 8 * 0x1000;
+  if (op.size > max_size)
+    op.size = max_size;
+
+  if (!cpu->ept.dirty_logging || op.size == 0 || !bitmap) {
+    skip_instruction();
+    return;
+  }
+
+  auto const bitmap_size = ((op.size >> 12) + 7) / 8;
+
+  // the bitmap is cleared here, so other vcpus only need to set bits
+  for (uint64_t addr = bitmap & ~0xFFFull, i = 0;
+       addr < bitmap + bitmap_size; addr += 0x1000, ++i) {
+    size_t remaining = 0;
+    op.pages[i] = static_cast<uint8_t*>(gva2hva(reinterpret_cast<void*>(addr), &remaining));
+
+    auto const clear_start = (addr < bitmap) ? op.offset : 0;
+
+    if (!op.pages[i]) {
+      // guest virtual address that caused the fault
+      ctx->cr2 = addr + clear_start;
+
+      page_fault_exception error;
+      error.flags = 0;
+      error.present = 0;
+      error.write = 1;
+      error.user_mode_access = (current_guest_cpl() == 3);
+
+      inject_hw_exception(page_fault, error.flags);
+      return;
+    }
+
+    auto clear_end = bitmap + bitmap_size - addr;
+    if (clear_end > 0x1000)
+      clear_end = 0x1000;
+
+    memset(op.pages[i] + clear_start, 0, clear_end - clear_start);
+  }
+
+  write_shootdown_latency(ctx->r9,
+    run_on_all_vcpus(cpu, fetch_dirty_bitmap_on_vcpu, &op));
+
+  ctx->rax = op.size;
+  skip_instruction();
+}
+
+static void set_ept_exec_view_on_vcpu(vcpu* const cpu, void* const ctx) {
+  set_ept_exec_view_enabled(cpu->ept, static_cast<global_ept_op*>(ctx)->args[0] != 0);
+}
+
+// enable or disable the EPT execute view for hooks on every logical processor.
+// while it is disabled, hooks modify their PTE on every switch instead.
+// returns whether the execute view was enabled before.
+void set_ept_exec_view(vcpu* const cpu) {
+  global_ept_op op = {};
+  op.args[0] = cpu->ctx->rcx;
+
+  cpu->ctx->rax = cpu->ept.exec_view_enabled;
+
+  write_shootdown_latency(cpu->ctx->rdx,
+    run_on_all_vcpus(cpu, set_ept_exec_view_on_vcpu, &op));
+
+  skip_instruction();
+}
+
+// get the EPT hook statistics of every logical processor combined, and
+// optionally reset them. the counters of other vcpus are read while they
+// are running, so the result is only approximate.
+void query_ept_hook_stats(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  ept_hook_stats stats = {};
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    auto& s = ghv.vcpus[i].ept.hook_stats;
+
+    stats.view_switch_count += s.view_switch_count;
+    stats.view_switch_tsc   += s.view_switch_tsc;
+    stats.pte_flip_count    += s.pte_flip_count;
+    stats.pte_flip_tsc      += s.pte_flip_tsc;
+    stats.view_build_count  += s.view_build_count;
+    stats.view_build_tsc    += s.view_build_tsc;
+
+    if (ctx->rdx)
+      s = {};
+  }
+
+  ctx->rax = write_guest_buffer(ctx->rcx, &stats, sizeof(stats));
+  skip_instruction();
+}
+
+// get the per-hook counters of every EPT hook on this logical processor,
+// combined with the counters of the same hook on every other vcpu. returns
+// the number of hooks that were written.
+void query_ept_hooks(vcpu* const cpu) {
+  auto const ctx       = cpu->ctx;
+  auto const max_count = ctx->rdx;
+
+  uint64_t count = 0;
+
+  for (auto const bucket : cpu->ept.hooks.buckets) {
+    for (auto hook = bucket; hook && count < max_count; hook = hook->next) {
+      ept_hook_info info = {};
+      info.orig_pfn = hook->orig_pfn;
+      info.exec_pfn = hook->exec_pfn;
+
+      for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+        auto const other = find_ept_hook(ghv.vcpus[i].ept, hook->orig_pfn);
+        if (!other)
+          continue;
+
+        info.exit_count += other->exit_count;
+        info.flip_count += other->flip_count;
+        info.hot_count  += other->hot;
+      }
+
+      if (!write_guest_buffer(ctx->rcx + count * sizeof(info), &info, sizeof(info)))
+        break;
+
+      ++count;
+    }
+  }
+
+  ctx->rax = count;
+  skip_instruction();
+}
+
+// maximum number of pages that a single shadow hook hypercall processes
+inline constexpr size_t shadow_ept_hook_batch_max = 64;
+
+// args: hook batch, hook count
+static void install_shadow_ept_hooks_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op    = static_cast<global_ept_op*>(ctx);
+  auto const hooks = reinterpret_cast<shadow_ept_hook const*>(op->args[0]);
+
+  for (size_t i = 0; i < op->args[1]; ++i) {
+    if (!install_ept_hook(cpu->ept, hooks[i].orig_pfn, hooks[i].shadow_gpa >> 12)) {
+      _InterlockedExchange(&op->failed, 1);
+      return;
+    }
+  }
+}
+
+// args: hook batch, hook count
+static void rollback_shadow_ept_hooks_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op    = static_cast<global_ept_op*>(ctx);
+  auto const hooks = reinterpret_cast<shadow_ept_hook const*>(op->args[0]);
+
+  for (size_t i = 0; i < op->args[1]; ++i)
+    remove_ept_hook(cpu->ept, hooks[i].orig_pfn);
+}
+
+// args: PFN batch, PFN count
+static void remove_shadow_ept_hooks_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op   = static_cast<global_ept_op*>(ctx);
+  auto const pfns = reinterpret_cast<uint64_t const*>(op->args[0]);
+
+  for (size_t i = 0; i < op->args[1]; ++i)
+    remove_ept_hook(cpu->ept, pfns[i]);
+}
+
+// write a patch into the shadow pages of a hook batch
+static bool apply_shadow_ept_patch(shadow_ept_hook const* const hooks,
+    size_t const count, shadow_ept_patch const& patch) {
+  for (uint64_t offset = 0; offset < patch.size;) {
+    auto const pa        = patch.physical_address + offset;
+    auto const curr_size = min(patch.size - offset, 0x1000 - (pa & 0xFFF));
+
+    // pieces that land in a page outside of this batch are ignored, so the
+    // same patch list can be passed with every batch
+    for (size_t i = 0; i < count; ++i) {
+      if (hooks[i].orig_pfn != (pa >> 12))
+        continue;
+
+      auto const dst = host_physical_memory_base + hooks[i].shadow_gpa + (pa & 0xFFF);
+      if (!read_guest_buffer(patch.data + offset, dst, curr_size))
+        return false;
+    }
+
+    offset += curr_size;
+  }
+
+  return true;
+}
+
+// clone a batch of pages into the shadow page arena, patch the clones, and
+// hook the original pages on every logical processor. the shadow GPAs are
+// written back to the guest's hook array. returns the number of hooks that
+// were installed, which is 0 if any page in the batch failed.
+void install_shadow_ept_hooks(vcpu* const cpu) {
+  auto const ctx         = cpu->ctx;
+  auto const count       = min(ctx->rdx, shadow_ept_hook_batch_max);
+  auto const patch_count = ctx->r9;
+
+  ctx->rax = 0;
+
+  shadow_ept_hook hooks[shadow_ept_hook_batch_max];
+  if (!read_guest_buffer(ctx->rcx, hooks, count * sizeof(hooks[0]))) {
+    skip_instruction();
+    return;
+  }
+
+  size_t cloned = 0;
+
+  for (; cloned < count; ++cloned) {
+    auto& hook = hooks[cloned];
+
+    // a page that is already hooked would keep its shadow page on some
+    // vcpus, and a page can't be cloned twice in the same batch
+    if (find_ept_hook(cpu->ept, hook.orig_pfn))
+      break;
+
+    bool duplicate = false;
+    for (size_t i = 0; i < cloned; ++i)
+      duplicate |= (hooks[i].orig_pfn == hook.orig_pfn);
+
+    if (duplicate)
+      break;
+
+    auto const pfn = alloc_ept_shadow_page(ghv.ept_shadow_arena);
+    if (!pfn)
+      break;
+
+    hook.shadow_gpa = pfn << 12;
+
+    host_exception_info e;
+    memcpy_safe(e, host_physical_memory_base + hook.shadow_gpa,
+      host_physical_memory_base + (hook.orig_pfn << 12), 0x1000);
+
+    if (e.exception_occurred) {
+      free_ept_shadow_page(ghv.ept_shadow_arena, pfn);
+      break;
+    }
+  }
+
+  bool success = (cloned == count);
+
+  for (uint64_t i = 0; success && i < patch_count; ++i) {
+    shadow_ept_patch patch;
+
+    success = read_guest_buffer(ctx->r8 + i * sizeof(patch), &patch, sizeof(patch)) &&
+      apply_shadow_ept_patch(hooks, count, patch);
+  }
+
+  // this is done before installing the hooks so that the guest is never
+  // left with hooks that it doesn't know the shadow pages of
+  success = success && write_guest_buffer(ctx->rcx, hooks, count * sizeof(hooks[0]));
+
+  if (success) {
+    global_ept_op op = {};
+    op.args[0] = reinterpret_cast<uint64_t>(hooks);
+    op.args[1] = count;
+
+    auto latency = run_on_all_vcpus(cpu, install_shadow_ept_hooks_on_vcpu, &op);
+
+    // don't leave the batch installed on only some of the vcpus
+    if (op.failed)
+      latency += run_on_all_vcpus(cpu, rollback_shadow_ept_hooks_on_vcpu, &op);
+
+    write_shootdown_latency(ctx->r10, latency);
+
+    success = !op.failed;
+  }
+
+  if (success)
+    ctx->rax = count;
+  else {
+    for (size_t i = 0; i < cloned; ++i)
+      free_ept_shadow_page(ghv.ept_shadow_arena, hooks[i].shadow_gpa >> 12);
+  }
+
+  skip_instruction();
+}
+
+// remove a batch of EPT hooks on every logical processor and give their
+// shadow pages back to the arena. hooks that don't use a shadow page are
+// removed as well. returns the number of PFNs that were processed.
+void remove_shadow_ept_hooks(vcpu* const cpu) {
+  auto const ctx   = cpu->ctx;
+  auto const count = min(ctx->rdx, shadow_ept_hook_batch_max);
+
+  ctx->rax = 0;
+
+  uint64_t pfns[shadow_ept_hook_batch_max];
+  if (!read_guest_buffer(ctx->rcx, pfns, count * sizeof(pfns[0]))) {
+    skip_instruction();
+    return;
+  }
+
+  uint64_t shadow_pfns[shadow_ept_hook_batch_max] = {};
+  for (size_t i = 0; i < count; ++i) {
+    if (auto const hook = find_ept_hook(cpu->ept, pfns[i]))
+      shadow_pfns[i] = hook->exec_pfn;
+  }
+
+  global_ept_op op = {};
+  op.args[0] = reinterpret_cast<uint64_t>(pfns);
+  op.args[1] = count;
+
+  write_shootdown_latency(ctx->r8,
+    run_on_all_vcpus(cpu, remove_shadow_ept_hooks_on_vcpu, &op));
+
+  // no vcpu can be executing from these pages anymore
+  for (size_t i = 0; i < count; ++i) {
+    if (shadow_pfns[i])
+      free_ept_shadow_page(ghv.ept_shadow_arena, shadow_pfns[i]);
+  }
+
+  ctx->rax = count;
+  skip_instruction();
+}
+
+// the scope of an EPT hook that is applied on every vcpu
+struct ept_hook_scope_op {
+  uint64_t orig_pfn;
+  uint64_t cr3_pfns[ept_hook_max_scopes];
+  uint64_t count;
+
+  // set by any vcpu that failed to apply the scope
+  long volatile failed;
+};
+
+static void set_ept_hook_scope_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op = static_cast<ept_hook_scope_op*>(ctx);
+
+  cr3 guest_cr3;
+  guest_cr3.flags = vmx_vmread(VMCS_GUEST_CR3);
+
+  if (!set_ept_hook_scope(cpu->ept, op->orig_pfn, op->cr3_pfns,
+      op->count, guest_cr3.address_of_page_directory))
+    _InterlockedExchange(&op->failed, 1);
+}
+
+// limit an EPT hook to the address spaces of a list of CR3 values on every
+// logical processor, or make it global again if the list is empty. processes
+// that use KVA shadowing need both their kernel and their user CR3.
+void set_ept_hook_scope(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  ctx->rax = 0;
+
+  // the hook has to exist on this vcpu so that its scope can be restored
+  auto const hook = find_ept_hook(cpu->ept, ctx->rcx);
+
+  if (!hook || ctx->r8 > ept_hook_max_scopes) {
+    skip_instruction();
+    return;
+  }
+
+  ept_hook_scope_op op = {};
+  op.orig_pfn = ctx->rcx;
+  op.count    = ctx->r8;
+
+  for (size_t i = 0; i < op.count; ++i) {
+    cr3 scope_cr3;
+    if (!read_guest_buffer(ctx->rdx + i * sizeof(scope_cr3), &scope_cr3, sizeof(scope_cr3))) {
+      skip_instruction();
+      return;
+    }
+
+    op.cr3_pfns[i] = scope_cr3.address_of_page_directory;
+  }
+
+  ept_hook_scope_op prev_op = {};
+  prev_op.orig_pfn = op.orig_pfn;
+  prev_op.count    = hook->scope_count;
+
+  for (size_t i = 0; i < prev_op.count; ++i)
+    prev_op.cr3_pfns[i] = hook->scope_cr3_pfns[i];
+
+  auto latency = run_on_all_vcpus(cpu, set_ept_hook_scope_on_vcpu, &op);
+
+  // don't leave the hook with a different scope on some of the vcpus
+  if (op.failed)
+    latency += run_on_all_vcpus(cpu, set_ept_hook_scope_on_vcpu, &prev_op);
+
+  write_shootdown_latency(ctx->r9, latency);
+
+  ctx->rax = !op.failed;
+  skip_instruction();
+}
+
+// an EPT hook group that is being switched on every vcpu
+struct ept_hook_group_op {
+  ept_hook_group const* group;
+  bool activate;
+
+  vcpu_barrier barriers[3];
+
+  // set by any vcpu that failed to activate the group
+  long volatile failed;
+};
+
+static void switch_ept_hook_group_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto&       op    = *static_cast<ept_hook_group_op*>(ctx);
+  auto const& group = *op.group;
+
+  // every vcpu is held in root-mode until every other vcpu has switched the
+  // group, so the guest never sees a partially installed group
+  wait_for_vcpu_barrier(op.barriers[0]);
+
+  bool installed = false;
+
+  if (!op.activate)
+    remove_ept_hooks(cpu->ept, group.orig_pfns, group.page_count);
+  else if (install_ept_hooks(cpu->ept, group.orig_pfns, group.exec_pfns, group.page_count))
+    installed = true;
+  else
+    _InterlockedExchange(&op.failed, 1);
+
+  wait_for_vcpu_barrier(op.barriers[1]);
+
+  // every vcpu sees the same value here, so they all roll back together
+  if (op.failed) {
+    if (installed)
+      remove_ept_hooks(cpu->ept, group.orig_pfns, group.page_count);
+
+    wait_for_vcpu_barrier(op.barriers[2]);
+  }
+}
+
+// get the EPT hook group that a handle refers to, or null if the handle is
+// invalid. this should be called while holding the EPT hook group lock.
+static ept_hook_group* get_ept_hook_group(uint64_t const handle) {
+  if (handle == 0 || handle > ept_hook_group_count)
+    return nullptr;
+
+  auto const group = &ghv.ept_hook_groups[handle - 1];
+  return group->page_count != 0 ? group : nullptr;
+}
+
+// activate or deactivate an EPT hook group on every vcpu. this should be
+// called while holding the EPT hook group lock.
+static bool switch_ept_hook_group(vcpu* const cpu, ept_hook_group& group,
+    bool const activate, uint64_t& latency) {
+  if (group.active == activate)
+    return true;
+
+  ept_hook_group_op op = {};
+  op.group    = &group;
+  op.activate = activate;
+
+  acquire_spin_lock_draining(cpu, ghv.vcpu_barrier_lock);
+
+  for (auto& barrier : op.barriers)
+    prepare_vcpu_barrier(barrier);
+
+  latency += run_on_all_vcpus(cpu, switch_ept_hook_group_on_vcpu, &op);
+
+  ghv.vcpu_barrier_lock.release();
+
+  if (op.failed)
+    return false;
+
+  group.active = activate;
+  return true;
+}
+
+// define a group of EPT hooks without installing any of them. returns a
+// handle to the group, or 0 if the group couldn't be created.
+void create_ept_hook_group(vcpu* const cpu) {
+  auto const ctx   = cpu->ctx;
+  auto const count = ctx->rdx;
+
+  ctx->rax = 0;
+
+  if (count == 0 || count > ept_hook_group_max_pages) {
+    skip_instruction();
+    return;
+  }
+
+  ept_hook_group_page pages[ept_hook_group_max_pages];
+  if (!read_guest_buffer(ctx->rcx, pages, count * sizeof(pages[0]))) {
+    skip_instruction();
+    return;
+  }
+
+  // a page can only be hooked once
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < i; ++j) {
+      if (pages[i].orig_pfn == pages[j].orig_pfn) {
+        skip_instruction();
+        return;
+      }
+    }
+  }
+
+  acquire_spin_lock_draining(cpu, ghv.ept_hook_group_lock);
+
+  for (size_t i = 0; i < ept_hook_group_count; ++i) {
+    auto& group = ghv.ept_hook_groups[i];
+    if (group.page_count != 0)
+      continue;
+
+    for (size_t j = 0; j < count; ++j) {
+      group.orig_pfns[j] = pages[j].orig_pfn;
+      group.exec_pfns[j] = pages[j].exec_pfn;
+    }
+
+    group.page_count = count;
+    group.active     = false;
+
+    ctx->rax = i + 1;
+    break;
+  }
+
+  ghv.ept_hook_group_lock.release();
+
+  skip_instruction();
+}
+
+// install every hook in a group on every logical processor at once. nothing
+// is installed if any vcpu fails, such as when a page is already hooked.
+void activate_ept_hook_group(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  uint64_t latency = 0;
+
+  acquire_spin_lock_draining(cpu, ghv.ept_hook_group_lock);
+
+  auto const group = get_ept_hook_group(ctx->rcx);
+  ctx->rax = group && switch_ept_hook_group(cpu, *group, true, latency);
+
+  ghv.ept_hook_group_lock.release();
+
+  write_shootdown_latency(ctx->rdx, latency);
+
+  skip_instruction();
+}
+
+// remove every hook in a group on every logical processor at once
+void deactivate_ept_hook_group(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  uint64_t latency = 0;
+
+  acquire_spin_lock_draining(cpu, ghv.ept_hook_group_lock);
+
+  auto const group = get_ept_hook_group(ctx->rcx);
+  ctx->rax = group && switch_ept_hook_group(cpu, *group, false, latency);
+
+  ghv.ept_hook_group_lock.release();
+
+  write_shootdown_latency(ctx->rdx, latency);
+
+  skip_instruction();
+}
+
+// deactivate a group of EPT hooks (if needed) and free it
+void destroy_ept_hook_group(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  uint64_t latency = 0;
+
+  acquire_spin_lock_draining(cpu, ghv.ept_hook_group_lock);
+
+  ctx->rax = 0;
+
+  if (auto const group = get_ept_hook_group(ctx->rcx)) {
+    switch_ept_hook_group(cpu, *group, false, latency);
+    group->page_count = 0;
+    ctx->rax = 1;
+  }
+
+  ghv.ept_hook_group_lock.release();
+
+  write_shootdown_latency(ctx->rdx, latency);
+
+  skip_instruction();
+}
+
+// maximum number of runs that a single query_ept_access_map call exports
+inline constexpr size_t access_run_batch_max = 64;
+
+static void start_access_sampling_on_vcpu(vcpu* const cpu, void* const ctx) {
+  if (!set_ept_access_sampling(cpu->ept, true))
+    _InterlockedExchange(&static_cast<global_ept_op*>(ctx)->failed, 1);
+}
+
+static void stop_access_sampling_on_vcpu(vcpu* const cpu, void*) {
+  auto const& sampler = ghv.access_sampler;
+
+  // give the PTs of the hot regions back to the pool
+  for (size_t i = 0; i < sampler.released_count; ++i)
+    merge_ept_pde(cpu->ept, sampler.released[i]);
+
+  for (auto const& hot : sampler.hot_regions) {
+    if (hot.used)
+      merge_ept_pde(cpu->ept, hot.physical_address);
+  }
+
+  // this also flushes the EPT
+  set_ept_access_sampling(cpu->ept, false);
+}
+
+static void sample_access_on_vcpu(vcpu* const cpu, void*) {
+  auto& sampler = ghv.access_sampler;
+
+  bool modified = false;
+
+  // regions that stopped being hot go back to being 2MB pages
+  for (size_t i = 0; i < sampler.released_count; ++i)
+    modified |= merge_ept_pde(cpu->ept, sampler.released[i]);
+
+  // hot regions need a PT so that their pages can be sampled individually.
+  // if the pool is empty, the region is only sampled as a whole.
+  for (auto const& hot : sampler.hot_regions) {
+    if (hot.used && !get_ept_pte(cpu->ept, hot.physical_address))
+      modified |= (get_ept_pte(cpu->ept, hot.physical_address, true) != nullptr);
+  }
+
+  collect_ept_accessed_regions(cpu->ept, record_accessed_region, &sampler);
+
+  // the processor doesn't set the accessed flags again for translations
+  // that are still cached
+  if (modified)
+    flush_ept(cpu->ept);
+  else
+    flush_ept_views(cpu->ept);
+}
+
+// clear the access histogram and enable the EPT accessed flags on every
+// logical processor
+void start_ept_access_sampling(vcpu* const cpu) {
+  auto& sampler = ghv.access_sampler;
+
+  acquire_spin_lock_draining(cpu, sampler.lock);
+
+  global_ept_op op = {};
+
+  auto latency = run_on_all_vcpus(cpu, start_access_sampling_on_vcpu, &op);
+
+  // don't leave some of the vcpus sampling
+  if (op.failed)
+    latency += run_on_all_vcpus(cpu, stop_access_sampling_on_vcpu, &op);
+
+  // the first sample contains every access since the flags were enabled
+  reset_access_sampler(sampler);
+  sampler.active = !op.failed;
+
+  sampler.lock.release();
+
+  write_shootdown_latency(cpu->ctx->rcx, latency);
+
+  cpu->ctx->rax = !op.failed;
+  skip_instruction();
+}
+
+// disable the EPT accessed flags on every logical processor. the histogram
+// can still be exported afterwards.
+void stop_ept_access_sampling(vcpu* const cpu) {
+  auto& sampler = ghv.access_sampler;
+
+  acquire_spin_lock_draining(cpu, sampler.lock);
+
+  write_shootdown_latency(cpu->ctx->rcx,
+    run_on_all_vcpus(cpu, stop_access_sampling_on_vcpu, nullptr));
+
+  for (auto& hot : sampler.hot_regions)
+    hot.used = false;
+
+  sampler.released_count = 0;
+  sampler.active         = false;
+
+  sampler.lock.release();
+
+  skip_instruction();
+}
+
+// harvest the EPT accessed flags of every logical processor into the
+// histogram. this is meant to be called periodically by the client, and the
+// sampling interval is the time between two calls.
+void sample_ept_access(vcpu* const cpu) {
+  auto& sampler = ghv.access_sampler;
+
+  acquire_spin_lock_draining(cpu, sampler.lock);
+
+  cpu->ctx->rax = sampler.active;
+
+  if (sampler.active) {
+    write_shootdown_latency(cpu->ctx->rcx,
+      run_on_all_vcpus(cpu, sample_access_on_vcpu, nullptr));
+
+    // every vcpu has merged these by now
+    sampler.released_count = 0;
+
+    finish_access_sample(sampler);
+  }
+
+  sampler.lock.release();
+
+  skip_instruction();
+}
+
+// export the access histogram as runs of pages with the same access count,
+// starting at the specified physical address. the address that the next
+// call should start at is written to the guest (0 once the end is reached).
+// returns the number of runs that were written.
+void query_ept_access_map(vcpu* const cpu) {
+  auto const ctx       = cpu->ctx;
+  auto const max_count = min(ctx->r8, access_run_batch_max);
+
+  ctx->rax = 0;
+
+  if (max_count == 0) {
+    skip_instruction();
+    return;
+  }
+
+  ept_access_run runs[access_run_batch_max];
+  uint64_t next = ctx->rcx;
+
+  acquire_spin_lock_draining(cpu, ghv.access_sampler.lock);
+  auto const count = get_access_runs(ghv.access_sampler, next, runs, max_count);
+  ghv.access_sampler.lock.release();
+
+  if (write_guest_buffer(ctx->rdx, runs, count * sizeof(runs[0])) &&
+      write_guest_buffer(ctx->r9, &next, sizeof(next)))
+    ctx->rax = count;
+
+  skip_instruction();
+}
+
+static void take_snapshot_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const barriers = static_cast<vcpu_barrier*>(ctx);
+
+  // the guest doesn't run on any vcpu while RAM is being write-protected,
+  // so the snapshot captures a single point in time
+  wait_for_vcpu_barrier(barriers[0]);
+  set_snapshot_protection(cpu->ept, true);
+  wait_for_vcpu_barrier(barriers[1]);
+}
+
+static void drop_snapshot_on_vcpu(vcpu* const cpu, void*) {
+  set_snapshot_protection(cpu->ept, false);
+}
+
+// write-protect RAM on every logical processor so that pages are copied
+// into the snapshot pool before they are first written to. fails if a
+// snapshot is already being held.
+void start_memory_snapshot(vcpu* const cpu) {
+  auto& snapshot = ghv.snapshot;
+
+  acquire_spin_lock_draining(cpu, snapshot.control_lock);
+
+  cpu->ctx->rax = !snapshot.active;
+
+  if (!snapshot.active) {
+    reset_snapshot(snapshot);
+    snapshot.active = true;
+
+    acquire_spin_lock_draining(cpu, ghv.vcpu_barrier_lock);
+
+    vcpu_barrier barriers[2];
+    for (auto& barrier : barriers)
+      prepare_vcpu_barrier(barrier);
+
+    write_shootdown_latency(cpu->ctx->rcx,
+      run_on_all_vcpus(cpu, take_snapshot_on_vcpu, barriers));
+
+    ghv.vcpu_barrier_lock.release();
+  }
+
+  snapshot.control_lock.release();
+
+  skip_instruction();
+}
+
+// give write access back on every logical processor and give the copies
+// back to the snapshot pool
+void stop_memory_snapshot(vcpu* const cpu) {
+  auto& snapshot = ghv.snapshot;
+
+  acquire_spin_lock_draining(cpu, snapshot.control_lock);
+
+  if (snapshot.active) {
+    snapshot.active = false;
+
+    write_shootdown_latency(cpu->ctx->rcx,
+      run_on_all_vcpus(cpu, drop_snapshot_on_vcpu, nullptr));
+
+    // no vcpu can be copying a page anymore
+    reset_snapshot(snapshot);
+  }
+
+  snapshot.control_lock.release();
+
+  skip_instruction();
+}
+
+// read physical memory as it was when the snapshot was taken. returns the
+// number of bytes that were read, which is 0 if there is no snapshot or if
+// it overflowed.
+void read_memory_snapshot(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  // arguments
+  auto const dst  = reinterpret_cast<uint8_t*>(ctx->rcx);
+  auto const src  = ctx->rdx;
+  auto const size = ctx->r8;
+
+  ctx->rax = 0;
+
+  if (!ghv.snapshot.active || ghv.snapshot.overflowed) {
+    skip_instruction();
+    return;
+  }
+
+  size_t bytes_read = 0;
+
+  while (bytes_read < size) {
+    size_t dst_remaining = 0;
+
+    // translate the guest buffer into hypervisor space
+    auto const curr_dst = gva2hva(dst + bytes_read, &dst_remaining);
+
+    if (!curr_dst) {
+      // guest virtual address that caused the fault
+      ctx->cr2 = reinterpret_cast<uint64_t>(dst + bytes_read);
+
+      page_fault_exception error;
+      error.flags            = 0;
+      error.present          = 0;
+      error.write            = 1;
+      error.user_mode_access = (current_guest_cpl() == 3);
+
+      inject_hw_exception(page_fault, error.flags);
+      return;
+    }
+
+    auto const curr_size = min(dst_remaining, size - bytes_read);
+
+    if (!read_snapshot(ghv.snapshot, curr_dst, src + bytes_read, curr_size)) {
+      inject_hw_exception(general_protection, 0);
+      return;
+    }
+
+    bytes_read += curr_size;
+  }
+
+  // the snapshot might have overflowed while it was being read
+  ctx->rax = ghv.snapshot.overflowed ? 0 : bytes_read;
+  skip_instruction();
+}
+
+// get the state of the memory snapshot and its pool usage
+void query_memory_snapshot_stats(vcpu* const cpu) {
+  memory_snapshot_stats stats = {};
+  get_snapshot_stats(ghv.snapshot, stats);
+
+  cpu->ctx->rax = write_guest_buffer(cpu->ctx->rcx, &stats, sizeof(stats));
+  skip_instruction();
+}
+
+// maximum number of pages that are hashed in a single hypercall
+inline constexpr size_t page_hash_batch_max = 128;
+
+// hash the contents of a page. pages that only contain zeroes hash to 0,
+// and no other page does.
+static uint64_t hash_page(uint64_t const* const page) {
+  uint64_t hash = 0, bits = 0;
+
+  for (size_t i = 0; i < 512; ++i) {
+    bits |= page[i];
+    hash  = _rotl64(hash + page[i] * 0xC2B2AE3D27D4EB4Full, 31) * 0x9E3779B97F4A7C15ull;
+  }
+
+  if (!bits)
+    return 0;
+
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDull;
+  hash ^= hash >> 33;
+
+  return hash ? hash : 1;
+}
+
+// hash a batch of RAM pages, starting at the specified physical address, so
+// that clients can find identical pages. MMIO is skipped since reading it
+// can have side effects. the address that the next call should start at is
+// written to the guest (0 once every page was hashed). returns the number
+// of hashes that were written.
+void hash_physical_pages(vcpu* const cpu) {
+  auto const ctx       = cpu->ctx;
+  auto const max_count = min(ctx->r8, page_hash_batch_max);
+
+  ctx->rax = 0;
+
+  if (max_count == 0) {
+    skip_instruction();
+    return;
+  }
+
+  page_hash hashes[page_hash_batch_max];
+  size_t count = 0;
+
+  auto addr = ctx->rcx & ~0xFFFull;
+
+  for (size_t i = 0; i < ghv.ram_range_count && count < max_count; ++i) {
+    auto const& range = ghv.ram_ranges[i];
+
+    if (addr < range.start)
+      addr = range.start;
+
+    for (; addr < range.end && count < max_count; addr += 0x1000) {
+      hashes[count].physical_address = addr;
+      hashes[count].hash             = hash_page(
+        reinterpret_cast<uint64_t const*>(host_physical_memory_base + addr));
+      ++count;
+    }
+  }
+
+  uint64_t next = 0;
+  for (size_t i = 0; i < ghv.ram_range_count; ++i) {
+    if (addr < ghv.ram_ranges[i].end) {
+      next = addr;
+      break;
+    }
+  }
+
+  if (write_guest_buffer(ctx->rdx, hashes, count * sizeof(hashes[0])) &&
+      write_guest_buffer(ctx->r9, &next, sizeof(next)))
+    ctx->rax = count;
+
+  skip_instruction();
+}
+
+// number of MMR access counts that are copied to the guest at once
+inline constexpr size_t mmr_profile_batch_max = 32;
+
+// copy the aggregated access counts of an MMR into a guest buffer, and clear
+// them if requested. counts are kept separately on every vcpu, so the same
+// (RIP, CR3, access) or page can show up once for every vcpu. the number of
+// accesses that couldn't be counted is written to the guest as well.
+// returns the number of counts that were written.
+void read_mmr_profile(vcpu* const cpu) {
+  auto const ctx       = cpu->ctx;
+  auto const max_count = ctx->r8;
+  auto const reset     = ctx->r9 != 0;
+
+  ctx->rax = 0;
+
+  size_t idx = 0;
+
+  // ignore handles that don't point to an MMR entry, and there is nothing
+  // to read while profiling is disabled
+  if (!mmr_profile_enabled || !get_mmr_index(ctx->rcx, idx)) {
+    skip_instruction();
+    return;
+  }
+
+  mmr_access_count counts[mmr_profile_batch_max];
+
+  uint64_t count   = 0;
+  uint64_t dropped = 0;
+  bool     failed  = false;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count && !failed; ++i) {
+    auto& profile = ghv.mmr_pool.profiles[i];
+
+    dropped += read_mmr_dropped_count(profile, idx, reset);
+
+    for (size_t cursor = 0; count < max_count;) {
+      auto const curr_count = copy_mmr_profile(profile, idx, counts,
+        min(max_count - count, mmr_profile_batch_max), reset, cursor);
+
+      if (curr_count == 0)
+        break;
+
+      if (!write_guest_buffer(ctx->rdx + count * sizeof(counts[0]),
+          counts, curr_count * sizeof(counts[0]))) {
+        failed = true;
+        break;
+      }
+
+      count += curr_count;
+    }
+  }
+
+  if (ctx->r10)
+    write_guest_buffer(ctx->r10, &dropped, sizeof(dropped));
+
+  ctx->rax = count;
+
+  skip_instruction();
+}
+
+// the MMR is identified by its slot and its range, since local MMRs on
+// other vcpus can use the same slot
+struct mmr_filter_op {
+  size_t idx;
+  vcpu_ept_mmr_entry mmr;
+
+  // null to remove the filter
+  mmr_filter const* filter;
+
+  long volatile failed;
+};
+
+static void set_mmr_filter_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op    = static_cast<mmr_filter_op*>(ctx);
+  auto&      entry = cpu->ept.mmrs->entries[op->idx];
+
+  if (entry.size  != op->mmr.size  ||
+      entry.mode  != op->mmr.mode  ||
+      entry.start != op->mmr.start)
+    return;
+
+  if (!attach_mmr_filter(*cpu->ept.mmrs, entry, op->filter))
+    _InterlockedExchange(&op->failed, 1);
+}
+
+// attach a filter to an MMR on every logical processor that it is installed
+// on, or remove its filter if the filter is null. accesses that don't pass
+// the filter are neither logged nor counted. returns false if the filter
+// couldn't be attached.
+void set_mmr_filter(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  ctx->rax = 0;
+
+  mmr_filter_op op = {};
+
+  // ignore handles that don't point to an MMR entry
+  if (!get_mmr_index(ctx->rcx, op.idx)) {
+    skip_instruction();
+    return;
+  }
+
+  op.mmr = *reinterpret_cast<vcpu_ept_mmr_entry const*>(ctx->rcx);
+
+  if (op.mmr.size == 0) {
+    skip_instruction();
+    return;
+  }
+
+  mmr_filter filter;
+
+  if (ctx->rdx) {
+    if (!read_guest_buffer(ctx->rdx, &filter, sizeof(filter))) {
+      skip_instruction();
+      return;
+    }
+
+    filter.cr3_count       = min(filter.cr3_count, mmr_filter_list_max);
+    filter.pid_count       = min(filter.pid_count, mmr_filter_list_max);
+    filter.rip_range_count = min(filter.rip_range_count, mmr_filter_list_max);
+
+    op.filter = &filter;
+  }
+
+  auto latency = run_on_all_vcpus(cpu, set_mmr_filter_on_vcpu, &op);
+
+  // don't leave the filter attached on only some of the vcpus
+  if (op.failed) {
+    op.filter = nullptr;
+    latency += run_on_all_vcpus(cpu, set_mmr_filter_on_vcpu, &op);
+  }
+
+  write_shootdown_latency(ctx->r8, latency);
+
+  ctx->rax = !op.failed;
+  skip_instruction();
+}
+
+// a small MMR that is installed on every vcpu
+struct mmr_watch_op {
+  // index of the MMR entry
+  size_t idx;
+
+  // linear address that the debug registers watch
+  uint64_t address;
+
+  uint64_t physical_address;
+  uint64_t size;
+  uint8_t  mode;
+
+  // set by any vcpu that failed to install the MMR
+  long volatile failed;
+};
+
+static void install_mmr_watch_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op = static_cast<mmr_watch_op*>(ctx);
+
+  // this also fails if the slot was taken by a local MMR on this vcpu
+  auto const entry = insert_watched_mmr(*cpu->ept.mmrs,
+    op->physical_address, op->size, op->mode, op->idx);
+
+  if (!entry) {
+    _InterlockedExchange(&op->failed, 1);
+    return;
+  }
+
+  if (!arm_watchpoint(cpu, op->idx, op->address, op->size, op->mode)) {
+    erase_mmr(*cpu->ept.mmrs, *entry);
+    _InterlockedExchange(&op->failed, 1);
+    return;
+  }
+
+  // the entry might have been used by an aggregating MMR before
+  if (cpu->ept.mmr_profile)
+    reset_mmr_profile(*cpu->ept.mmr_profile, op->idx);
+}
+
+static void rollback_mmr_watch_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op    = static_cast<mmr_watch_op*>(ctx);
+  auto&      entry = cpu->ept.mmrs->entries[op->idx];
+
+  // only remove the entry if it was installed by install_mmr_watch_on_vcpu()
+  if (entry.watched &&
+      entry.size  == op->size &&
+      entry.mode  == op->mode &&
+      entry.start == op->physical_address)
+    remove_mmr_watch_entry(cpu, entry);
+}
+
+// install an MMR of up to 8 bytes, at a virtual address in the current
+// address space, on every logical processor. the MMR is served by a debug
+// register instead of the EPT, so accesses to the rest of its page don't
+// cause vm-exits. the returned handle works with remove_mmr_global().
+void install_mmr_watch(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  mmr_watch_op op = {};
+  op.address = ctx->rcx;
+  op.size    = ctx->rdx;
+  op.mode    = static_cast<uint8_t>(ctx->r8 & mmr_memory_mode_mask);
+  op.idx     = find_free_mmr(*cpu->ept.mmrs);
+
+  // return null by default
+  ctx->rax = 0;
+
+  if (op.idx >= vcpu_ept_mmrs::capacity ||
+      !is_watchpoint_range(op.address, op.size, op.mode)) {
+    skip_instruction();
+    return;
+  }
+
+  // the range can't cross a page since it fits into an aligned 8-byte block
+  op.physical_address = gva2gpa(reinterpret_cast<void*>(op.address));
+
+  if (!op.physical_address) {
+    skip_instruction();
+    return;
+  }
+
+  auto latency = run_on_all_vcpus(cpu, install_mmr_watch_on_vcpu, &op);
+
+  if (op.failed)
+    latency += run_on_all_vcpus(cpu, rollback_mmr_watch_on_vcpu, &op);
+  else
+    ctx->rax = reinterpret_cast<uint64_t>(&cpu->ept.mmrs->entries[op.idx]);
+
+  write_shootdown_latency(ctx->r9, latency);
+
+  skip_instruction();
+}
+
+// an access window that is set for an MMR on every vcpu
+struct mmr_window_op {
+  // index of the MMR entry
+  size_t idx;
+
+  // the MMR that the handle pointed to on the calling vcpu
+  vcpu_ept_mmr_entry mmr;
+
+  uint32_t window;
+};
+
+static void set_mmr_window_on_vcpu(vcpu* const cpu, void* const ctx) {
+  auto const op    = static_cast<mmr_window_op*>(ctx);
+  auto&      entry = cpu->ept.mmrs->entries[op->idx];
+
+  if (entry.size  != op->mmr.size  ||
+      entry.mode  != op->mmr.mode  ||
+      entry.start != op->mmr.start)
+    return;
+
+  // a window that is already open still ends at its original deadline
+  entry.window = op->window;
+}
+
+// set the number of TSC ticks that the pages of an MMR are left accessible
+// for after an access, on every logical processor that the MMR is installed
+// on. accesses during the window aren't observed. a window of 0 re-protects
+// the page after every instruction. returns false if the handle is invalid.
+void set_mmr_window(vcpu* const cpu) {
+  auto const ctx = cpu->ctx;
+
+  ctx->rax = 0;
+
+  mmr_window_op op = {};
+
+  // ignore handles that don't point to an MMR entry
+  if (!get_mmr_index(ctx->rcx, op.idx)) {
+    skip_instruction();
+    return;
+  }
+
+  op.mmr    = *reinterpret_cast<vcpu_ept_mmr_entry const*>(ctx->rcx);
+  op.window = static_cast<uint32_t>(min(ctx->rdx, 0xFFFFFFFFull));
+
+  if (op.mmr.size == 0) {
+    skip_instruction();
+    return;
+  }
+
+  write_shootdown_latency(ctx->r8,
+    run_on_all_vcpus(cpu, set_mmr_window_on_vcpu, &op));
+
+  ctx->rax = 1;
+  skip_instruction();
+}
+
+// number of MMR events that are copied to the guest at once
+inline constexpr size_t mmr_trace_batch_max = 8;
+
+// copy and consume the events in the MMR trace of every vcpu. events are
+// in order on each vcpu, but not across vcpus, and they are only consumed
+// once they were written to the guest. the number of events that were
+// dropped since the last read is written to the guest as well.
+// returns the number of events that were written.
+void read_mmr_trace(vcpu* const cpu) {
+  auto const ctx       = cpu->ctx;
+  auto const max_count = ctx->rdx;
+
+  ctx->rax = 0;
+
+  // nothing is ever recorded while tracing is disabled
+  if (!mmr_trace_enabled) {
+    skip_instruction();
+    return;
+  }
+
+  mmr_event events[mmr_trace_batch_max];
+
+  uint64_t count   = 0;
+  uint64_t dropped = 0;
+  bool     failed  = false;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count && !failed; ++i) {
+    auto& trace = ghv.mmr_pool.traces[i];
+
+    scoped_spin_lock lock(trace.lock);
+
+    dropped += read_mmr_trace_dropped_count(trace);
+
+    while (count < max_count) {
+      auto const curr_count = peek_mmr_trace(trace, events,
+        min(max_count - count, mmr_trace_batch_max));
+
+      if (curr_count == 0)
+        break;
+
+      if (!write_guest_buffer(ctx->rcx + count * sizeof(events[0]),
+          events, curr_count * sizeof(events[0]))) {
+        failed = true;
+        break;
+      }
+
+      consume_mmr_trace(trace, curr_count);
+      count += curr_count;
+    }
+  }
+
+  if (ctx->r8)
+    write_guest_buffer(ctx->r8, &dropped, sizeof(dropped));
+
+  ctx->rax = count;
+
+  skip_instruction();
+}
+
 } // namespace hv::hc
 
@@ -35,7 +35,183 @@ enum hypercall_code : uint64_t {
   hypercall_get_message,
   hypercall_get_message_type,
   hypercall_get_message_time,
-  hypercall_get_message_sender
+  hypercall_get_message_sender,
+  hypercall_install_ept_hook_global,
+  hypercall_remove_ept_hook_global,
+  hypercall_hide_physical_page_global,
+  hypercall_unhide_physical_page_global,
+  hypercall_install_mmr_global,
+  hypercall_remove_mmr_global,
+  hypercall_remove_all_mmrs_global,
+  hypercall_hide_physical_range,
+  hypercall_unhide_physical_range,
+  hypercall_start_dirty_log,
+  hypercall_stop_dirty_log,
+  hypercall_fetch_and_clear_dirty_bitmap,
+  hypercall_set_ept_exec_view,
+  hypercall_query_ept_hook_stats,
+  hypercall_query_ept_hooks,
+  hypercall_install_shadow_ept_hooks,
+  hypercall_remove_shadow_ept_hooks,
+  hypercall_set_ept_hook_scope,
+  hypercall_create_ept_hook_group,
+  hypercall_activate_ept_hook_group,
+  hypercall_deactivate_ept_hook_group,
+  hypercall_destroy_ept_hook_group,
+  hypercall_start_ept_access_sampling,
+  hypercall_stop_ept_access_sampling,
+  hypercall_sample_ept_access,
+  hypercall_query_ept_access_map,
+  hypercall_start_memory_snapshot,
+  hypercall_stop_memory_snapshot,
+  hypercall_read_memory_snapshot,
+  hypercall_query_memory_snapshot_stats,
+  hypercall_hash_physical_pages,
+  hypercall_read_mmr_profile,
+  hypercall_set_mmr_filter,
+  hypercall_install_mmr_watch,
+  hypercall_set_mmr_window,
+  hypercall_read_mmr_trace
+};
+
+// per-hook counters that are returned by the query_ept_hooks hypercall.
+// the counts are combined across every logical processor.
+struct ept_hook_info {
+  uint64_t orig_pfn;
+  uint64_t exec_pfn;
+
+  // ept-violations that were caused by this hook
+  uint64_t exit_count;
+
+  // switches between the original and the executable page
+  uint64_t flip_count;
+
+  // number of logical processors that this hook is currently hot on
+  uint64_t hot_count;
+};
+
+// a page to hook with the install_shadow_ept_hooks hypercall. the hypervisor
+// clones the original page into its shadow page arena and fills in the GPA
+// of the clone, which is executed in place of the original page.
+struct shadow_ept_hook {
+  uint64_t orig_pfn;
+  uint64_t shadow_gpa;
+};
+
+// bytes that are written into a shadow page before its hook is installed.
+// the patch is addressed by the original physical address, and patches that
+// cross a page boundary are split between both pages.
+struct shadow_ept_patch {
+  uint64_t physical_address;
+  uint64_t size;
+
+  // guest virtual address of the patch bytes
+  uint64_t data;
+};
+
+// a page in an EPT hook group, as passed to the create_ept_hook_group hypercall
+struct ept_hook_group_page {
+  uint64_t orig_pfn;
+  uint64_t exec_pfn;
+};
+
+// a run of physical memory whose pages were all accessed in the same number
+// of samples, as returned by the query_ept_access_map hypercall. pages that
+// were never accessed aren't covered by any run.
+struct ept_access_run {
+  uint64_t physical_address;
+  uint64_t size;
+  uint64_t sample_count;
+};
+
+// state of the memory snapshot, as returned by the query_memory_snapshot_stats
+// hypercall. the snapshot can't be read anymore once it overflowed.
+struct memory_snapshot_stats {
+  uint64_t active;
+  uint64_t overflowed;
+
+  // write faults that were caused by the snapshot on every logical processor
+  uint64_t cow_fault_count;
+
+  // pages in the snapshot pool that hold a copy, and the size of the pool
+  uint64_t pool_used_count;
+  uint64_t pool_page_count;
+};
+
+// hash of a page of RAM, as returned by the hash_physical_pages hypercall.
+// pages that only contain zeroes always have a hash of 0.
+struct page_hash {
+  uint64_t physical_address;
+  uint64_t hash;
+};
+
+// aggregated access count of an MMR, as returned by the read_mmr_profile
+// hypercall. per-page totals have the physical address of the page and a
+// RIP and CR3 of 0, every other count has a page address of 0.
+struct mmr_access_count {
+  uint64_t rip;
+  uint64_t cr3;
+  uint64_t page_address;
+
+  // combination of mmr_memory_mode flags
+  uint64_t access;
+  uint64_t count;
+};
+
+// an access to an MMR that was installed with mmr_memory_mode_trace, as
+// returned by the read_mmr_trace hypercall. the layout is fixed so that
+// recording an access only takes a handful of stores.
+struct mmr_event {
+  uint64_t tsc;
+  uint64_t physical_address;
+  uint64_t cr3;
+  uint64_t pid;
+  uint64_t rip;
+
+  // index of the logical processor, and of the MMR entry
+  uint16_t vcpu;
+  uint16_t mmr;
+
+  // combination of mmr_memory_mode flags
+  uint8_t access;
+  uint8_t cpl;
+  uint8_t reserved[2];
+
+  // general-purpose registers in encoding order: RAX, RCX, RDX, RBX, RSP,
+  // RBP, RSI, RDI, and R8-R15
+  uint64_t gpr[16];
+};
+static_assert(sizeof(mmr_event) == 176, "MMR events have a fixed layout!");
+
+// maximum number of values in each allow-list of an MMR filter
+inline constexpr size_t mmr_filter_list_max = 4;
+
+// a range of guest RIPs [start, end)
+struct mmr_rip_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+// conditions that an access has to meet for an MMR to log or count it, as
+// passed to the set_mmr_filter hypercall. an empty allow-list, or a mask
+// of 0, doesn't filter anything.
+struct mmr_filter {
+  // address spaces, compared against the guest CR3 without its PCID
+  uint64_t cr3[mmr_filter_list_max];
+  uint64_t cr3_count;
+
+  // process IDs
+  uint64_t pid[mmr_filter_list_max];
+  uint64_t pid_count;
+
+  mmr_rip_range rip_ranges[mmr_filter_list_max];
+  uint64_t rip_range_count;
+
+  // bit n allows accesses that were made at CPL n
+  uint64_t cpl_mask;
+
+  // combination of mmr_memory_mode flags
+  uint64_t access_mask;
 };
 
 // hypercall input
@@ -124,6 +300,121 @@ void get_message_time(vcpu* cpu);
 // get message sender id
 void get_message_sender(vcpu* cpu);
 
+// install an EPT hook on every logical processor
+void install_ept_hook_global(vcpu* cpu);
+
+// remove an EPT hook from every logical processor
+void remove_ept_hook_global(vcpu* cpu);
+
+// hide a physical page from the guest on every logical processor
+void hide_physical_page_global(vcpu* cpu);
+
+// unhide a physical page from the guest on every logical processor
+void unhide_physical_page_global(vcpu* cpu);
+
+// install an MMR on every logical processor. the same slot is used on
+// every vcpu, so the returned handle works with remove_mmr_global().
+void install_mmr_global(vcpu* cpu);
+
+// remove an MMR that was installed with install_mmr_global()
+void remove_mmr_global(vcpu* cpu);
+
+// remove every installed MMR on every logical processor
+void remove_all_mmrs_global(vcpu* cpu);
+
+// hide a GPA range or a (cr3, gva) range from the guest on every logical processor
+void hide_physical_range(vcpu* cpu);
+
+// unhide a GPA range or a (cr3, gva) range on every logical processor
+void unhide_physical_range(vcpu* cpu);
+
+// enable the EPT dirty flags on every logical processor
+void start_dirty_log(vcpu* cpu);
+
+// disable the EPT dirty flags on every logical processor
+void stop_dirty_log(vcpu* cpu);
+
+// write a bitmap of the pages in a GPA range that were written to since
+// the last call, and clear their dirty flags on every logical processor
+void fetch_and_clear_dirty_bitmap(vcpu* cpu);
+
+// enable or disable the EPT execute view for hooks on every logical processor.
+// returns whether it was enabled before.
+void set_ept_exec_view(vcpu* cpu);
+
+// get the EPT hook statistics of every logical processor combined
+void query_ept_hook_stats(vcpu* cpu);
+
+// get the per-hook counters of every EPT hook on this logical processor
+void query_ept_hooks(vcpu* cpu);
+
+// clone a batch of pages into the shadow page arena, patch the clones, and
+// hook the original pages on every logical processor
+void install_shadow_ept_hooks(vcpu* cpu);
+
+// remove a batch of EPT hooks on every logical processor and give their
+// shadow pages back to the arena
+void remove_shadow_ept_hooks(vcpu* cpu);
+
+// limit an EPT hook to a set of address spaces on every logical processor
+void set_ept_hook_scope(vcpu* cpu);
+
+// define a group of EPT hooks without installing any of them
+void create_ept_hook_group(vcpu* cpu);
+
+// install every hook in a group on every logical processor at once
+void activate_ept_hook_group(vcpu* cpu);
+
+// remove every hook in a group on every logical processor at once
+void deactivate_ept_hook_group(vcpu* cpu);
+
+// deactivate a group of EPT hooks (if needed) and free it
+void destroy_ept_hook_group(vcpu* cpu);
+
+// clear the access histogram and enable the EPT accessed flags on every
+// logical processor
+void start_ept_access_sampling(vcpu* cpu);
+
+// disable the EPT accessed flags on every logical processor
+void stop_ept_access_sampling(vcpu* cpu);
+
+// harvest the EPT accessed flags of every logical processor into the histogram
+void sample_ept_access(vcpu* cpu);
+
+// export the access histogram as run-length encoded runs
+void query_ept_access_map(vcpu* cpu);
+
+// write-protect RAM on every logical processor so that pages are copied
+// before they are first written to
+void start_memory_snapshot(vcpu* cpu);
+
+// give write access back on every logical processor and drop the copies
+void stop_memory_snapshot(vcpu* cpu);
+
+// read physical memory as it was when the snapshot was taken
+void read_memory_snapshot(vcpu* cpu);
+
+// get the state of the memory snapshot and its pool usage
+void query_memory_snapshot_stats(vcpu* cpu);
+
+// hash a batch of RAM pages so that identical pages can be found
+void hash_physical_pages(vcpu* cpu);
+
+// copy the aggregated access counts of an MMR and clear them if requested
+void read_mmr_profile(vcpu* cpu);
+
+// attach a filter to an MMR on every logical processor, or remove it
+void set_mmr_filter(vcpu* cpu);
+
+// install a small MMR that is served by a debug register on every logical processor
+void install_mmr_watch(vcpu* cpu);
+
+// leave the pages of an MMR accessible for a while after they were accessed
+void set_mmr_window(vcpu* cpu);
+
+// copy and consume the events in the MMR trace of every logical processor
+void read_mmr_trace(vcpu* cpu);
+
 } // namespace hc
 
 } // namespace hv
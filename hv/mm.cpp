@@ -109,6 +109,63 @@ void* gva2hva(void* const gva, size_t* const offset_to_next_page) {
   return gva2hva(guest_cr3, gva, offset_to_next_page);
 }
 
+// set the accessed and dirty flags of the guest paging entry that maps a GVA,
+// like the processor does when it writes to the GVA. returns false if the GVA
+// isn't mapped.
+bool set_guest_dirty_flag(cr3 const guest_cr3, void* const gva) {
+  pml4_virtual_address const vaddr = { gva };
+
+  // the accessed and dirty flags are at the same position in every leaf
+  auto const set_flags = [](uint64_t& entry) {
+    _InterlockedOr64(reinterpret_cast<long long volatile*>(&entry),
+      (1ull << 5) | (1ull << 6));
+    return true;
+  };
+
+  // guest PML4
+  auto const pml4 = reinterpret_cast<pml4e_64*>(host_physical_memory_base
+    + (guest_cr3.address_of_page_directory << 12));
+  auto& pml4e = pml4[vaddr.pml4_idx];
+
+  if (!pml4e.present)
+    return false;
+
+  // guest PDPT
+  auto const pdpt = reinterpret_cast<pdpte_64*>(host_physical_memory_base
+    + (pml4e.page_frame_number << 12));
+  auto& pdpte = pdpt[vaddr.pdpt_idx];
+
+  if (!pdpte.present)
+    return false;
+
+  // 1GB
+  if (pdpte.large_page)
+    return set_flags(pdpte.flags);
+
+  // guest PD
+  auto const pd = reinterpret_cast<pde_64*>(host_physical_memory_base
+    + (pdpte.page_frame_number << 12));
+  auto& pde = pd[vaddr.pd_idx];
+
+  if (!pde.present)
+    return false;
+
+  // 2MB page
+  if (pde.large_page)
+    return set_flags(pde.flags);
+
+  // guest PT
+  auto const pt = reinterpret_cast<pte_64*>(host_physical_memory_base
+    + (pde.page_frame_number << 12));
+  auto& pte = pt[vaddr.pt_idx];
+
+  if (!pte.present)
+    return false;
+
+  // 4KB page
+  return set_flags(pte.flags);
+}
+
 // attempt to read the memory at the specified guest virtual address from root-mode
 size_t read_guest_virtual_memory(cr3 const guest_cr3,
     void* const gva, void* const buffer, size_t const size) {
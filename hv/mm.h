@@ -37,6 +37,11 @@ void* gva2hva(cr3 guest_cr3, void* gva, size_t* offset_to_next_page = nullptr);
 // the HVA in order to modify the GVA.
 void* gva2hva(void* gva, size_t* offset_to_next_page = nullptr);
 
+// set the accessed and dirty flags of the guest paging entry that maps a GVA,
+// like the processor does when it writes to the GVA. returns false if the GVA
+// isn't mapped.
+bool set_guest_dirty_flag(cr3 guest_cr3, void* gva);
+
 // attempt to read the memory at the specified guest virtual address from root-mode
 size_t read_guest_virtual_memory(cr3 guest_cr3, void* gva, void* buffer, size_t size);
 
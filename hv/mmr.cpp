@@ -0,0 +1,503 @@
+#include "mmr.h"
+
+#include <ntddk.h>
+#include <intrin.h>
+#include <string.h>
+
+namespace hv {
+
+// recompute the max end address of every node in the implicit interval tree.
+// the nodes at level k are the indices whose lowest k bits are set, and a
+// node whose right subtree is out of range uses the max end of the last
+// complete subtree instead.
+static void build_mmr_index(vcpu_ept_mmrs& mmrs) {
+  auto const n = static_cast<int64_t>(mmrs.count);
+
+  if (n == 0) {
+    mmrs.max_level = -1;
+    return;
+  }
+
+  auto const end_at = [&](int64_t const i) {
+    return mmr_page_end(mmrs.entries[mmrs.sorted[i]]);
+  };
+
+  int64_t  last_i = 0;
+  uint64_t last   = 0;
+
+  for (int64_t i = 0; i < n; i += 2) {
+    last_i = i;
+    last   = mmrs.max_end[i] = end_at(i);
+  }
+
+  int k = 1;
+  for (; (1ll << k) <= n; ++k) {
+    auto const x = 1ll << (k - 1);
+
+    for (auto i = (x << 1) - 1; i < n; i += (x << 2)) {
+      auto const el = mmrs.max_end[i - x];
+      auto const er = (i + x < n) ? mmrs.max_end[i + x] : last;
+
+      auto e = end_at(i);
+      if (el > e)
+        e = el;
+      if (er > e)
+        e = er;
+
+      mmrs.max_end[i] = e;
+    }
+
+    last_i = ((last_i >> k) & 1) ? last_i - x : last_i + x;
+    if (last_i < n && mmrs.max_end[last_i] > last)
+      last = mmrs.max_end[last_i];
+  }
+
+  mmrs.max_level = k - 1;
+}
+
+// find the position in the sorted array where an entry with this start
+// address should be inserted (after every entry with the same start)
+static size_t upper_bound_mmr(vcpu_ept_mmrs const& mmrs, uint64_t const start) {
+  size_t lo = 0, hi = mmrs.count;
+
+  while (lo < hi) {
+    auto const mid = (lo + hi) / 2;
+
+    if (mmr_page_start(mmrs.entries[mmrs.sorted[mid]]) <= start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// allocate a zero-initialized array from non-paged memory
+template <typename T>
+static T* alloc_mmr_array(size_t const count) {
+  auto const arr = static_cast<T*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, count * sizeof(T), 'fr0g'));
+
+  if (arr)
+    memset(arr, 0, count * sizeof(T));
+
+  return arr;
+}
+
+// allocate the MMR state of every vcpu
+bool create_mmr_pool(mmr_pool& pool, size_t const vcpu_count) {
+  pool.mmrs     = alloc_mmr_array<vcpu_ept_mmrs>(vcpu_count);
+  pool.profiles = nullptr;
+  pool.traces   = nullptr;
+
+  if (mmr_profile_enabled)
+    pool.profiles = alloc_mmr_array<vcpu_mmr_profile>(vcpu_count);
+
+  if (mmr_trace_enabled)
+    pool.traces = alloc_mmr_array<vcpu_mmr_trace>(vcpu_count);
+
+  if (!pool.mmrs || (mmr_profile_enabled && !pool.profiles) ||
+      (mmr_trace_enabled && !pool.traces)) {
+    destroy_mmr_pool(pool);
+    return false;
+  }
+
+  return true;
+}
+
+// free the memory that was allocated with create_mmr_pool()
+void destroy_mmr_pool(mmr_pool& pool) {
+  if (pool.mmrs)
+    ExFreePoolWithTag(pool.mmrs, 'fr0g');
+
+  if (pool.profiles)
+    ExFreePoolWithTag(pool.profiles, 'fr0g');
+
+  if (pool.traces)
+    ExFreePoolWithTag(pool.traces, 'fr0g');
+
+  pool.mmrs     = nullptr;
+  pool.profiles = nullptr;
+  pool.traces   = nullptr;
+}
+
+// initialize an empty MMR index
+void prepare_mmrs(vcpu_ept_mmrs& mmrs) {
+  memset(&mmrs.entries, 0, sizeof(mmrs.entries));
+  memset(&mmrs.used, 0, sizeof(mmrs.used));
+
+  mmrs.count        = 0;
+  mmrs.max_level    = -1;
+  mmrs.filters_used = 0;
+}
+
+// get the index of the first unused entry, or capacity if every entry is in use
+size_t find_free_mmr(vcpu_ept_mmrs const& mmrs) {
+  for (size_t i = 0; i < mmrs.capacity / 64; ++i) {
+    unsigned long bit = 0;
+    if (_BitScanForward64(&bit, ~mmrs.used[i]))
+      return i * 64 + bit;
+  }
+
+  return mmrs.capacity;
+}
+
+// mark an entry as used and initialize it. a specific entry can be requested
+// with idx, otherwise the first unused entry is taken.
+static vcpu_ept_mmr_entry* alloc_mmr(vcpu_ept_mmrs& mmrs, uint64_t const start,
+    uint64_t const size, uint8_t const mode, size_t idx) {
+  if (size == 0)
+    return nullptr;
+
+  if (idx >= mmrs.capacity) {
+    idx = find_free_mmr(mmrs);
+
+    // all entries are in use
+    if (idx >= mmrs.capacity)
+      return nullptr;
+  }
+  else if (mmrs.used[idx / 64] & (1ull << (idx % 64)))
+    return nullptr;
+
+  mmrs.used[idx / 64] |= (1ull << (idx % 64));
+
+  auto& entry = mmrs.entries[idx];
+  entry.start   = start;
+  entry.size    = size;
+  entry.mode    = mode;
+  entry.filter  = 0;
+  entry.watched = false;
+  entry.window  = 0;
+
+  return &entry;
+}
+
+// add an MMR to the index. a specific entry can be requested with idx,
+// otherwise the first unused entry is taken. null is returned if the
+// entry is already in use or if every entry is in use.
+vcpu_ept_mmr_entry* insert_mmr(vcpu_ept_mmrs& mmrs, uint64_t const start,
+    uint64_t const size, uint8_t const mode, size_t const idx) {
+  auto const entry = alloc_mmr(mmrs, start, size, mode, idx);
+  if (!entry)
+    return nullptr;
+
+  auto const pos = upper_bound_mmr(mmrs, mmr_page_start(*entry));
+
+  memmove(&mmrs.sorted[pos + 1], &mmrs.sorted[pos],
+    (mmrs.count - pos) * sizeof(mmrs.sorted[0]));
+
+  mmrs.sorted[pos] = static_cast<uint16_t>(entry - mmrs.entries);
+  ++mmrs.count;
+
+  build_mmr_index(mmrs);
+
+  return entry;
+}
+
+// add an MMR that is served by a debug register. the entry is reserved like
+// any other MMR, but it isn't added to the index so the EPT ignores it.
+vcpu_ept_mmr_entry* insert_watched_mmr(vcpu_ept_mmrs& mmrs, uint64_t const start,
+    uint64_t const size, uint8_t const mode, size_t const idx) {
+  auto const entry = alloc_mmr(mmrs, start, size, mode, idx);
+  if (entry)
+    entry->watched = true;
+
+  return entry;
+}
+
+// remove an MMR from the index
+void erase_mmr(vcpu_ept_mmrs& mmrs, vcpu_ept_mmr_entry& entry) {
+  auto const idx = static_cast<size_t>(&entry - mmrs.entries);
+
+  if (entry.size == 0)
+    return;
+
+  if (entry.watched) {
+    attach_mmr_filter(mmrs, entry, nullptr);
+
+    mmrs.used[idx / 64] &= ~(1ull << (idx % 64));
+    entry.size    = 0;
+    entry.watched = false;
+    return;
+  }
+
+  // the entry is somewhere in the run of entries with the same start address
+  auto pos = upper_bound_mmr(mmrs, mmr_page_start(entry));
+  while (pos > 0 && mmrs.sorted[pos - 1] != idx)
+    --pos;
+
+  if (pos == 0)
+    return;
+
+  --pos;
+
+  memmove(&mmrs.sorted[pos], &mmrs.sorted[pos + 1],
+    (mmrs.count - pos - 1) * sizeof(mmrs.sorted[0]));
+
+  --mmrs.count;
+
+  attach_mmr_filter(mmrs, entry, nullptr);
+
+  mmrs.used[idx / 64] &= ~(1ull << (idx % 64));
+  entry.size = 0;
+
+  build_mmr_index(mmrs);
+}
+
+// get the entry that an MMR handle points to, or null if the handle is invalid
+vcpu_ept_mmr_entry* get_mmr(vcpu_ept_mmrs& mmrs, uint64_t const handle) {
+  auto const first = reinterpret_cast<uint64_t>(&mmrs.entries[0]);
+
+  if (handle < first || handle >= first + sizeof(mmrs.entries))
+    return nullptr;
+
+  if ((handle - first) % sizeof(vcpu_ept_mmr_entry) != 0)
+    return nullptr;
+
+  auto const entry = reinterpret_cast<vcpu_ept_mmr_entry*>(handle);
+  return entry->size != 0 ? entry : nullptr;
+}
+
+// attach a filter to an MMR, replacing its current filter, or remove its
+// filter if null is passed. returns false if every filter is in use.
+bool attach_mmr_filter(vcpu_ept_mmrs& mmrs,
+    vcpu_ept_mmr_entry& entry, mmr_filter const* const filter) {
+  if (!filter) {
+    if (entry.filter)
+      mmrs.filters_used &= ~(1ull << (entry.filter - 1));
+
+    entry.filter = 0;
+    return true;
+  }
+
+  if (!entry.filter) {
+    unsigned long idx = 0;
+
+    // all filters are in use
+    if (!_BitScanForward64(&idx, ~mmrs.filters_used))
+      return false;
+
+    mmrs.filters_used |= (1ull << idx);
+    entry.filter = static_cast<uint8_t>(idx + 1);
+  }
+
+  mmrs.filters[entry.filter - 1] = *filter;
+
+  return true;
+}
+
+// get the combined mode of every MMR that overlaps [start, start + size)
+uint8_t get_mmr_mode(vcpu_ept_mmrs const& mmrs,
+    uint64_t const start, uint64_t const size) {
+  uint8_t mode = 0;
+
+  for_each_mmr(mmrs, start, size, [&](vcpu_ept_mmr_entry const& entry) {
+    mode |= entry.mode;
+  });
+
+  return mode;
+}
+
+// check whether every MMR that overlaps [start, start + size) covers all of
+// it, meaning that every page in the range is monitored in the same way
+bool is_mmr_mode_uniform(vcpu_ept_mmrs const& mmrs,
+    uint64_t const start, uint64_t const size) {
+  bool uniform = true;
+
+  for_each_mmr(mmrs, start, size, [&](vcpu_ept_mmr_entry const& entry) {
+    if (mmr_page_start(entry) > start || mmr_page_end(entry) < start + size)
+      uniform = false;
+  });
+
+  return uniform;
+}
+
+// find the entry with the specified key, or the entry that it should be
+// inserted into (which might be an entry that was reset). null is returned
+// if the table is full.
+static mmr_profile_entry* find_mmr_profile_entry(mmr_profile_entry* const table,
+    uint64_t const rip, uint64_t const cr3, uint16_t const mmr, uint8_t const access) {
+  auto hash = rip * 0x9E3779B97F4A7C15ull;
+  hash ^= cr3 + ((static_cast<uint64_t>(mmr) << 3) | access);
+  hash *= 0x9E3779B97F4A7C15ull;
+
+  auto idx = (hash >> 32) & (mmr_profile_capacity - 1);
+
+  mmr_profile_entry* reusable = nullptr;
+
+  for (size_t i = 0; i < mmr_profile_capacity; ++i) {
+    auto& entry = table[idx];
+
+    // the end of the probe sequence was reached without finding the key
+    if (!entry.access)
+      return reusable ? reusable : &entry;
+
+    if (entry.rip == rip && entry.cr3 == cr3 &&
+        entry.mmr == mmr && entry.access == access)
+      return &entry;
+
+    if (!entry.count && !reusable)
+      reusable = &entry;
+
+    idx = (idx + 1) & (mmr_profile_capacity - 1);
+  }
+
+  return reusable;
+}
+
+// increment the count of a key, returns false if the table is full
+static bool increment_mmr_profile_entry(mmr_profile_entry* const table,
+    uint64_t const rip, uint64_t const cr3, uint16_t const mmr, uint8_t const access) {
+  auto const entry = find_mmr_profile_entry(table, rip, cr3, mmr, access);
+  if (!entry)
+    return false;
+
+  entry->rip    = rip;
+  entry->cr3    = cr3;
+  entry->mmr    = mmr;
+  entry->access = access;
+  ++entry->count;
+
+  return true;
+}
+
+// initialize an empty MMR profile
+void prepare_mmr_profile(vcpu_mmr_profile& profile) {
+  profile.lock.initialize();
+
+  memset(&profile.accesses, 0, sizeof(profile.accesses));
+  memset(&profile.pages, 0, sizeof(profile.pages));
+  memset(&profile.dropped, 0, sizeof(profile.dropped));
+}
+
+// count an access to an aggregating MMR, both for the code that made it and
+// for the page that it was made to
+void record_mmr_access(vcpu_mmr_profile& profile, size_t const mmr,
+    uint64_t const physical_address, uint64_t const rip, uint64_t const cr3, uint8_t const access) {
+  scoped_spin_lock lock(profile.lock);
+
+  auto const idx = static_cast<uint16_t>(mmr);
+
+  auto const counted_access = increment_mmr_profile_entry(
+    profile.accesses, rip, cr3, idx, access);
+  auto const counted_page = increment_mmr_profile_entry(
+    profile.pages, physical_address & ~0xFFFull, 0, idx, access);
+
+  if (!counted_access || !counted_page)
+    ++profile.dropped[mmr];
+}
+
+// clear every count of an MMR
+void reset_mmr_profile(vcpu_mmr_profile& profile, size_t const mmr) {
+  scoped_spin_lock lock(profile.lock);
+
+  // the keys are kept so that probe sequences aren't broken up
+  for (size_t i = 0; i < mmr_profile_capacity; ++i) {
+    if (profile.accesses[i].mmr == mmr)
+      profile.accesses[i].count = 0;
+
+    if (profile.pages[i].mmr == mmr)
+      profile.pages[i].count = 0;
+  }
+
+  profile.dropped[mmr] = 0;
+}
+
+// copy the counts of an MMR into a buffer, starting at the specified cursor,
+// and clear them if requested. the cursor is advanced past the last entry
+// that was copied. returns the number of counts that were copied.
+size_t copy_mmr_profile(vcpu_mmr_profile& profile, size_t const mmr,
+    mmr_access_count* const counts, size_t const max_count, bool const reset, size_t& cursor) {
+  scoped_spin_lock lock(profile.lock);
+
+  size_t count = 0;
+
+  // the cursor goes through the access table first, and then the page table
+  for (; cursor < mmr_profile_capacity * 2 && count < max_count; ++cursor) {
+    auto const is_page = cursor >= mmr_profile_capacity;
+    auto& entry = is_page ? profile.pages[cursor - mmr_profile_capacity]
+                          : profile.accesses[cursor];
+
+    if (entry.mmr != mmr || !entry.count)
+      continue;
+
+    auto& c = counts[count++];
+    c.rip          = is_page ? 0 : entry.rip;
+    c.cr3          = entry.cr3;
+    c.page_address = is_page ? entry.rip : 0;
+    c.access       = entry.access;
+    c.count        = entry.count;
+
+    if (reset)
+      entry.count = 0;
+  }
+
+  return count;
+}
+
+// get the number of accesses to an MMR that couldn't be counted, and clear
+// it if requested
+uint64_t read_mmr_dropped_count(vcpu_mmr_profile& profile,
+    size_t const mmr, bool const reset) {
+  scoped_spin_lock lock(profile.lock);
+
+  auto const dropped = profile.dropped[mmr];
+
+  if (reset)
+    profile.dropped[mmr] = 0;
+
+  return dropped;
+}
+
+// initialize an empty MMR trace
+void prepare_mmr_trace(vcpu_mmr_trace& trace) {
+  trace.lock.initialize();
+
+  trace.head         = 0;
+  trace.tail         = 0;
+  trace.dropped      = 0;
+  trace.dropped_read = 0;
+}
+
+// copy the oldest events of a trace into a buffer without consuming them.
+// returns the number of events that were copied.
+// this should be called while holding the trace lock.
+size_t peek_mmr_trace(vcpu_mmr_trace const& trace,
+    mmr_event* const events, size_t const max_count) {
+  auto const head = trace.head;
+  auto const tail = trace.tail;
+
+  // the events can only be read once the head that published them was read
+  _ReadBarrier();
+
+  auto const available = static_cast<size_t>(head - tail);
+  auto const count     = available < max_count ? available : max_count;
+
+  for (size_t i = 0; i < count; ++i)
+    events[i] = trace.events[(tail + i) & (mmr_trace_capacity - 1)];
+
+  return count;
+}
+
+// consume the oldest events of a trace, so that the vcpu can reuse them.
+// this should be called while holding the trace lock.
+void consume_mmr_trace(vcpu_mmr_trace& trace, size_t const count) {
+  // the events have to be copied before the vcpu is allowed to overwrite them
+  _ReadWriteBarrier();
+  trace.tail = trace.tail + count;
+}
+
+// get the number of events that were dropped since the last time that
+// this was called.
+// this should be called while holding the trace lock.
+uint64_t read_mmr_trace_dropped_count(vcpu_mmr_trace& trace) {
+  auto const dropped = trace.dropped;
+  auto const count   = dropped - trace.dropped_read;
+
+  trace.dropped_read = dropped;
+
+  return count;
+}
+
+} // namespace hv
+
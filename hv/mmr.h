@@ -0,0 +1,339 @@
+#pragma once
+
+#include "spin-lock.h"
+#include "hypercalls.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+// TODO: make this a bitfield instead
+enum mmr_memory_mode {
+  mmr_memory_mode_r = 0b001,
+  mmr_memory_mode_w = 0b010,
+  mmr_memory_mode_x = 0b100,
+
+  // count accesses in the MMR profile instead of logging every one of them
+  mmr_memory_mode_aggregate = 0b1000,
+
+  // write a binary record of every access into the MMR trace instead of
+  // logging it as text
+  mmr_memory_mode_trace = 0b10000
+};
+
+// monitored memory ranges
+struct vcpu_ept_mmr_entry {
+  // start physical address
+  uint64_t start;
+
+  // size of the range in bytes, a value of 0 indicates that this entry isn't being used
+  uint64_t size;
+
+  // the memory access type that we are monitoring for
+  uint8_t mode;
+
+  // index + 1 of the filter in vcpu_ept_mmrs::filters, 0 if unfiltered
+  uint8_t filter;
+
+  // whether the MMR is served by a debug register instead of the EPT
+  bool watched;
+
+  // number of TSC ticks that a page is left accessible for after it was
+  // accessed, or 0 if it is re-protected after a single instruction
+  uint32_t window;
+};
+
+// every MMR that is installed on a vcpu. active entries are kept sorted by
+// their (page-aligned) start address, and the sorted array doubles as an
+// implicit interval tree so that every MMR that overlaps a page can be found
+// in O(log n) time, even when MMRs overlap each other.
+struct vcpu_ept_mmrs {
+  static constexpr size_t capacity = 2048;
+  static_assert(capacity <= 0x10000, "MMR indices are stored as 16-bit integers!");
+
+  // MMR handles point into this buffer, so entries never move
+  vcpu_ept_mmr_entry entries[capacity];
+
+  // bitmap of entries that are in use
+  uint64_t used[capacity / 64];
+
+  // indices of the active entries, sorted by start address
+  uint16_t sorted[capacity];
+  size_t count;
+
+  // max end address of the subtree that is rooted at each node
+  uint64_t max_end[capacity];
+
+  // level of the root node of the implicit tree (-1 if empty)
+  int max_level;
+
+  // only a few MMRs have a filter, so filters aren't stored in the entries
+  static constexpr size_t filter_capacity = 64;
+  static_assert(filter_capacity <= 64, "Filters are tracked with a 64-bit bitmap!");
+
+  mmr_filter filters[filter_capacity];
+
+  // bitmap of filters that are in use
+  uint64_t filters_used;
+};
+
+// number of (RIP, CR3, access) combinations, and of (page, access)
+// combinations, that can be counted on every vcpu
+inline constexpr size_t mmr_profile_capacity = 1024;
+static_assert((mmr_profile_capacity & (mmr_profile_capacity - 1)) == 0,
+  "MMR profile capacity must be a power of two!");
+
+// how often an aggregating MMR was accessed by the same code in the same
+// address space. for per-page totals, the physical address of the page is
+// stored instead of RIP and CR3 is 0.
+struct mmr_profile_entry {
+  uint64_t rip;
+  uint64_t cr3;
+
+  // a count of 0 means that the entry was reset and can be reused
+  uint64_t count;
+
+  // index of the MMR entry
+  uint16_t mmr;
+
+  // combination of mmr_memory_mode flags, a value of 0 indicates that this
+  // entry was never used
+  uint8_t access;
+};
+
+// access counts of every aggregating MMR on a vcpu. these are only updated
+// by the vcpu that they belong to, so the lock is normally uncontended.
+struct vcpu_mmr_profile {
+  spin_lock lock;
+
+  // open-addressed hash tables
+  mmr_profile_entry accesses[mmr_profile_capacity];
+  mmr_profile_entry pages[mmr_profile_capacity];
+
+  // accesses of every MMR that didn't fit into one of the tables
+  uint64_t dropped[vcpu_ept_mmrs::capacity];
+};
+
+// number of MMR events that fit into the trace of every vcpu
+inline constexpr size_t mmr_trace_capacity = 512;
+static_assert((mmr_trace_capacity & (mmr_trace_capacity - 1)) == 0,
+  "MMR trace capacity must be a power of two!");
+
+// ring of MMR events on a vcpu. the vcpu is the only producer and never
+// takes the lock, which only keeps readers on other vcpus from consuming
+// the same events.
+struct vcpu_mmr_trace {
+  spin_lock lock;
+
+  // number of events that were ever published, and that were ever consumed
+  uint64_t volatile head;
+  uint64_t volatile tail;
+
+  // events that were dropped because the ring was full, and how many of
+  // those were already reported to a reader
+  uint64_t volatile dropped;
+  uint64_t dropped_read;
+
+  mmr_event events[mmr_trace_capacity];
+};
+
+// whether every vcpu gets an MMR profile and an MMR trace. while either is
+// disabled, MMRs are installed without the matching mode flag and log
+// their accesses instead.
+inline constexpr bool mmr_profile_enabled = true;
+inline constexpr bool mmr_trace_enabled   = true;
+
+// mmr_memory_mode flags that MMRs can be installed with
+inline constexpr uint8_t mmr_memory_mode_mask =
+  mmr_memory_mode_r | mmr_memory_mode_w | mmr_memory_mode_x |
+  (mmr_profile_enabled ? mmr_memory_mode_aggregate : 0) |
+  (mmr_trace_enabled ? mmr_memory_mode_trace : 0);
+
+// the MMR state of every vcpu. this is allocated separately from the vcpus,
+// and the profiles and traces are only allocated if they are enabled.
+struct mmr_pool {
+  vcpu_ept_mmrs* mmrs;
+
+  // null if disabled
+  vcpu_mmr_profile* profiles;
+  vcpu_mmr_trace* traces;
+};
+
+// page-aligned start address of an MMR
+inline uint64_t mmr_page_start(vcpu_ept_mmr_entry const& entry) {
+  return entry.start & ~0xFFFull;
+}
+
+// page-aligned end address of an MMR (exclusive)
+inline uint64_t mmr_page_end(vcpu_ept_mmr_entry const& entry) {
+  return (entry.start + entry.size + 0xFFF) & ~0xFFFull;
+}
+
+// allocate the MMR state of every vcpu
+bool create_mmr_pool(mmr_pool& pool, size_t vcpu_count);
+
+// free the memory that was allocated with create_mmr_pool()
+void destroy_mmr_pool(mmr_pool& pool);
+
+// initialize an empty MMR index
+void prepare_mmrs(vcpu_ept_mmrs& mmrs);
+
+// get the index of the first unused entry, or capacity if every entry is in use
+size_t find_free_mmr(vcpu_ept_mmrs const& mmrs);
+
+// add an MMR to the index. a specific entry can be requested with idx,
+// otherwise the first unused entry is taken. null is returned if the
+// entry is already in use or if every entry is in use.
+vcpu_ept_mmr_entry* insert_mmr(vcpu_ept_mmrs& mmrs, uint64_t start,
+    uint64_t size, uint8_t mode, size_t idx = vcpu_ept_mmrs::capacity);
+
+// add an MMR that is served by a debug register. the entry is reserved like
+// any other MMR, but it isn't added to the index so the EPT ignores it.
+vcpu_ept_mmr_entry* insert_watched_mmr(vcpu_ept_mmrs& mmrs, uint64_t start,
+    uint64_t size, uint8_t mode, size_t idx);
+
+// remove an MMR from the index
+void erase_mmr(vcpu_ept_mmrs& mmrs, vcpu_ept_mmr_entry& entry);
+
+// get the entry that an MMR handle points to, or null if the handle is invalid
+vcpu_ept_mmr_entry* get_mmr(vcpu_ept_mmrs& mmrs, uint64_t handle);
+
+// attach a filter to an MMR, replacing its current filter, or remove its
+// filter if null is passed. returns false if every filter is in use.
+bool attach_mmr_filter(vcpu_ept_mmrs& mmrs,
+  vcpu_ept_mmr_entry& entry, mmr_filter const* filter);
+
+// get the filter of an MMR, or null if it doesn't have one
+inline mmr_filter const* get_mmr_filter(vcpu_ept_mmrs const& mmrs,
+    vcpu_ept_mmr_entry const& entry) {
+  return entry.filter ? &mmrs.filters[entry.filter - 1] : nullptr;
+}
+
+// get the combined mode of every MMR that overlaps [start, start + size)
+uint8_t get_mmr_mode(vcpu_ept_mmrs const& mmrs, uint64_t start, uint64_t size);
+
+// check whether every MMR that overlaps [start, start + size) covers all of
+// it, meaning that every page in the range is monitored in the same way
+bool is_mmr_mode_uniform(vcpu_ept_mmrs const& mmrs, uint64_t start, uint64_t size);
+
+// initialize an empty MMR profile
+void prepare_mmr_profile(vcpu_mmr_profile& profile);
+
+// count an access to an aggregating MMR, both for the code that made it and
+// for the page that it was made to
+void record_mmr_access(vcpu_mmr_profile& profile, size_t mmr,
+  uint64_t physical_address, uint64_t rip, uint64_t cr3, uint8_t access);
+
+// clear every count of an MMR
+void reset_mmr_profile(vcpu_mmr_profile& profile, size_t mmr);
+
+// copy the counts of an MMR into a buffer, starting at the specified cursor,
+// and clear them if requested. the cursor is advanced past the last entry
+// that was copied. returns the number of counts that were copied.
+size_t copy_mmr_profile(vcpu_mmr_profile& profile, size_t mmr,
+  mmr_access_count* counts, size_t max_count, bool reset, size_t& cursor);
+
+// get the number of accesses to an MMR that couldn't be counted, and clear
+// it if requested
+uint64_t read_mmr_dropped_count(vcpu_mmr_profile& profile, size_t mmr, bool reset);
+
+// initialize an empty MMR trace
+void prepare_mmr_trace(vcpu_mmr_trace& trace);
+
+// get the next free event in the trace, or null (and count the event as
+// dropped) if the ring is full. the event isn't visible to readers until
+// it is published with commit_mmr_event().
+// this should only be called by the vcpu that the trace belongs to.
+inline mmr_event* begin_mmr_event(vcpu_mmr_trace& trace) {
+  if (trace.head - trace.tail >= mmr_trace_capacity) {
+    trace.dropped = trace.dropped + 1;
+    return nullptr;
+  }
+
+  return &trace.events[trace.head & (mmr_trace_capacity - 1)];
+}
+
+// publish the event that was returned by begin_mmr_event()
+// this should only be called by the vcpu that the trace belongs to.
+inline void commit_mmr_event(vcpu_mmr_trace& trace) {
+  // stores aren't reordered with other stores on x86, so the event only has
+  // to be written before the head as far as the compiler is concerned
+  _WriteBarrier();
+  trace.head = trace.head + 1;
+}
+
+// copy the oldest events of a trace into a buffer without consuming them.
+// returns the number of events that were copied.
+// this should be called while holding the trace lock.
+size_t peek_mmr_trace(vcpu_mmr_trace const& trace, mmr_event* events, size_t max_count);
+
+// consume the oldest events of a trace, so that the vcpu can reuse them.
+// this should be called while holding the trace lock.
+void consume_mmr_trace(vcpu_mmr_trace& trace, size_t count);
+
+// get the number of events that were dropped since the last time that
+// this was called.
+// this should be called while holding the trace lock.
+uint64_t read_mmr_trace_dropped_count(vcpu_mmr_trace& trace);
+
+// call fn() for every MMR whose pages overlap [start, start + size)
+template <typename Fn>
+void for_each_mmr(vcpu_ept_mmrs const& mmrs,
+    uint64_t const start, uint64_t const size, Fn const fn) {
+  if (mmrs.count == 0)
+    return;
+
+  auto const end = start + size;
+  auto const n   = static_cast<int64_t>(mmrs.count);
+
+  auto const entry_at = [&](int64_t const i) -> vcpu_ept_mmr_entry const& {
+    return mmrs.entries[mmrs.sorted[i]];
+  };
+
+  // top-down traversal of the implicit tree. a node at level k has its
+  // children at x - 2^(k-1) and x + 2^(k-1), and the left child can be out
+  // of range (in which case it is still traversed).
+  struct node {
+    int64_t x;
+    int     k;
+    bool    left_done;
+  } stack[64];
+
+  int t = 0;
+  stack[t++] = { (1ll << mmrs.max_level) - 1, mmrs.max_level, false };
+
+  while (t > 0) {
+    auto const z = stack[--t];
+
+    // small subtrees are scanned linearly
+    if (z.k <= 3) {
+      auto const i0 = z.x >> z.k << z.k;
+      auto i1 = i0 + (1ll << (z.k + 1)) - 1;
+      if (i1 > n)
+        i1 = n;
+
+      for (auto i = i0; i < i1 && mmr_page_start(entry_at(i)) < end; ++i) {
+        if (start < mmr_page_end(entry_at(i)))
+          fn(entry_at(i));
+      }
+    }
+    else if (!z.left_done) {
+      auto const y = z.x - (1ll << (z.k - 1));
+
+      // come back to this node after the left subtree
+      stack[t++] = { z.x, z.k, true };
+
+      if (y >= n || mmrs.max_end[y] > start)
+        stack[t++] = { y, z.k - 1, false };
+    }
+    else if (z.x < n && mmr_page_start(entry_at(z.x)) < end) {
+      if (start < mmr_page_end(entry_at(z.x)))
+        fn(entry_at(z.x));
+
+      stack[t++] = { z.x + (1ll << (z.k - 1)), z.k - 1, false };
+    }
+  }
+}
+
+} // namespace hv
+
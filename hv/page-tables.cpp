@@ -5,8 +5,43 @@
 
 namespace hv {
 
-// directly map physical memory into the host page tables
-static void map_physical_memory(host_page_tables& pt) {
+// directly map physical memory into the host page tables using 1GB pages
+static void map_physical_memory_1gb(host_page_tables& pt) {
+  for (uint64_t i = 0; i < host_physical_memory_pml4_count; ++i) {
+    auto& pml4e = pt.pml4[host_physical_memory_pml4_idx + i];
+    pml4e.flags                    = 0;
+    pml4e.present                  = 1;
+    pml4e.write                    = 1;
+    pml4e.supervisor               = 0;
+    pml4e.page_level_write_through = 0;
+    pml4e.page_level_cache_disable = 0;
+    pml4e.accessed                 = 0;
+    pml4e.execute_disable          = 0;
+    pml4e.page_frame_number = MmGetPhysicalAddress(&pt.phys_pdpts[i]).QuadPart >> 12;
+
+    for (uint64_t j = 0; j < 512; ++j) {
+      pdpte_1gb_64 pdpte;
+      pdpte.flags                    = 0;
+      pdpte.present                  = 1;
+      pdpte.write                    = 1;
+      pdpte.supervisor               = 0;
+      pdpte.page_level_write_through = 0;
+      pdpte.page_level_cache_disable = 0;
+      pdpte.accessed                 = 0;
+      pdpte.dirty                    = 0;
+      pdpte.large_page               = 1;
+      pdpte.global                   = 0;
+      pdpte.pat                      = 0;
+      pdpte.execute_disable          = 0;
+      pdpte.page_frame_number        = (i << 9) + j;
+
+      pt.phys_pdpts[i][j].flags = pdpte.flags;
+    }
+  }
+}
+
+// directly map physical memory into the host page tables using 2MB pages
+static void map_physical_memory_2mb(host_page_tables& pt) {
   auto& pml4e = pt.pml4[host_physical_memory_pml4_idx];
   pml4e.flags                    = 0;
   pml4e.present                  = 1;
@@ -16,13 +51,12 @@ static void map_physical_memory(host_page_tables& pt) {
   pml4e.page_level_cache_disable = 0;
   pml4e.accessed                 = 0;
   pml4e.execute_disable          = 0;
-  pml4e.page_frame_number = MmGetPhysicalAddress(&pt.phys_pdpt).QuadPart >> 12;
+  pml4e.page_frame_number = MmGetPhysicalAddress(&pt.phys_pdpts[0]).QuadPart >> 12;
 
-  // TODO: add support for 1GB pages
   // TODO: check if 2MB pages are supported (pretty much always are)
 
   for (uint64_t i = 0; i < host_physical_memory_pd_count; ++i) {
-    auto& pdpte = pt.phys_pdpt[i];
+    auto& pdpte = pt.phys_pdpts[0][i];
     pdpte.flags                    = 0;
     pdpte.present                  = 1;
     pdpte.write                    = 1;
@@ -52,6 +86,20 @@ static void map_physical_memory(host_page_tables& pt) {
   }
 }
 
+// directly map physical memory into the host page tables
+static void map_physical_memory(host_page_tables& pt) {
+  cpuid_eax_80000001 cpuid_80000001;
+  __cpuid(reinterpret_cast<int*>(&cpuid_80000001), 0x80000001);
+
+  // 1GB pages let us map a lot more physical memory, which is needed
+  // on large-memory systems where the EPT paging structures (or the
+  // guest page tables) can live anywhere in physical memory
+  if (cpuid_80000001.edx.pages_1gb_available)
+    map_physical_memory_1gb(pt);
+  else
+    map_physical_memory_2mb(pt);
+}
+
 // initialize the host page tables
 void prepare_host_page_tables() {
   auto& pt = ghv.host_page_tables;
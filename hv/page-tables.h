@@ -4,11 +4,18 @@
 
 namespace hv {
 
-// how much of physical memory to map into the host address-space
+// how much of physical memory to map into the host address-space when
+// 1GB pages are supported (each PML4E maps 512GB of physical memory)
+inline constexpr size_t host_physical_memory_pml4_count = 8;
+
+// how much of physical memory to map into the host address-space when
+// 1GB pages aren't supported (each PD maps 1GB of physical memory)
 inline constexpr size_t host_physical_memory_pd_count = 64;
 
-// physical memory is directly mapped to this pml4 entry
-inline constexpr uint64_t host_physical_memory_pml4_idx = 255;
+// physical memory is directly mapped starting at this pml4 entry. this
+// is right below the kernel address space in the top half of the PML4.
+inline constexpr uint64_t host_physical_memory_pml4_idx =
+  256 - host_physical_memory_pml4_count;
 
 // directly access physical memory by using [base + offset]
 inline uint8_t* const host_physical_memory_base = reinterpret_cast<uint8_t*>(
@@ -18,10 +25,10 @@ struct host_page_tables {
   // array of PML4 entries that point to a PDPT
   alignas(0x1000) pml4e_64 pml4[512];
 
-  // PDPT for mapping physical memory
-  alignas(0x1000) pdpte_64 phys_pdpt[512];
+  // PDPTs for mapping physical memory
+  alignas(0x1000) pdpte_64 phys_pdpts[host_physical_memory_pml4_count][512];
 
-  // PDs for mapping physical memory
+  // PDs for mapping physical memory (only used if 1GB pages aren't supported)
   alignas(0x1000) pde_2mb_64 phys_pds[host_physical_memory_pd_count][512];
 };
 
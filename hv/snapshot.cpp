@@ -0,0 +1,192 @@
+#include "snapshot.h"
+#include "hypercalls.h"
+#include "exception-routines.h"
+#include "page-tables.h"
+#include "hv.h"
+
+#include <ntddk.h>
+
+namespace hv {
+
+static_assert((snapshot_table_capacity & (snapshot_table_capacity - 1)) == 0,
+  "Snapshot table capacity must be a power of two!");
+
+// allocate the memory for the memory snapshot
+bool create_snapshot(memory_snapshot& snapshot) {
+  snapshot.control_lock.initialize();
+  snapshot.lock.initialize();
+  snapshot.table       = nullptr;
+  snapshot.copy_count  = 0;
+  snapshot.fault_count = 0;
+  snapshot.active      = false;
+  snapshot.overflowed  = false;
+
+  if (!create_ept_page_pool(snapshot.pool, snapshot_pool_page_count))
+    return false;
+
+  snapshot.table = static_cast<snapshot_entry*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, snapshot_table_capacity * sizeof(snapshot_entry), 'fr0g'));
+
+  if (!snapshot.table) {
+    destroy_snapshot(snapshot);
+    return false;
+  }
+
+  memset(snapshot.table, 0, snapshot_table_capacity * sizeof(snapshot_entry));
+
+  return true;
+}
+
+// free the memory that was allocated with create_snapshot()
+void destroy_snapshot(memory_snapshot& snapshot) {
+  destroy_ept_page_pool(snapshot.pool);
+
+  if (snapshot.table)
+    ExFreePoolWithTag(snapshot.table, 'fr0g');
+
+  snapshot.table      = nullptr;
+  snapshot.copy_count = 0;
+}
+
+// give every copy back to the pool and clear the counters
+void reset_snapshot(memory_snapshot& snapshot) {
+  scoped_spin_lock lock(snapshot.lock);
+
+  for (size_t i = 0; i < snapshot_table_capacity; ++i) {
+    auto& entry = snapshot.table[i];
+    if (!entry.copy_pfn)
+      continue;
+
+    free_ept_page(snapshot.pool, entry.copy_pfn);
+    entry.pfn      = 0;
+    entry.copy_pfn = 0;
+  }
+
+  snapshot.copy_count  = 0;
+  snapshot.fault_count = 0;
+  snapshot.overflowed  = false;
+}
+
+// write-protect every range of RAM on the current vcpu for the snapshot, or
+// give write access back, and flush the EPT.
+// this should only be called from root-mode.
+void set_snapshot_protection(vcpu_ept_data& ept, bool const enable) {
+  ept.snapshot_protected = enable;
+
+  for (size_t i = 0; i < ghv.ram_range_count; ++i) {
+    auto const& range = ghv.ram_ranges[i];
+    set_ept_snapshot_protection(ept, range.start, range.end - range.start, enable);
+  }
+
+  flush_ept(ept);
+}
+
+// find the entry for a page, or the unused entry where it would be inserted.
+// this should be called while holding the snapshot lock.
+static snapshot_entry& find_snapshot_entry(memory_snapshot& snapshot, uint64_t const pfn) {
+  auto idx = ((pfn * 0x9E3779B97F4A7C15ull) >> 32) & (snapshot_table_capacity - 1);
+
+  // the table is never more than half full, so there is always an unused entry
+  while (snapshot.table[idx].copy_pfn && snapshot.table[idx].pfn != pfn)
+    idx = (idx + 1) & (snapshot_table_capacity - 1);
+
+  return snapshot.table[idx];
+}
+
+// copy a page into the pool unless it was already copied. false is returned
+// (and the snapshot is marked as overflowed) if the pool is empty.
+bool copy_snapshot_page(memory_snapshot& snapshot, uint64_t const pfn) {
+  // MMIO isn't covered by the snapshot since reading it can have side effects
+  if (!snapshot.active || !is_ram_address(pfn << 12))
+    return true;
+
+  scoped_spin_lock lock(snapshot.lock);
+
+  auto& entry = find_snapshot_entry(snapshot, pfn);
+  if (entry.copy_pfn)
+    return true;
+
+  auto const copy_pfn = alloc_ept_page(snapshot.pool);
+  if (!copy_pfn) {
+    snapshot.overflowed = true;
+    return false;
+  }
+
+  memcpy(host_physical_memory_base + (copy_pfn << 12),
+    host_physical_memory_base + (pfn << 12), 0x1000);
+
+  entry.pfn      = pfn;
+  entry.copy_pfn = copy_pfn;
+  ++snapshot.copy_count;
+
+  return true;
+}
+
+// handle a write to a page that might be write-protected for the snapshot.
+// the page is copied and becomes writable on the current vcpu. returns false
+// if the page isn't write-protected for the snapshot.
+// this should only be called from root-mode.
+bool handle_snapshot_write(memory_snapshot& snapshot,
+    vcpu_ept_data& ept, uint64_t const physical_address) {
+  if (!is_ept_snapshot_page(ept, physical_address))
+    return false;
+
+  if (snapshot.active)
+    _InterlockedIncrement64(&snapshot.fault_count);
+
+  // no vcpu can write to the page before it was copied, so the page still
+  // holds the same contents as when the snapshot was taken
+  copy_snapshot_page(snapshot, physical_address >> 12);
+
+  // out of EPT pages to split a large page with. the rest of the large page
+  // can't stay write-protected, so the snapshot is given up on this vcpu.
+  if (!release_ept_snapshot_page(ept, physical_address)) {
+    snapshot.overflowed = true;
+    set_snapshot_protection(ept, false);
+  }
+
+  return true;
+}
+
+// copy physical memory from the snapshot into a hypervisor buffer. returns
+// false if an exception occurred while copying.
+bool read_snapshot(memory_snapshot& snapshot,
+    void* const dst, uint64_t const physical_address, size_t const size) {
+  // pages that haven't been copied can't be written to while this is held
+  scoped_spin_lock lock(snapshot.lock);
+
+  for (size_t bytes_read = 0; bytes_read < size;) {
+    auto const curr_address = physical_address + bytes_read;
+    auto const offset       = curr_address & 0xFFF;
+    auto const curr_size    = min(size - bytes_read, 0x1000 - offset);
+
+    auto src = host_physical_memory_base + curr_address;
+
+    if (auto const copy_pfn = find_snapshot_entry(snapshot, curr_address >> 12).copy_pfn)
+      src = host_physical_memory_base + (copy_pfn << 12) + offset;
+
+    host_exception_info e;
+    memcpy_safe(e, static_cast<uint8_t*>(dst) + bytes_read, src, curr_size);
+
+    if (e.exception_occurred)
+      return false;
+
+    bytes_read += curr_size;
+  }
+
+  return true;
+}
+
+// get the state of the snapshot and how much of the pool is in use
+void get_snapshot_stats(memory_snapshot& snapshot, memory_snapshot_stats& stats) {
+  scoped_spin_lock lock(snapshot.lock);
+
+  stats.active          = snapshot.active;
+  stats.overflowed      = snapshot.overflowed;
+  stats.cow_fault_count = snapshot.fault_count;
+  stats.pool_used_count = snapshot.copy_count;
+  stats.pool_page_count = snapshot.pool.page_count;
+}
+
+} // namespace hv
+
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "spin-lock.h"
+#include "ept.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct memory_snapshot_stats;
+
+// number of pages that can hold the original contents of written pages
+inline constexpr size_t snapshot_pool_page_count = 8192;
+
+// capacity of the table that maps written pages to their copies. this is
+// twice the size of the pool so that probe sequences stay short.
+inline constexpr size_t snapshot_table_capacity = snapshot_pool_page_count * 2;
+
+// a page that was copied before the guest wrote to it
+struct snapshot_entry {
+  uint64_t pfn;
+
+  // PFN of the copy, a value of 0 indicates that this entry isn't being used
+  uint64_t copy_pfn;
+};
+
+// copy-on-write snapshot of RAM. every EPT leaf that maps RAM is
+// write-protected when the snapshot is taken, and the first write to a page
+// copies the page into the pool before the guest is allowed to modify it.
+// pages that haven't been copied still hold their contents from when the
+// snapshot was taken.
+struct memory_snapshot {
+  // held across run_on_all_vcpus() while a snapshot is taken or dropped
+  spin_lock control_lock;
+
+  // held while copying a page or reading from the snapshot
+  spin_lock lock;
+
+  // pages that hold the original contents of written pages
+  ept_page_pool pool;
+
+  // open-addressed hash table of the pages that were copied
+  snapshot_entry* table;
+  size_t copy_count;
+
+  // write faults that were caused by the snapshot. every vcpu faults at
+  // most once for each page that it writes to.
+  long long volatile fault_count;
+
+  // whether RAM is write-protected on every vcpu
+  bool volatile active;
+
+  // set if a page was written to without being copied, in which case the
+  // snapshot can't be read anymore
+  bool volatile overflowed;
+};
+
+// allocate the memory for the memory snapshot
+bool create_snapshot(memory_snapshot& snapshot);
+
+// free the memory that was allocated with create_snapshot()
+void destroy_snapshot(memory_snapshot& snapshot);
+
+// give every copy back to the pool and clear the counters
+void reset_snapshot(memory_snapshot& snapshot);
+
+// write-protect every range of RAM on the current vcpu for the snapshot, or
+// give write access back, and flush the EPT.
+// this should only be called from root-mode.
+void set_snapshot_protection(vcpu_ept_data& ept, bool enable);
+
+// copy a page into the pool unless it was already copied. false is returned
+// (and the snapshot is marked as overflowed) if the pool is empty.
+bool copy_snapshot_page(memory_snapshot& snapshot, uint64_t pfn);
+
+// handle a write to a page that might be write-protected for the snapshot.
+// the page is copied and becomes writable on the current vcpu. returns false
+// if the page isn't write-protected for the snapshot.
+// this should only be called from root-mode.
+bool handle_snapshot_write(memory_snapshot& snapshot,
+  vcpu_ept_data& ept, uint64_t physical_address);
+
+// copy physical memory from the snapshot into a hypervisor buffer. returns
+// false if an exception occurred while copying.
+bool read_snapshot(memory_snapshot& snapshot,
+  void* dst, uint64_t physical_address, size_t size);
+
+// get the state of the snapshot and how much of the pool is in use
+void get_snapshot_stats(memory_snapshot& snapshot, memory_snapshot_stats& stats);
+
+} // namespace hv
+
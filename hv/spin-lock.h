@@ -15,6 +15,11 @@ struct spin_lock {
       _mm_pause();
   }
 
+  // returns false if the lock is already held
+  bool try_acquire() {
+    return 0 == _InterlockedCompareExchange(&lock, 1, 0);
+  }
+
   void release() {
     lock = 0;
   }
@@ -179,7 +179,30 @@ static void prepare_external_structures(vcpu* const cpu) {
   prepare_host_idt(cpu->host_idt);
   prepare_host_gdt(cpu->host_gdt, &cpu->host_tss);
 
-  prepare_ept(cpu->ept);
+  prepare_ept(cpu->ept, cpu - ghv.vcpus);
+
+  prepare_watchpoints(cpu->watchpoints);
+}
+
+// re-protect the MMR page once its access window is over, or make sure that
+// the preemption timer causes a vm-exit by then
+static void update_mmr_window(vcpu* const cpu) {
+  auto const deadline = cpu->ept.mmr_window_deadline;
+  if (!deadline)
+    return;
+
+  auto const tsc = __rdtsc();
+
+  if (tsc >= deadline) {
+    rearm_mmr_page(cpu->ept);
+    return;
+  }
+
+  auto const ticks = (deadline - tsc) >>
+    cpu->cached.vmx_misc.preemption_timer_tsc_relationship;
+
+  if (ticks < cpu->preemption_timer)
+    cpu->preemption_timer = ticks;
 }
 
 // call the appropriate exit-handler for this vm-exit
@@ -191,6 +214,7 @@ static void dispatch_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
   case VMX_EXIT_REASON_NMI_WINDOW:                   handle_nmi_window(cpu);           break;
   case VMX_EXIT_REASON_EXECUTE_CPUID:                emulate_cpuid(cpu);               break;
   case VMX_EXIT_REASON_MOV_CR:                       handle_mov_cr(cpu);               break;
+  case VMX_EXIT_REASON_MOV_DR:                       handle_mov_dr(cpu);               break;
   case VMX_EXIT_REASON_EXECUTE_RDMSR:                emulate_rdmsr(cpu);               break;
   case VMX_EXIT_REASON_EXECUTE_WRMSR:                emulate_wrmsr(cpu);               break;
   case VMX_EXIT_REASON_EXECUTE_XSETBV:               emulate_xsetbv(cpu);              break;
@@ -239,6 +263,9 @@ bool handle_vm_exit(guest_context* const ctx) {
 
   dispatch_vm_exit(cpu, reason);
 
+  // run any work that other vcpus have queued for us
+  drain_work_queue(cpu);
+
   vmentry_interrupt_information interrupt_info;
   interrupt_info.flags = static_cast<uint32_t>(
     vmx_vmread(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD));
@@ -256,10 +283,16 @@ bool handle_vm_exit(guest_context* const ctx) {
   if (cpu->stop_virtualization) {
     // TODO: assert that CPL is 0
 
+    // make sure no other vcpu is left waiting on us
+    shutdown_work_queue(cpu);
+
     // ensure that the control register shadows reflect the guest values
     vmx_vmwrite(VMCS_CTRL_CR0_READ_SHADOW, read_effective_guest_cr0().flags);
     vmx_vmwrite(VMCS_CTRL_CR4_READ_SHADOW, read_effective_guest_cr4().flags);
 
+    // give the debug registers that serve MMRs back to the guest
+    disarm_all_watchpoints(cpu);
+
     // DR7
     __writedr(7, vmx_vmread(VMCS_GUEST_DR7));
 
@@ -310,6 +343,8 @@ bool handle_vm_exit(guest_context* const ctx) {
 
   hide_vm_exit_overhead(cpu);
 
+  update_mmr_window(cpu);
+
   // sync the vmcs state with the vcpu state
   vmx_vmwrite(VMCS_CTRL_TSC_OFFSET,                  cpu->tsc_offset);
   vmx_vmwrite(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, cpu->preemption_timer);
@@ -329,7 +364,11 @@ void handle_host_interrupt(trap_frame* const frame) {
     write_ctrl_proc_based(ctrl);
 
     auto const cpu = reinterpret_cast<vcpu*>(_readfsbase_u64());
-    ++cpu->queued_nmis;
+
+    // NMIs that were sent to kick us into processing our work queue
+    // only need to force a vm-exit and aren't delivered to the guest
+    if (!consume_work_queue_kick(cpu))
+      ++cpu->queued_nmis;
 
     break;
   }
@@ -403,6 +442,8 @@ bool virtualize_cpu(vcpu* const cpu) {
 
   DbgPrint("[hv] Initialized external structures.\n");
 
+  prepare_work_queue(cpu->work_queue);
+
   write_vmcs_ctrl_fields(cpu);
   write_vmcs_host_fields(cpu);
   write_vmcs_guest_fields();
@@ -430,6 +471,9 @@ bool virtualize_cpu(vcpu* const cpu) {
 
   DbgPrint("[hv] Launched VM on VCPU#%i.\n", KeGetCurrentProcessorIndex() + 1);
 
+  // other vcpus can now send work our way
+  cpu->work_queue.online = true;
+
   hypercall_input input;
   input.code = hypercall_ping;
   input.key  = hypercall_key;
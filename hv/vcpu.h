@@ -7,6 +7,8 @@
 #include "ept.h"
 #include "vmx.h"
 #include "timing.h"
+#include "work-queue.h"
+#include "watchpoints.h"
 
 namespace hv {
 
@@ -88,6 +90,12 @@ struct vcpu {
   // the number of NMIs that need to be delivered
   uint32_t volatile queued_nmis;
 
+  // work that other vcpus want us to run in root-mode
+  vcpu_work_queue work_queue;
+
+  // debug registers that serve small MMRs
+  vcpu_watchpoints watchpoints;
+
   // current TSC offset
   uint64_t tsc_offset;
 
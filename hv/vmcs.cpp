@@ -95,7 +95,8 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   vmx_vmwrite(VMCS_CTRL_CR4_READ_SHADOW, __readcr4() & ~CR4_VMX_ENABLE_FLAG);
 
   // 3.24.6.7
-  // try to trigger the least amount of CR3 exits as possible
+  // try to trigger the least amount of CR3 exits as possible. the target is
+  // dropped while any EPT hook is scoped to specific address spaces.
   vmx_vmwrite(VMCS_CTRL_CR3_TARGET_COUNT,   1);
   vmx_vmwrite(VMCS_CTRL_CR3_TARGET_VALUE_0, ghv.system_cr3.flags);
 
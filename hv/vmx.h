@@ -111,6 +111,11 @@ uint16_t current_guest_cpl();
 // increment the instruction pointer after emulating an instruction
 void skip_instruction();
 
+// increment the instruction pointer after emulating an instruction that
+// didn't cause an instruction-specific vm-exit (the vm-exit instruction
+// length is only valid for those)
+void skip_instruction(uint64_t length);
+
 // inject a non-maskable interrupt into the guest
 void inject_nmi();
 
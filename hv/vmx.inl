@@ -224,9 +224,16 @@ inline uint16_t current_guest_cpl() {
 
 // increment the instruction pointer after emulating an instruction
 inline void skip_instruction() {
+  skip_instruction(vmx_vmread(VMCS_VMEXIT_INSTRUCTION_LENGTH));
+}
+
+// increment the instruction pointer after emulating an instruction that
+// didn't cause an instruction-specific vm-exit (the vm-exit instruction
+// length is only valid for those)
+inline void skip_instruction(uint64_t const length) {
   // increment RIP
   auto const old_rip = vmx_vmread(VMCS_GUEST_RIP);
-  auto new_rip       = old_rip + vmx_vmread(VMCS_VMEXIT_INSTRUCTION_LENGTH);
+  auto new_rip       = old_rip + length;
 
   // handle wrap-around for 32-bit addresses
   // https://patchwork.kernel.org/project/kvm/patch/20200427165917.31799-1-pbonzini@redhat.com/
@@ -0,0 +1,237 @@
+#include "watchpoints.h"
+#include "vcpu.h"
+#include "mmr.h"
+
+#include <string.h>
+
+namespace hv {
+
+// DR7 bits (enables, condition, and length) that belong to a debug register
+static uint64_t dr7_mask(size_t const i) {
+  return (0b11ull << (i * 2)) | (0b1111ull << (16 + i * 4));
+}
+
+// the hardware value of DR0-DR3 is restored from the guest context
+static uint64_t& hardware_dr(vcpu* const cpu, size_t const i) {
+  return (&cpu->ctx->dr0)[i];
+}
+
+// get the size of the aligned block that a debug register has to watch in
+// order to cover the range, or 0 if it doesn't fit into 8 bytes
+static uint64_t get_watchpoint_length(uint64_t const address, uint64_t const size) {
+  for (uint64_t length = 1; length <= 8; length *= 2) {
+    if ((address & ~(length - 1)) + length >= address + size)
+      return length;
+  }
+
+  return 0;
+}
+
+// intercept the guest's accesses to the debug registers and the #DBs that
+// they cause, or stop intercepting them
+static void set_debug_register_exiting(bool const enable) {
+  auto ctrl = read_ctrl_proc_based();
+  ctrl.mov_dr_exiting = enable;
+  write_ctrl_proc_based(ctrl);
+
+  auto bitmap = vmx_vmread(VMCS_CTRL_EXCEPTION_BITMAP);
+  if (enable)
+    bitmap |= (1ull << debug);
+  else
+    bitmap &= ~(1ull << debug);
+
+  vmx_vmwrite(VMCS_CTRL_EXCEPTION_BITMAP, bitmap);
+}
+
+// combine the guest's DR7 with the debug registers that serve MMRs
+static void update_hardware_dr7(vcpu_watchpoints const& wp) {
+  dr7 value;
+  value.flags = wp.guest_dr7;
+
+  for (size_t i = 0; i < watchpoint_capacity; ++i) {
+    if (wp.mmrs[i])
+      value.flags &= ~dr7_mask(i);
+  }
+
+  // general detection is emulated in the MOV DR handler, since the #DB
+  // would be raised before the vm-exit
+  value.general_detect = 0;
+
+  // bit 10 is reserved and always set
+  value.flags |= wp.dr7 | (1ull << 10);
+
+  vmx_vmwrite(VMCS_GUEST_DR7, value.flags);
+}
+
+// initialize the watchpoints of a vcpu
+void prepare_watchpoints(vcpu_watchpoints& watchpoints) {
+  memset(&watchpoints, 0, sizeof(watchpoints));
+}
+
+// check whether a debug register can serve an MMR at the specified linear
+// address. the range has to fit into an aligned 8-byte block, and execute
+// MMRs can't monitor reads or writes at the same time.
+bool is_watchpoint_range(uint64_t const address,
+    uint64_t const size, uint8_t const mode) {
+  if (size == 0 || !(mode & 0b111))
+    return false;
+
+  // instruction breakpoints only match the first byte of an instruction
+  if (mode & mmr_memory_mode_x)
+    return size == 1 && !(mode & (mmr_memory_mode_r | mmr_memory_mode_w));
+
+  return get_watchpoint_length(address, size) != 0;
+}
+
+// serve an MMR with a debug register on the current vcpu. only debug
+// registers that the guest doesn't use are taken. returns false if every
+// debug register is in use.
+// this should only be called from root-mode.
+bool arm_watchpoint(vcpu* const cpu, size_t const mmr,
+    uint64_t const address, uint64_t const size, uint8_t const mode) {
+  auto& wp = cpu->watchpoints;
+
+  auto const length = get_watchpoint_length(address, size);
+  if (!length || wp.count >= watchpoint_capacity)
+    return false;
+
+  auto const guest_dr7 = wp.count > 0 ? wp.guest_dr7 : vmx_vmread(VMCS_GUEST_DR7);
+
+  // debug registers that the guest has enabled are never taken, since that
+  // would silently break the guest's breakpoints
+  size_t slot = watchpoint_capacity;
+  for (size_t i = 0; i < watchpoint_capacity; ++i) {
+    if (!wp.mmrs[i] && !(guest_dr7 & (0b11ull << (i * 2)))) {
+      slot = i;
+      break;
+    }
+  }
+
+  if (slot >= watchpoint_capacity)
+    return false;
+
+  // the guest's values are kept in the shadow copy from now on
+  if (wp.count == 0) {
+    for (size_t i = 0; i < 4; ++i)
+      wp.guest_dr[i] = hardware_dr(cpu, i);
+
+    wp.guest_dr6 = cpu->ctx->dr6;
+    wp.guest_dr7 = guest_dr7;
+    wp.dr7       = 0;
+
+    set_debug_register_exiting(true);
+  }
+
+  // R/W: 00 = execute, 01 = write, 11 = read or write. reads can't be
+  // watched on their own, so they are watched together with writes.
+  uint64_t condition = 0b01;
+  if (mode & mmr_memory_mode_x)
+    condition = 0b00;
+  else if (mode & mmr_memory_mode_r)
+    condition = 0b11;
+
+  // LEN: 00 = 1 byte, 01 = 2 bytes, 11 = 4 bytes, 10 = 8 bytes
+  uint64_t const lengths[] = { 0b00, 0b01, 0b01, 0b11, 0b11, 0b11, 0b11, 0b10 };
+
+  wp.dr7 |= (1ull << (slot * 2)) |
+    (((lengths[length - 1] << 2) | condition) << (16 + slot * 4));
+
+  wp.mmrs[slot]      = static_cast<uint16_t>(mmr + 1);
+  wp.addresses[slot] = address;
+  ++wp.count;
+
+  hardware_dr(cpu, slot) = address & ~(length - 1);
+  update_hardware_dr7(wp);
+
+  return true;
+}
+
+// free the debug register that serves an MMR on the current vcpu, and give
+// it back to the guest.
+// this should only be called from root-mode.
+void disarm_watchpoint(vcpu* const cpu, size_t const mmr) {
+  auto& wp = cpu->watchpoints;
+
+  for (size_t i = 0; i < watchpoint_capacity; ++i) {
+    if (wp.mmrs[i] != mmr + 1)
+      continue;
+
+    wp.mmrs[i]      = 0;
+    wp.addresses[i] = 0;
+    wp.dr7         &= ~dr7_mask(i);
+    --wp.count;
+
+    hardware_dr(cpu, i) = wp.guest_dr[i];
+
+    if (wp.count > 0) {
+      update_hardware_dr7(wp);
+      return;
+    }
+
+    // the guest owns the debug registers again
+    cpu->ctx->dr6 = wp.guest_dr6;
+    vmx_vmwrite(VMCS_GUEST_DR7, wp.guest_dr7);
+
+    set_debug_register_exiting(false);
+
+    return;
+  }
+}
+
+// free every debug register that serves an MMR on the current vcpu.
+// this should only be called from root-mode.
+void disarm_all_watchpoints(vcpu* const cpu) {
+  for (size_t i = 0; i < watchpoint_capacity; ++i) {
+    if (cpu->watchpoints.mmrs[i])
+      disarm_watchpoint(cpu, cpu->watchpoints.mmrs[i] - 1);
+  }
+}
+
+// get the value of a debug register as seen by the guest
+uint64_t read_guest_dr(vcpu* const cpu, uint64_t const idx) {
+  auto const& wp = cpu->watchpoints;
+
+  if (wp.count == 0) {
+    if (idx < 4)
+      return hardware_dr(cpu, idx);
+
+    return idx == 6 ? cpu->ctx->dr6 : vmx_vmread(VMCS_GUEST_DR7);
+  }
+
+  if (idx < 4)
+    return wp.guest_dr[idx];
+
+  return idx == 6 ? wp.guest_dr6 : wp.guest_dr7;
+}
+
+// set the value of a debug register as seen by the guest. the debug
+// registers that serve MMRs keep their hardware value.
+void write_guest_dr(vcpu* const cpu, uint64_t const idx, uint64_t const value) {
+  auto& wp = cpu->watchpoints;
+
+  if (wp.count == 0) {
+    if (idx < 4)
+      hardware_dr(cpu, idx) = value;
+    else if (idx == 6)
+      cpu->ctx->dr6 = value;
+    else
+      vmx_vmwrite(VMCS_GUEST_DR7, value);
+
+    return;
+  }
+
+  if (idx < 4) {
+    wp.guest_dr[idx] = value;
+
+    if (!wp.mmrs[idx])
+      hardware_dr(cpu, idx) = value;
+  }
+  else if (idx == 6)
+    wp.guest_dr6 = value;
+  else {
+    wp.guest_dr7 = value;
+    update_hardware_dr7(wp);
+  }
+}
+
+} // namespace hv
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// number of debug registers that can serve MMRs on every vcpu
+inline constexpr size_t watchpoint_capacity = 4;
+
+// debug registers that serve small MMRs instead of the EPT, so that accesses
+// to the rest of the page don't cause any vm-exits. while any of them is in
+// use, the guest's accesses to the debug registers are emulated with a
+// shadow copy and the #DBs that they cause are hidden from the guest.
+struct vcpu_watchpoints {
+  // index + 1 of the MMR entry that each debug register serves, 0 if unused
+  uint16_t mmrs[watchpoint_capacity];
+
+  // linear address of the MMR that each debug register serves
+  uint64_t addresses[watchpoint_capacity];
+
+  // DR7 bits of the debug registers that are in use
+  uint64_t dr7;
+
+  // the debug registers as seen by the guest. these are only used while
+  // at least one debug register is in use.
+  uint64_t guest_dr[4];
+  uint64_t guest_dr6;
+  uint64_t guest_dr7;
+
+  // number of debug registers that are in use
+  size_t count;
+};
+
+// initialize the watchpoints of a vcpu
+void prepare_watchpoints(vcpu_watchpoints& watchpoints);
+
+// check whether a debug register can serve an MMR at the specified linear
+// address. the range has to fit into an aligned 8-byte block, and execute
+// MMRs can't monitor reads or writes at the same time.
+bool is_watchpoint_range(uint64_t address, uint64_t size, uint8_t mode);
+
+// serve an MMR with a debug register on the current vcpu. only debug
+// registers that the guest doesn't use are taken. returns false if every
+// debug register is in use.
+// this should only be called from root-mode.
+bool arm_watchpoint(vcpu* cpu, size_t mmr, uint64_t address, uint64_t size, uint8_t mode);
+
+// free the debug register that serves an MMR on the current vcpu, and give
+// it back to the guest.
+// this should only be called from root-mode.
+void disarm_watchpoint(vcpu* cpu, size_t mmr);
+
+// free every debug register that serves an MMR on the current vcpu.
+// this should only be called from root-mode.
+void disarm_all_watchpoints(vcpu* cpu);
+
+// get the value of a debug register as seen by the guest
+uint64_t read_guest_dr(vcpu* cpu, uint64_t idx);
+
+// set the value of a debug register as seen by the guest. the debug
+// registers that serve MMRs keep their hardware value.
+void write_guest_dr(vcpu* cpu, uint64_t idx, uint64_t value);
+
+} // namespace hv
+
@@ -0,0 +1,229 @@
+#include "work-queue.h"
+#include "page-tables.h"
+#include "vcpu.h"
+#include "hv.h"
+
+namespace hv {
+
+// ICR value for a fixed-destination NMI (delivery mode 100b, level assert)
+inline constexpr uint32_t apic_icr_nmi = (0b100 << 8) | (1 << 14);
+
+// overflow bits of the general-purpose and fixed-function counters in
+// IA32_PERF_GLOBAL_STATUS
+inline constexpr uint64_t perf_global_overflow_mask = 0x7'FFFFFFFFull;
+
+// send an NMI to the logical processor with the specified APIC ID
+static void send_nmi(uint32_t const apic_id) {
+  ia32_apic_base_register apic_base;
+  apic_base.flags = __readmsr(IA32_APIC_BASE);
+
+  // x2APIC: the destination lives in the upper 32 bits and a single
+  // WRMSR sends the IPI
+  if (apic_base.enable_x2apic_mode) {
+    __writemsr(IA32_X2APIC_ICR, (static_cast<uint64_t>(apic_id) << 32) | apic_icr_nmi);
+    return;
+  }
+
+  auto const apic     = host_physical_memory_base + (apic_base.apic_base << 12);
+  auto const icr_low  = reinterpret_cast<uint32_t volatile*>(apic + 0x300);
+  auto const icr_high = reinterpret_cast<uint32_t volatile*>(apic + 0x310);
+
+  // wait for the previous IPI to be accepted
+  while (*icr_low & (1 << 12))
+    _mm_pause();
+
+  // the guest might have been interrupted between writing the high and
+  // low halves of the ICR, so make sure to restore its destination
+  auto const guest_icr_high = *icr_high;
+
+  *icr_high = apic_id << 24;
+  *icr_low  = apic_icr_nmi;
+
+  while (*icr_low & (1 << 12))
+    _mm_pause();
+
+  *icr_high = guest_icr_high;
+}
+
+// initialize the work queue of the current vcpu
+void prepare_work_queue(vcpu_work_queue& queue) {
+  queue.lock.initialize();
+  queue.head           = 0;
+  queue.count          = 0;
+  queue.online         = false;
+  queue.kicks_sent     = 0;
+  queue.kicks_received = 0;
+
+  // IA32_PERF_GLOBAL_STATUS was added in architectural performance
+  // monitoring version 2
+  int regs[4];
+  __cpuid(regs, 0x00);
+
+  queue.pmi_status_supported = false;
+  if (regs[0] >= 0x0A) {
+    __cpuid(regs, 0x0A);
+    queue.pmi_status_supported = (regs[0] & 0xFF) >= 2;
+  }
+
+  ia32_apic_base_register apic_base;
+  apic_base.flags = __readmsr(IA32_APIC_BASE);
+
+  if (apic_base.enable_x2apic_mode)
+    queue.apic_id = static_cast<uint32_t>(__readmsr(IA32_X2APIC_APICID));
+  else {
+    cpuid_eax_01 cpuid_01;
+    __cpuid(reinterpret_cast<int*>(&cpuid_01), 0x01);
+    queue.apic_id = cpuid_01.cpuid_additional_information.initial_apic_id;
+  }
+}
+
+// stop accepting work on the current vcpu and run whatever is still pending
+void shutdown_work_queue(vcpu* const cpu) {
+  {
+    scoped_spin_lock lock(cpu->work_queue.lock);
+    cpu->work_queue.online = false;
+  }
+
+  // anyone waiting on us needs to be released
+  drain_work_queue(cpu);
+}
+
+// run every pending work item on the current vcpu
+void drain_work_queue(vcpu* const cpu) {
+  auto& queue = cpu->work_queue;
+
+  // this is called on every vm-exit so avoid the lock when possible
+  while (queue.count > 0) {
+    vcpu_work_item* item = nullptr;
+
+    {
+      scoped_spin_lock lock(queue.lock);
+
+      if (queue.count == 0)
+        break;
+
+      item = queue.items[queue.head];
+      queue.head = (queue.head + 1) % vcpu_work_queue_capacity;
+      --queue.count;
+    }
+
+    item->fn(cpu, item->ctx);
+
+    // the item lives on the initiator's stack and is gone after this
+    _InterlockedDecrement(&item->remaining);
+  }
+}
+
+// run fn on every virtualized vcpu (including the current one) and wait
+// until every vcpu has finished. returns the shootdown latency in TSC ticks.
+uint64_t run_on_all_vcpus(vcpu* const cpu, vcpu_work_fn const fn, void* const ctx) {
+  auto const start_tsc = __rdtsc();
+
+  vcpu_work_item item;
+  item.fn        = fn;
+  item.ctx       = ctx;
+  item.remaining = 0;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    auto const other = &ghv.vcpus[i];
+    if (other == cpu)
+      continue;
+
+    auto& queue = other->work_queue;
+
+    while (true) {
+      queue.lock.acquire();
+
+      // vcpus that aren't virtualized don't use EPT at all
+      if (!queue.online) {
+        queue.lock.release();
+        break;
+      }
+
+      if (queue.count < vcpu_work_queue_capacity) {
+        queue.items[(queue.head + queue.count) % vcpu_work_queue_capacity] = &item;
+        ++queue.count;
+        _InterlockedIncrement(&item.remaining);
+
+        // force a vm-exit unless a kick is already on its way. this is done
+        // while holding the lock so the vcpu can't devirtualize in between.
+        if (queue.kicks_sent == queue.kicks_received) {
+          _InterlockedIncrement(&queue.kicks_sent);
+          send_nmi(queue.apic_id);
+        }
+
+        queue.lock.release();
+        break;
+      }
+
+      queue.lock.release();
+
+      // the queue is full. the vcpu that owns it might be waiting for us
+      // to run one of its items, so we need to make progress on ours.
+      drain_work_queue(cpu);
+      _mm_pause();
+    }
+  }
+
+  fn(cpu, ctx);
+
+  while (item.remaining > 0) {
+    drain_work_queue(cpu);
+    _mm_pause();
+  }
+
+  return __rdtsc() - start_tsc;
+}
+
+// returns true if the current NMI was sent by run_on_all_vcpus() and
+// shouldn't be delivered to the guest
+bool consume_work_queue_kick(vcpu* const cpu) {
+  auto& queue = cpu->work_queue;
+
+  // every NMI that arrives while no kick is in flight belongs to the guest.
+  // kicks are never delivered, since no guest handler would claim them.
+  if (queue.kicks_received == queue.kicks_sent)
+    return false;
+
+  _InterlockedIncrement(&queue.kicks_received);
+
+  // a PMI that arrived together with the kick can be merged into a single
+  // NMI. the guest's PMI handler claims NMIs by their overflow status, so
+  // the NMI is still delivered if any counter overflowed.
+  if (queue.pmi_status_supported &&
+      (__readmsr(IA32_PERF_GLOBAL_STATUS) & perf_global_overflow_mask))
+    return false;
+
+  return true;
+}
+
+// acquire a lock that is held across run_on_all_vcpus(). the vcpu that holds
+// the lock might be waiting for this vcpu, so work items are run meanwhile.
+void acquire_spin_lock_draining(vcpu* const cpu, spin_lock& lock) {
+  while (!lock.try_acquire()) {
+    drain_work_queue(cpu);
+    _mm_pause();
+  }
+}
+
+// prepare a barrier for every vcpu that is currently virtualized. these
+// vcpus are expected to stay virtualized until they all passed the barrier.
+// this should be called while holding the vcpu barrier lock.
+void prepare_vcpu_barrier(vcpu_barrier& barrier) {
+  barrier.participants = 0;
+  barrier.arrived      = 0;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    barrier.participants += ghv.vcpus[i].work_queue.online;
+}
+
+// wait until every vcpu that takes part reached the barrier
+void wait_for_vcpu_barrier(vcpu_barrier& barrier) {
+  _InterlockedIncrement(&barrier.arrived);
+
+  while (barrier.arrived < barrier.participants)
+    _mm_pause();
+}
+
+} // namespace hv
+
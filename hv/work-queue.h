@@ -0,0 +1,87 @@
+#pragma once
+
+#include "spin-lock.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// maximum number of work items that can be pending on a single vcpu
+inline constexpr size_t vcpu_work_queue_capacity = 16;
+
+// function that is run in root-mode on a remote vcpu
+using vcpu_work_fn = void(*)(vcpu* cpu, void* ctx);
+
+struct vcpu_work_item {
+  vcpu_work_fn fn;
+  void* ctx;
+
+  // number of vcpus that still need to run this item
+  long volatile remaining;
+};
+
+struct vcpu_work_queue {
+  spin_lock lock;
+
+  // ring buffer of pending work items
+  vcpu_work_item* items[vcpu_work_queue_capacity];
+  size_t head;
+  size_t volatile count;
+
+  // APIC ID of the logical processor that owns this queue
+  uint32_t apic_id;
+
+  // whether the owning vcpu is virtualized and draining this queue
+  bool online;
+
+  // number of NMIs that were sent to force a vm-exit on the owning vcpu,
+  // and how many of them were received. only one kick is in flight at a
+  // time, so every NMI consumes at most one kick.
+  long volatile kicks_sent;
+  long volatile kicks_received;
+
+  // whether IA32_PERF_GLOBAL_STATUS is supported, so that a PMI can be
+  // told apart from a kick
+  bool pmi_status_supported;
+};
+
+// holds every vcpu that reaches it in root-mode until all of them did
+struct vcpu_barrier {
+  // number of vcpus that take part, and how many reached the barrier
+  long participants;
+  long volatile arrived;
+};
+
+// initialize the work queue of the current vcpu
+void prepare_work_queue(vcpu_work_queue& queue);
+
+// stop accepting work on the current vcpu and run whatever is still pending
+void shutdown_work_queue(vcpu* cpu);
+
+// run every pending work item on the current vcpu
+void drain_work_queue(vcpu* cpu);
+
+// run fn on every virtualized vcpu (including the current one) and wait
+// until every vcpu has finished. returns the shootdown latency in TSC ticks.
+uint64_t run_on_all_vcpus(vcpu* cpu, vcpu_work_fn fn, void* ctx);
+
+// returns true if the current NMI was sent by run_on_all_vcpus() and
+// shouldn't be delivered to the guest
+bool consume_work_queue_kick(vcpu* cpu);
+
+// acquire a lock that is held across run_on_all_vcpus(). the vcpu that holds
+// the lock might be waiting for this vcpu, so work items are run meanwhile.
+void acquire_spin_lock_draining(vcpu* cpu, spin_lock& lock);
+
+// prepare a barrier for every vcpu that is currently virtualized. these
+// vcpus are expected to stay virtualized until they all passed the barrier.
+// this should be called while holding the vcpu barrier lock.
+void prepare_vcpu_barrier(vcpu_barrier& barrier);
+
+// wait until every vcpu that takes part reached the barrier
+void wait_for_vcpu_barrier(vcpu_barrier& barrier);
+
+} // namespace hv
+
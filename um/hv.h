@@ -4,8 +4,15 @@
 #include <chrono>
 
 #include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <string>
+#include <algorithm>
 
 #include <cstdint>
+#include <cstdio>
 #include <Windows.h>
 
 namespace hv {
@@ -80,7 +87,43 @@ enum hypercall_code : uint64_t {
   hypercall_get_message,
   hypercall_get_message_type,
   hypercall_get_message_time,
-  hypercall_get_message_sender
+  hypercall_get_message_sender,
+  hypercall_install_ept_hook_global,
+  hypercall_remove_ept_hook_global,
+  hypercall_hide_physical_page_global,
+  hypercall_unhide_physical_page_global,
+  hypercall_install_mmr_global,
+  hypercall_remove_mmr_global,
+  hypercall_remove_all_mmrs_global,
+  hypercall_hide_physical_range,
+  hypercall_unhide_physical_range,
+  hypercall_start_dirty_log,
+  hypercall_stop_dirty_log,
+  hypercall_fetch_and_clear_dirty_bitmap,
+  hypercall_set_ept_exec_view,
+  hypercall_query_ept_hook_stats,
+  hypercall_query_ept_hooks,
+  hypercall_install_shadow_ept_hooks,
+  hypercall_remove_shadow_ept_hooks,
+  hypercall_set_ept_hook_scope,
+  hypercall_create_ept_hook_group,
+  hypercall_activate_ept_hook_group,
+  hypercall_deactivate_ept_hook_group,
+  hypercall_destroy_ept_hook_group,
+  hypercall_start_ept_access_sampling,
+  hypercall_stop_ept_access_sampling,
+  hypercall_sample_ept_access,
+  hypercall_query_ept_access_map,
+  hypercall_start_memory_snapshot,
+  hypercall_stop_memory_snapshot,
+  hypercall_read_memory_snapshot,
+  hypercall_query_memory_snapshot_stats,
+  hypercall_hash_physical_pages,
+  hypercall_read_mmr_profile,
+  hypercall_set_mmr_filter,
+  hypercall_install_mmr_watch,
+  hypercall_set_mmr_window,
+  hypercall_read_mmr_trace
 };
 
 // hypercall input
@@ -98,7 +141,185 @@ struct hypercall_input {
 enum mmr_memory_mode {
   mmr_memory_mode_r = 0b001,
   mmr_memory_mode_w = 0b010,
-  mmr_memory_mode_x = 0b100
+  mmr_memory_mode_x = 0b100,
+
+  // count accesses with read_mmr_profile() instead of logging every one of them
+  mmr_memory_mode_aggregate = 0b1000,
+
+  // record accesses for read_mmr_trace() instead of logging them as text
+  mmr_memory_mode_trace = 0b10000
+};
+
+// counters for comparing the cost of the two ways that an EPT hook can
+// switch between its original page and its executable page
+struct ept_hook_stats {
+  // EPTP switches between the main view and the execute view
+  uint64_t view_switch_count;
+  uint64_t view_switch_tsc;
+
+  // PTE modifications, which are used when the execute view is disabled
+  // or can't be built
+  uint64_t pte_flip_count;
+  uint64_t pte_flip_tsc;
+
+  // rebuilds of the execute view after the main view was modified
+  uint64_t view_build_count;
+  uint64_t view_build_tsc;
+};
+
+// per-hook counters that are returned by the query_ept_hooks hypercall.
+// the counts are combined across every logical processor.
+struct ept_hook_info {
+  uint64_t orig_pfn;
+  uint64_t exec_pfn;
+
+  // ept-violations that were caused by this hook
+  uint64_t exit_count;
+
+  // switches between the original and the executable page
+  uint64_t flip_count;
+
+  // number of logical processors that this hook is currently hot on
+  uint64_t hot_count;
+};
+
+// a page to hook with the install_shadow_ept_hooks hypercall. the hypervisor
+// clones the original page into its shadow page arena and fills in the GPA
+// of the clone, which is executed in place of the original page.
+struct shadow_ept_hook {
+  uint64_t orig_pfn;
+  uint64_t shadow_gpa;
+};
+
+// bytes that are written into a shadow page before its hook is installed.
+// the patch is addressed by the original physical address, and patches that
+// cross a page boundary are split between both pages.
+struct shadow_ept_patch {
+  uint64_t physical_address;
+  uint64_t size;
+
+  // guest virtual address of the patch bytes
+  uint64_t data;
+};
+
+// a page in an EPT hook group, as passed to the create_ept_hook_group hypercall
+struct ept_hook_group_page {
+  uint64_t orig_pfn;
+  uint64_t exec_pfn;
+};
+
+// a run of physical memory whose pages were all accessed in the same number
+// of samples, as returned by the query_ept_access_map hypercall. pages that
+// were never accessed aren't covered by any run.
+struct ept_access_run {
+  uint64_t physical_address;
+  uint64_t size;
+  uint64_t sample_count;
+};
+
+// state of the memory snapshot, as returned by the query_memory_snapshot_stats
+// hypercall. the snapshot can't be read anymore once it overflowed.
+struct memory_snapshot_stats {
+  uint64_t active;
+  uint64_t overflowed;
+
+  // write faults that were caused by the snapshot on every logical processor
+  uint64_t cow_fault_count;
+
+  // pages in the snapshot pool that hold a copy, and the size of the pool
+  uint64_t pool_used_count;
+  uint64_t pool_page_count;
+};
+
+// hash of a page of RAM, as returned by the hash_physical_pages hypercall.
+// pages that only contain zeroes always have a hash of 0.
+struct page_hash {
+  uint64_t physical_address;
+  uint64_t hash;
+};
+
+// aggregated access count of an MMR, as returned by the read_mmr_profile
+// hypercall. per-page totals have the physical address of the page and a
+// RIP and CR3 of 0, every other count has a page address of 0.
+struct mmr_access_count {
+  uint64_t rip;
+  uint64_t cr3;
+  uint64_t page_address;
+
+  // combination of mmr_memory_mode flags
+  uint64_t access;
+  uint64_t count;
+};
+
+// an access to an MMR that was installed with mmr_memory_mode_trace, as
+// returned by the read_mmr_trace hypercall. the layout is fixed so that
+// recording an access only takes a handful of stores.
+struct mmr_event {
+  uint64_t tsc;
+  uint64_t physical_address;
+  uint64_t cr3;
+  uint64_t pid;
+  uint64_t rip;
+
+  // index of the logical processor, and of the MMR entry
+  uint16_t vcpu;
+  uint16_t mmr;
+
+  // combination of mmr_memory_mode flags
+  uint8_t access;
+  uint8_t cpl;
+  uint8_t reserved[2];
+
+  // general-purpose registers in encoding order: RAX, RCX, RDX, RBX, RSP,
+  // RBP, RSI, RDI, and R8-R15
+  uint64_t gpr[16];
+};
+static_assert(sizeof(mmr_event) == 176, "MMR events have a fixed layout!");
+
+// maximum number of values in each allow-list of an MMR filter
+inline constexpr size_t mmr_filter_list_max = 4;
+
+// a range of guest RIPs [start, end)
+struct mmr_rip_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+// conditions that an access has to meet for an MMR to log or count it, as
+// passed to the set_mmr_filter hypercall. an empty allow-list, or a mask
+// of 0, doesn't filter anything.
+struct mmr_filter {
+  // address spaces, compared against the guest CR3 without its PCID
+  uint64_t cr3[mmr_filter_list_max];
+  uint64_t cr3_count;
+
+  // process IDs
+  uint64_t pid[mmr_filter_list_max];
+  uint64_t pid_count;
+
+  mmr_rip_range rip_ranges[mmr_filter_list_max];
+  uint64_t rip_range_count;
+
+  // bit n allows accesses that were made at CPL n
+  uint64_t cpl_mask;
+
+  // combination of mmr_memory_mode flags
+  uint64_t access_mask;
+};
+
+// how much of RAM could be deduplicated, as computed by scan_duplicate_pages().
+// pages are compared by their hash, so this is an (extremely close) estimate.
+struct page_dedup_stats {
+  // pages of RAM that were hashed
+  uint64_t page_count;
+
+  // pages that only contain zeroes
+  uint64_t zero_page_count;
+
+  // non-zero pages whose contents are identical to an earlier page, and
+  // the number of distinct contents that those pages share
+  uint64_t duplicate_page_count;
+  uint64_t shared_content_count;
 };
 
 // helper function to get time, used in wait_for_message
@@ -156,7 +377,7 @@ void unhide_physical_page(uint64_t pfn);
 void* get_hv_base();
 
 // write to the logger whenever a certain physical memory range is accessed
-void* install_mmr(uint64_t address, uint32_t size, uint8_t mode);
+void* install_mmr(uint64_t address, uint64_t size, uint8_t mode);
 
 // remove an existing MMR
 void remove_mmr(void* handle);
@@ -182,6 +403,186 @@ uint64_t get_message_time();
 // get message sender id
 uint64_t get_message_sender();
 
+// install an EPT hook on every logical processor
+bool install_ept_hook_global(uint64_t orig_page_pfn, uint64_t exec_page_pfn,
+                             uint64_t* latency_tsc = nullptr);
+
+// remove an EPT hook from every logical processor
+void remove_ept_hook_global(uint64_t orig_page_pfn, uint64_t* latency_tsc = nullptr);
+
+// hide a physical page from the guest on every logical processor
+bool hide_physical_page_global(uint64_t pfn, uint64_t* latency_tsc = nullptr);
+
+// unhide a physical page from the guest on every logical processor
+void unhide_physical_page_global(uint64_t pfn, uint64_t* latency_tsc = nullptr);
+
+// install an MMR on every logical processor
+void* install_mmr_global(uint64_t address, uint64_t size, uint8_t mode,
+                         uint64_t* latency_tsc = nullptr);
+
+// remove an MMR that was installed with install_mmr_global()
+void remove_mmr_global(void* handle, uint64_t* latency_tsc = nullptr);
+
+// remove every installed MMR on every logical processor
+void remove_all_mmrs_global(uint64_t* latency_tsc = nullptr);
+
+// hide a range of physical memory from the guest on every logical processor
+size_t hide_physical_range(uint64_t start, size_t size, uint64_t* latency_tsc = nullptr);
+
+// hide the physical memory behind a range of virtual memory on every logical processor
+size_t hide_physical_range(uint64_t cr3, void const* start, size_t size,
+                           uint64_t* latency_tsc = nullptr);
+
+// unhide a range of physical memory on every logical processor
+size_t unhide_physical_range(uint64_t start, size_t size, uint64_t* latency_tsc = nullptr);
+
+// unhide the physical memory behind a range of virtual memory on every logical processor
+size_t unhide_physical_range(uint64_t cr3, void const* start, size_t size,
+                             uint64_t* latency_tsc = nullptr);
+
+// start tracking which physical pages are written to on every logical processor
+bool start_dirty_log(uint64_t* latency_tsc = nullptr);
+
+// stop tracking written physical pages on every logical processor
+void stop_dirty_log(uint64_t* latency_tsc = nullptr);
+
+// write a bitmap (one bit per page) of the pages in a physical range that were
+// written to since the last call or since start_dirty_log() was called.
+// start should be page-aligned.
+bool fetch_and_clear_dirty_bitmap(uint64_t start, uint64_t size, void* bitmap,
+                                  uint64_t* latency_tsc = nullptr);
+
+// enable or disable the EPT execute view for hooks on every logical processor.
+// returns whether it was enabled before.
+bool set_ept_exec_view(bool enabled, uint64_t* latency_tsc = nullptr);
+
+// get the EPT hook statistics of every logical processor combined
+bool query_ept_hook_stats(ept_hook_stats& stats, bool reset = false);
+
+// get the per-hook counters of every EPT hook. returns the number of hooks
+// that were written to the buffer.
+size_t query_ept_hooks(ept_hook_info* hooks, size_t max_count);
+
+// clone pages into the hypervisor's shadow page arena, apply the patches to
+// the clones, and hook the original pages on every logical processor. the
+// shadow GPAs are written to the hook array. pages are processed in batches,
+// and batches that were installed before a failure stay installed.
+bool install_shadow_ept_hooks(shadow_ept_hook* hooks, size_t count,
+                              shadow_ept_patch const* patches = nullptr,
+                              size_t patch_count = 0, uint64_t* latency_tsc = nullptr);
+
+// remove EPT hooks on every logical processor and give their shadow pages
+// back to the arena
+void remove_shadow_ept_hooks(uint64_t const* pfns, size_t count,
+                             uint64_t* latency_tsc = nullptr);
+
+// limit an EPT hook to the address spaces of up to 4 CR3 values on every
+// logical processor, or make it global again if the count is 0. processes
+// that use KVA shadowing need both their kernel and their user CR3.
+bool set_ept_hook_scope(uint64_t orig_page_pfn, uint64_t const* cr3s, size_t count,
+                        uint64_t* latency_tsc = nullptr);
+
+// define a group of up to 64 EPT hooks without installing any of them.
+// returns a handle to the group, or 0 on failure.
+uint64_t create_ept_hook_group(ept_hook_group_page const* pages, size_t count);
+
+// install every hook in a group on every logical processor at once
+bool activate_ept_hook_group(uint64_t handle, uint64_t* latency_tsc = nullptr);
+
+// remove every hook in a group on every logical processor at once
+bool deactivate_ept_hook_group(uint64_t handle, uint64_t* latency_tsc = nullptr);
+
+// deactivate a group of EPT hooks (if needed) and free it
+bool destroy_ept_hook_group(uint64_t handle, uint64_t* latency_tsc = nullptr);
+
+// clear the access histogram and enable the EPT accessed flags on every
+// logical processor
+bool start_ept_access_sampling(uint64_t* latency_tsc = nullptr);
+
+// disable the EPT accessed flags on every logical processor
+void stop_ept_access_sampling(uint64_t* latency_tsc = nullptr);
+
+// harvest the EPT accessed flags into the access histogram. this should be
+// called periodically, and the interval between calls is the sample period.
+bool sample_ept_access(uint64_t* latency_tsc = nullptr);
+
+// export the access histogram as run-length encoded runs, starting at the
+// specified physical address. returns the number of runs that were written.
+// next is set to the address to continue from, or 0 if the end was reached.
+size_t query_ept_access_map(ept_access_run* runs, size_t max_count,
+                            uint64_t start = 0, uint64_t* next = nullptr);
+
+// write-protect RAM on every logical processor so that pages are copied
+// before they are first written to. fails if a snapshot is already held.
+bool start_memory_snapshot(uint64_t* latency_tsc = nullptr);
+
+// give write access back on every logical processor and drop the snapshot
+void stop_memory_snapshot(uint64_t* latency_tsc = nullptr);
+
+// read physical memory as it was when the snapshot was taken. returns 0 if
+// there is no snapshot or if it overflowed.
+size_t read_memory_snapshot(void* dst, uint64_t src, size_t size);
+
+// get the state of the memory snapshot and its pool usage
+bool query_memory_snapshot_stats(memory_snapshot_stats& stats);
+
+// hash RAM pages, starting at the specified physical address. returns the
+// number of hashes that were written. next is set to the address to
+// continue from, or 0 if every page was hashed.
+size_t hash_physical_pages(page_hash* hashes, size_t max_count,
+                           uint64_t start = 0, uint64_t* next = nullptr);
+
+// hash every page of RAM and count the zero pages and identical pages
+page_dedup_stats scan_duplicate_pages();
+
+// copy the aggregated access counts of an MMR that was installed with
+// mmr_memory_mode_aggregate, and clear them if requested. the counts are
+// kept per logical processor, so the same key can show up more than once.
+// returns the number of counts that were written.
+size_t read_mmr_profile(void* handle, mmr_access_count* counts, size_t max_count,
+                        bool reset = true, uint64_t* dropped = nullptr);
+
+// fetch and clear every aggregated access count of an MMR, combined across
+// every logical processor
+std::vector<mmr_access_count> fetch_mmr_profile(void* handle, uint64_t* dropped = nullptr);
+
+// attach a filter to an MMR on every logical processor, or remove its filter
+// if null is passed. accesses that don't pass the filter are neither logged
+// nor counted.
+bool set_mmr_filter(void* handle, mmr_filter const* filter, uint64_t* latency_tsc = nullptr);
+
+// install an MMR of up to 8 bytes on every logical processor, at a virtual
+// address in the current process. the MMR is served by a debug register
+// instead of the EPT, so accesses to the rest of the page don't cause any
+// vm-exits. the range has to fit into an aligned 8-byte block, and execute
+// MMRs have to be a single byte. reads can only be monitored together with
+// writes, so both are reported for every access. null is returned if a
+// logical processor has no debug register that the guest doesn't use, in
+// which case install_mmr() can be used instead. the returned handle works
+// with remove_mmr_global(), set_mmr_filter(), and read_mmr_profile().
+void* install_mmr_watch(void const* address, uint64_t size, uint8_t mode,
+                        uint64_t* latency_tsc = nullptr);
+
+// leave the pages of an MMR accessible for a number of TSC ticks after they
+// were accessed, on every logical processor. only the access that opens the
+// window is logged or counted, so a burst of accesses costs a single
+// vm-exit. a window of 0 re-protects the page after every instruction.
+bool set_mmr_window(void* handle, uint64_t window_tsc, uint64_t* latency_tsc = nullptr);
+
+// copy and consume the recorded accesses of every MMR that was installed
+// with mmr_memory_mode_trace. the events are in order on each logical
+// processor, but not across logical processors. the number of events that
+// were dropped because a trace was full is written to dropped as well.
+// returns the number of events that were written.
+size_t read_mmr_trace(mmr_event* events, size_t max_count, uint64_t* dropped = nullptr);
+
+// fetch and consume every recorded MMR access, sorted by TSC
+std::vector<mmr_event> fetch_mmr_trace(uint64_t* dropped = nullptr);
+
+// decode an MMR event into the same text that is logged for an MMR that
+// doesn't trace its accesses
+std::string format_mmr_event(mmr_event const& event);
+
 // wait until a new pessage is available in the message pipe then fetch it
 uint64_t wait_for_message(uint64_t timeout, uint64_t type = 0);
 
@@ -378,7 +779,7 @@ inline void* get_hv_base() {
 }
 
 // write to the logger whenever a certain physical memory range is accessed
-inline void* install_mmr(uint64_t const address, uint32_t const size,
+inline void* install_mmr(uint64_t const address, uint64_t const size,
                          uint8_t const mode) {
   hv::hypercall_input input;
   input.code    = hv::hypercall_install_mmr;
@@ -459,6 +860,702 @@ inline uint64_t get_message_sender() {
   return hv::vmx_vmcall(input);
 }
 
+// install an EPT hook on every logical processor
+inline bool install_ept_hook_global(uint64_t const orig_page_pfn,
+    uint64_t const exec_page_pfn, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_install_ept_hook_global;
+  input.key     = hv::hypercall_key;
+  input.args[0] = orig_page_pfn;
+  input.args[1] = exec_page_pfn;
+  input.args[2] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// remove an EPT hook from every logical processor
+inline void remove_ept_hook_global(uint64_t const orig_page_pfn,
+    uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_remove_ept_hook_global;
+  input.key     = hv::hypercall_key;
+  input.args[0] = orig_page_pfn;
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  hv::vmx_vmcall(input);
+}
+
+// hide a physical page from the guest on every logical processor
+inline bool hide_physical_page_global(uint64_t const pfn, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_hide_physical_page_global;
+  input.key     = hv::hypercall_key;
+  input.args[0] = pfn;
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// unhide a physical page from the guest on every logical processor
+inline void unhide_physical_page_global(uint64_t const pfn, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_unhide_physical_page_global;
+  input.key     = hv::hypercall_key;
+  input.args[0] = pfn;
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  hv::vmx_vmcall(input);
+}
+
+// install an MMR on every logical processor
+inline void* install_mmr_global(uint64_t const address, uint64_t const size,
+    uint8_t const mode, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_install_mmr_global;
+  input.key     = hv::hypercall_key;
+  input.args[0] = address;
+  input.args[1] = size;
+  input.args[2] = mode;
+  input.args[3] = reinterpret_cast<uint64_t>(latency_tsc);
+  return reinterpret_cast<void*>(hv::vmx_vmcall(input));
+}
+
+// remove an MMR that was installed with install_mmr_global()
+inline void remove_mmr_global(void* const handle, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_remove_mmr_global;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(handle);
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  hv::vmx_vmcall(input);
+}
+
+// remove every installed MMR on every logical processor
+inline void remove_all_mmrs_global(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_remove_all_mmrs_global;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  hv::vmx_vmcall(input);
+}
+
+// hide a range of physical memory from the guest on every logical processor
+inline size_t hide_physical_range(uint64_t const start, size_t const size,
+    uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_hide_physical_range;
+  input.key     = hv::hypercall_key;
+  input.args[0] = 0;
+  input.args[1] = start;
+  input.args[2] = size;
+  input.args[3] = 0;
+  input.args[4] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// hide the physical memory behind a range of virtual memory on every logical processor
+inline size_t hide_physical_range(uint64_t const cr3, void const* const start,
+    size_t const size, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_hide_physical_range;
+  input.key     = hv::hypercall_key;
+  input.args[0] = cr3;
+  input.args[1] = reinterpret_cast<uint64_t>(start);
+  input.args[2] = size;
+  input.args[3] = 1;
+  input.args[4] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// unhide a range of physical memory on every logical processor
+inline size_t unhide_physical_range(uint64_t const start, size_t const size,
+    uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_unhide_physical_range;
+  input.key     = hv::hypercall_key;
+  input.args[0] = 0;
+  input.args[1] = start;
+  input.args[2] = size;
+  input.args[3] = 0;
+  input.args[4] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// unhide the physical memory behind a range of virtual memory on every logical processor
+inline size_t unhide_physical_range(uint64_t const cr3, void const* const start,
+    size_t const size, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_unhide_physical_range;
+  input.key     = hv::hypercall_key;
+  input.args[0] = cr3;
+  input.args[1] = reinterpret_cast<uint64_t>(start);
+  input.args[2] = size;
+  input.args[3] = 1;
+  input.args[4] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// start tracking which physical pages are written to on every logical processor
+inline bool start_dirty_log(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_start_dirty_log;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// stop tracking written physical pages on every logical processor
+inline void stop_dirty_log(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_stop_dirty_log;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  hv::vmx_vmcall(input);
+}
+
+// write a bitmap (one bit per page) of the pages in a physical range that were
+// written to since the last call or since start_dirty_log() was called.
+// start should be page-aligned.
+inline bool fetch_and_clear_dirty_bitmap(uint64_t const start, uint64_t const size,
+    void* const bitmap, uint64_t* const latency_tsc) {
+  uint64_t total_latency = 0;
+
+  // the hypervisor only processes part of the range at a time
+  for (uint64_t processed = 0; processed < size;) {
+    uint64_t latency = 0;
+
+    hv::hypercall_input input;
+    input.code    = hv::hypercall_fetch_and_clear_dirty_bitmap;
+    input.key     = hv::hypercall_key;
+    input.args[0] = start + processed;
+    input.args[1] = size - processed;
+    input.args[2] = reinterpret_cast<uint64_t>(bitmap) + processed / 0x8000;
+    input.args[3] = reinterpret_cast<uint64_t>(&latency);
+
+    auto const curr_size = hv::vmx_vmcall(input);
+    if (!curr_size)
+      return false;
+
+    processed     += curr_size;
+    total_latency += latency;
+  }
+
+  if (latency_tsc)
+    *latency_tsc = total_latency;
+
+  return true;
+}
+
+// enable or disable the EPT execute view for hooks on every logical processor.
+// returns whether it was enabled before.
+inline bool set_ept_exec_view(bool const enabled, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_set_ept_exec_view;
+  input.key     = hv::hypercall_key;
+  input.args[0] = enabled;
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input) != 0;
+}
+
+// get the EPT hook statistics of every logical processor combined
+inline bool query_ept_hook_stats(ept_hook_stats& stats, bool const reset) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_ept_hook_stats;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(&stats);
+  input.args[1] = reset;
+  return hv::vmx_vmcall(input);
+}
+
+// get the per-hook counters of every EPT hook. returns the number of hooks
+// that were written to the buffer.
+inline size_t query_ept_hooks(ept_hook_info* const hooks, size_t const max_count) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_ept_hooks;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(hooks);
+  input.args[1] = max_count;
+  return hv::vmx_vmcall(input);
+}
+
+// clone pages into the hypervisor's shadow page arena, apply the patches to
+// the clones, and hook the original pages on every logical processor. the
+// shadow GPAs are written to the hook array. pages are processed in batches,
+// and batches that were installed before a failure stay installed.
+inline bool install_shadow_ept_hooks(shadow_ept_hook* const hooks, size_t const count,
+    shadow_ept_patch const* const patches, size_t const patch_count,
+    uint64_t* const latency_tsc) {
+  uint64_t total_latency = 0;
+
+  for (size_t processed = 0; processed < count;) {
+    uint64_t latency = 0;
+
+    // every batch gets the whole patch list
+    hv::hypercall_input input;
+    input.code    = hv::hypercall_install_shadow_ept_hooks;
+    input.key     = hv::hypercall_key;
+    input.args[0] = reinterpret_cast<uint64_t>(hooks + processed);
+    input.args[1] = count - processed;
+    input.args[2] = reinterpret_cast<uint64_t>(patches);
+    input.args[3] = patch_count;
+    input.args[4] = reinterpret_cast<uint64_t>(&latency);
+
+    auto const curr_count = hv::vmx_vmcall(input);
+    if (!curr_count)
+      return false;
+
+    processed     += curr_count;
+    total_latency += latency;
+  }
+
+  if (latency_tsc)
+    *latency_tsc = total_latency;
+
+  return true;
+}
+
+// remove EPT hooks on every logical processor and give their shadow pages
+// back to the arena
+inline void remove_shadow_ept_hooks(uint64_t const* const pfns, size_t const count,
+    uint64_t* const latency_tsc) {
+  uint64_t total_latency = 0;
+
+  for (size_t processed = 0; processed < count;) {
+    uint64_t latency = 0;
+
+    hv::hypercall_input input;
+    input.code    = hv::hypercall_remove_shadow_ept_hooks;
+    input.key     = hv::hypercall_key;
+    input.args[0] = reinterpret_cast<uint64_t>(pfns + processed);
+    input.args[1] = count - processed;
+    input.args[2] = reinterpret_cast<uint64_t>(&latency);
+
+    auto const curr_count = hv::vmx_vmcall(input);
+    if (!curr_count)
+      break;
+
+    processed     += curr_count;
+    total_latency += latency;
+  }
+
+  if (latency_tsc)
+    *latency_tsc = total_latency;
+}
+
+// limit an EPT hook to the address spaces of up to 4 CR3 values on every
+// logical processor, or make it global again if the count is 0. processes
+// that use KVA shadowing need both their kernel and their user CR3.
+inline bool set_ept_hook_scope(uint64_t const orig_page_pfn, uint64_t const* const cr3s,
+    size_t const count, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_set_ept_hook_scope;
+  input.key     = hv::hypercall_key;
+  input.args[0] = orig_page_pfn;
+  input.args[1] = reinterpret_cast<uint64_t>(cr3s);
+  input.args[2] = count;
+  input.args[3] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// define a group of up to 64 EPT hooks without installing any of them.
+// returns a handle to the group, or 0 on failure.
+inline uint64_t create_ept_hook_group(ept_hook_group_page const* const pages, size_t const count) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_create_ept_hook_group;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(pages);
+  input.args[1] = count;
+  return hv::vmx_vmcall(input);
+}
+
+// install every hook in a group on every logical processor at once
+inline bool activate_ept_hook_group(uint64_t const handle, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_activate_ept_hook_group;
+  input.key     = hv::hypercall_key;
+  input.args[0] = handle;
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// remove every hook in a group on every logical processor at once
+inline bool deactivate_ept_hook_group(uint64_t const handle, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_deactivate_ept_hook_group;
+  input.key     = hv::hypercall_key;
+  input.args[0] = handle;
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// deactivate a group of EPT hooks (if needed) and free it
+inline bool destroy_ept_hook_group(uint64_t const handle, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_destroy_ept_hook_group;
+  input.key     = hv::hypercall_key;
+  input.args[0] = handle;
+  input.args[1] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// clear the access histogram and enable the EPT accessed flags on every
+// logical processor
+inline bool start_ept_access_sampling(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_start_ept_access_sampling;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// disable the EPT accessed flags on every logical processor
+inline void stop_ept_access_sampling(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_stop_ept_access_sampling;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  hv::vmx_vmcall(input);
+}
+
+// harvest the EPT accessed flags into the access histogram. this should be
+// called periodically, and the interval between calls is the sample period.
+inline bool sample_ept_access(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_sample_ept_access;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// export the access histogram as run-length encoded runs, starting at the
+// specified physical address. returns the number of runs that were written.
+// next is set to the address to continue from, or 0 if the end was reached.
+inline size_t query_ept_access_map(ept_access_run* const runs, size_t const max_count,
+    uint64_t const start, uint64_t* const next) {
+  size_t count = 0;
+  uint64_t addr = start;
+
+  // the hypervisor only exports a limited number of runs at a time
+  while (count < max_count) {
+    hv::hypercall_input input;
+    input.code    = hv::hypercall_query_ept_access_map;
+    input.key     = hv::hypercall_key;
+    input.args[0] = addr;
+    input.args[1] = reinterpret_cast<uint64_t>(runs + count);
+    input.args[2] = max_count - count;
+    input.args[3] = reinterpret_cast<uint64_t>(&addr);
+
+    auto const curr_count = hv::vmx_vmcall(input);
+    count += curr_count;
+
+    // either the end was reached or the buffer isn't writable
+    if (curr_count == 0 || addr == 0)
+      break;
+  }
+
+  if (next)
+    *next = addr;
+
+  return count;
+}
+
+// write-protect RAM on every logical processor so that pages are copied
+// before they are first written to. fails if a snapshot is already held.
+inline bool start_memory_snapshot(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_start_memory_snapshot;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input);
+}
+
+// give write access back on every logical processor and drop the snapshot
+inline void stop_memory_snapshot(uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_stop_memory_snapshot;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(latency_tsc);
+  hv::vmx_vmcall(input);
+}
+
+// read physical memory as it was when the snapshot was taken. returns 0 if
+// there is no snapshot or if it overflowed.
+inline size_t read_memory_snapshot(void* const dst, uint64_t const src,
+                                   size_t const size) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_read_memory_snapshot;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(dst);
+  input.args[1] = src;
+  input.args[2] = size;
+  return hv::vmx_vmcall(input);
+}
+
+// get the state of the memory snapshot and its pool usage
+inline bool query_memory_snapshot_stats(memory_snapshot_stats& stats) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_memory_snapshot_stats;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(&stats);
+  return hv::vmx_vmcall(input);
+}
+
+// hash RAM pages, starting at the specified physical address. returns the
+// number of hashes that were written. next is set to the address to
+// continue from, or 0 if every page was hashed.
+inline size_t hash_physical_pages(page_hash* const hashes, size_t const max_count,
+    uint64_t const start, uint64_t* const next) {
+  size_t count = 0;
+  uint64_t addr = start;
+
+  // the hypervisor only hashes a limited number of pages at a time
+  while (count < max_count) {
+    hv::hypercall_input input;
+    input.code    = hv::hypercall_hash_physical_pages;
+    input.key     = hv::hypercall_key;
+    input.args[0] = addr;
+    input.args[1] = reinterpret_cast<uint64_t>(hashes + count);
+    input.args[2] = max_count - count;
+    input.args[3] = reinterpret_cast<uint64_t>(&addr);
+
+    auto const curr_count = hv::vmx_vmcall(input);
+    count += curr_count;
+
+    // either the end was reached or the buffer isn't writable
+    if (curr_count == 0 || addr == 0)
+      break;
+  }
+
+  if (next)
+    *next = addr;
+
+  return count;
+}
+
+// hash every page of RAM and count the zero pages and identical pages
+inline page_dedup_stats scan_duplicate_pages() {
+  page_dedup_stats stats = {};
+
+  // number of pages that have each (non-zero) hash
+  std::unordered_map<uint64_t, uint64_t> counts;
+  std::vector<page_hash> hashes(0x1000);
+
+  uint64_t addr = 0;
+
+  do {
+    auto const count = hv::hash_physical_pages(hashes.data(), hashes.size(), addr, &addr);
+    if (count == 0)
+      break;
+
+    for (size_t i = 0; i < count; ++i) {
+      ++stats.page_count;
+
+      if (hashes[i].hash == 0)
+        ++stats.zero_page_count;
+      else if (++counts[hashes[i].hash] == 2)
+        ++stats.shared_content_count;
+    }
+  } while (addr != 0);
+
+  for (auto const& [hash, count] : counts)
+    stats.duplicate_page_count += count - 1;
+
+  return stats;
+}
+
+// copy the aggregated access counts of an MMR that was installed with
+// mmr_memory_mode_aggregate, and clear them if requested. the counts are
+// kept per logical processor, so the same key can show up more than once.
+// returns the number of counts that were written.
+inline size_t read_mmr_profile(void* const handle, mmr_access_count* const counts,
+    size_t const max_count, bool const reset, uint64_t* const dropped) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_read_mmr_profile;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(handle);
+  input.args[1] = reinterpret_cast<uint64_t>(counts);
+  input.args[2] = max_count;
+  input.args[3] = reset;
+  input.args[4] = reinterpret_cast<uint64_t>(dropped);
+  return hv::vmx_vmcall(input);
+}
+
+// fetch and clear every aggregated access count of an MMR, combined across
+// every logical processor
+inline std::vector<mmr_access_count> fetch_mmr_profile(void* const handle,
+    uint64_t* const dropped) {
+  std::vector<mmr_access_count> profile;
+  std::vector<mmr_access_count> counts(0x1000);
+
+  // index of every (RIP, CR3, page, access) in the combined profile
+  std::map<std::tuple<uint64_t, uint64_t, uint64_t, uint64_t>, size_t> indices;
+
+  uint64_t total_dropped = 0;
+
+  while (true) {
+    uint64_t curr_dropped = 0;
+    auto const count = hv::read_mmr_profile(handle,
+      counts.data(), counts.size(), true, &curr_dropped);
+
+    total_dropped += curr_dropped;
+
+    for (size_t i = 0; i < count; ++i) {
+      auto const& c = counts[i];
+
+      auto const [it, inserted] = indices.try_emplace(
+        std::make_tuple(c.rip, c.cr3, c.page_address, c.access), profile.size());
+      if (inserted)
+        profile.push_back(c);
+      else
+        profile[it->second].count += c.count;
+    }
+
+    // the counts that were read have been cleared, so a partial read means
+    // that there is nothing left
+    if (count < counts.size())
+      break;
+  }
+
+  if (dropped)
+    *dropped = total_dropped;
+
+  return profile;
+}
+
+// attach a filter to an MMR on every logical processor, or remove its filter
+// if null is passed. accesses that don't pass the filter are neither logged
+// nor counted.
+inline bool set_mmr_filter(void* const handle, mmr_filter const* const filter,
+    uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_set_mmr_filter;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(handle);
+  input.args[1] = reinterpret_cast<uint64_t>(filter);
+  input.args[2] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input) != 0;
+}
+
+// install an MMR of up to 8 bytes on every logical processor, at a virtual
+// address in the current process. the MMR is served by a debug register
+// instead of the EPT, so accesses to the rest of the page don't cause any
+// vm-exits. the range has to fit into an aligned 8-byte block, and execute
+// MMRs have to be a single byte. reads can only be monitored together with
+// writes, so both are reported for every access. null is returned if a
+// logical processor has no debug register that the guest doesn't use, in
+// which case install_mmr() can be used instead. the returned handle works
+// with remove_mmr_global(), set_mmr_filter(), and read_mmr_profile().
+inline void* install_mmr_watch(void const* const address, uint64_t const size,
+    uint8_t const mode, uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_install_mmr_watch;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(address);
+  input.args[1] = size;
+  input.args[2] = mode;
+  input.args[3] = reinterpret_cast<uint64_t>(latency_tsc);
+  return reinterpret_cast<void*>(hv::vmx_vmcall(input));
+}
+
+// leave the pages of an MMR accessible for a number of TSC ticks after they
+// were accessed, on every logical processor. only the access that opens the
+// window is logged or counted, so a burst of accesses costs a single
+// vm-exit. a window of 0 re-protects the page after every instruction.
+inline bool set_mmr_window(void* const handle, uint64_t const window_tsc,
+    uint64_t* const latency_tsc) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_set_mmr_window;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(handle);
+  input.args[1] = window_tsc;
+  input.args[2] = reinterpret_cast<uint64_t>(latency_tsc);
+  return hv::vmx_vmcall(input) != 0;
+}
+
+// copy and consume the recorded accesses of every MMR that was installed
+// with mmr_memory_mode_trace. the events are in order on each logical
+// processor, but not across logical processors. the number of events that
+// were dropped because a trace was full is written to dropped as well.
+// returns the number of events that were written.
+inline size_t read_mmr_trace(mmr_event* const events,
+    size_t const max_count, uint64_t* const dropped) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_read_mmr_trace;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(events);
+  input.args[1] = max_count;
+  input.args[2] = reinterpret_cast<uint64_t>(dropped);
+  return hv::vmx_vmcall(input);
+}
+
+// fetch and consume every recorded MMR access, sorted by TSC
+inline std::vector<mmr_event> fetch_mmr_trace(uint64_t* const dropped) {
+  std::vector<mmr_event> trace;
+  std::vector<mmr_event> events(0x400);
+
+  uint64_t total_dropped = 0;
+
+  while (true) {
+    uint64_t curr_dropped = 0;
+    auto const count = hv::read_mmr_trace(events.data(), events.size(), &curr_dropped);
+
+    total_dropped += curr_dropped;
+    trace.insert(trace.end(), events.begin(), events.begin() + count);
+
+    // the events that were read have been consumed, so a partial read
+    // means that there is nothing left
+    if (count < events.size())
+      break;
+  }
+
+  // every logical processor has its own trace
+  std::stable_sort(trace.begin(), trace.end(),
+    [](mmr_event const& a, mmr_event const& b) { return a.tsc < b.tsc; });
+
+  if (dropped)
+    *dropped = total_dropped;
+
+  return trace;
+}
+
+// decode an MMR event into the same text that is logged for an MMR that
+// doesn't trace its accesses
+inline std::string format_mmr_event(mmr_event const& event) {
+  static char const* const gpr_names[16] = {
+    "RAX:", "RCX:", "RDX:", "RBX:", "RSP:", "RBP:", "RSI:", "RDI:",
+    "R8:",  "R9:",  "R10:", "R11:", "R12:", "R13:", "R14:", "R15:"
+  };
+
+  char mode[4] = "---";
+  if (event.access & mmr_memory_mode_r)
+    mode[0] = 'r';
+  if (event.access & mmr_memory_mode_w)
+    mode[1] = 'w';
+  if (event.access & mmr_memory_mode_x)
+    mode[2] = 'x';
+
+  char line[128];
+  std::string text;
+
+  sprintf_s(line, "[cpu %u, TSC %llu] accessed memory at physical address <%p>:\n",
+    event.vcpu, event.tsc, reinterpret_cast<void*>(event.physical_address));
+  text += line;
+
+  sprintf_s(line, "    MODE: %s\n", mode);
+  text += line;
+  sprintf_s(line, "    PID:  %p\n", reinterpret_cast<void*>(event.pid));
+  text += line;
+  sprintf_s(line, "    CR3:  %p\n", reinterpret_cast<void*>(event.cr3));
+  text += line;
+  sprintf_s(line, "    CPL:  %i\n", event.cpl);
+  text += line;
+  sprintf_s(line, "    RIP:  %p\n", reinterpret_cast<void*>(event.rip));
+  text += line;
+
+  for (size_t i = 0; i < 16; ++i) {
+    sprintf_s(line, "    %-5s %p\n", gpr_names[i], reinterpret_cast<void*>(event.gpr[i]));
+    text += line;
+  }
+
+  return text;
+}
+
 // wait until a new pessage is available in the message pipe then fetch it
 inline uint64_t wait_for_message(uint64_t timeout, uint64_t type) {
   uint64_t timeout_start       = hv::get_current_time();
@@ -1,39 +1,117 @@
 #include <iostream>
+#include <cstring>
 
 #include "hv.h"
 #include "dumper.h"
 
 void hide_hypervisor() {
   auto const hv_base = static_cast<uint8_t*>(hv::get_hv_base());
-  auto const hv_size = 0x64000;
+  size_t const hv_size = 0x64000;
 
-  // hide the hypervisor
-  hv::for_each_cpu([&](uint32_t) {
-    for (size_t i = 0; i < hv_size; i += 0x1000) {
-      auto const virt = hv_base + i;
-      auto const phys = hv::get_physical_address(0, virt);
+  // hide the hypervisor on every cpu at once
+  uint64_t latency = 0;
+  auto const hidden = hv::hide_physical_range(0, hv_base, hv_size, &latency);
 
-      if (!phys) {
-        printf("failed to get physical address for 0x%p.\n", virt);
-        continue;
+  if (hidden != hv_size / 0x1000)
+    printf("only hid %zu out of %zu pages.\n", hidden, hv_size / 0x1000);
+
+  printf("Hid the hypervisor (shootdown took %zu TSC ticks).\n", latency);
+}
+
+// print the counters of every installed EPT hook
+void print_ept_hooks() {
+  hv::ept_hook_info hooks[64];
+  auto const count = hv::query_ept_hooks(hooks, 64);
+
+  for (size_t i = 0; i < count; ++i) {
+    printf("EPT hook %zX -> %zX: %zu exits, %zu flips, hot on %zu cpus.\n",
+      hooks[i].orig_pfn, hooks[i].exec_pfn, hooks[i].exit_count,
+      hooks[i].flip_count, hooks[i].hot_count);
+  }
+}
+
+// compare the cost of switching EPT views with the cost of modifying the
+// PTE by repeatedly executing and then reading a hooked page
+void benchmark_ept_hook_views() {
+  auto const orig = static_cast<uint8_t*>(VirtualAlloc(nullptr, 0x1000,
+    MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+  auto const exec = static_cast<uint8_t*>(VirtualAlloc(nullptr, 0x1000,
+    MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+
+  if (!orig || !exec) {
+    printf("Failed to allocate the benchmark pages.\n");
+    return;
+  }
+
+  // both pages just return (RET)
+  orig[0] = 0xC3;
+  exec[0] = 0xC3;
+
+  // the physical pages can't change while they're hooked
+  VirtualLock(orig, 0x1000);
+  VirtualLock(exec, 0x1000);
+
+  auto const cr3      = hv::query_process_cr3(GetCurrentProcessId());
+  auto const orig_pfn = hv::get_physical_address(cr3, orig) >> 12;
+  auto const exec_pfn = hv::get_physical_address(cr3, exec) >> 12;
+
+  if (!orig_pfn || !exec_pfn || !hv::install_ept_hook_global(orig_pfn, exec_pfn)) {
+    printf("Failed to hook the benchmark page.\n");
+  }
+  else {
+    // the execute view is toggled for every logical processor, so it has to
+    // be restored afterwards
+    auto const exec_view_enabled = hv::set_ept_exec_view(false);
+
+    for (bool const views : { false, true }) {
+      hv::set_ept_exec_view(views);
+
+      hv::ept_hook_stats stats = {};
+      hv::query_ept_hook_stats(stats, true);
+
+      for (int i = 0; i < 10000; ++i) {
+        reinterpret_cast<void(*)()>(orig)();
+        (void)*reinterpret_cast<uint8_t volatile*>(orig);
       }
 
-      if (!hv::hide_physical_page(phys >> 12))
-        printf("failed to hide page: 0x%p.\n", virt);
+      hv::query_ept_hook_stats(stats);
+
+      auto const count = views ? stats.view_switch_count : stats.pte_flip_count;
+      auto const tsc   = views ? stats.view_switch_tsc   : stats.pte_flip_tsc;
+
+      printf("%s: %zu switches, %zu TSC ticks on average (%zu view builds).\n",
+        views ? "EPT views" : "PTE flips", count, count ? tsc / count : 0,
+        stats.view_build_count);
     }
-  });
+
+    hv::set_ept_exec_view(exec_view_enabled);
+
+    print_ept_hooks();
+
+    hv::remove_ept_hook_global(orig_pfn);
+  }
+
+  VirtualUnlock(orig, 0x1000);
+  VirtualUnlock(exec, 0x1000);
+  VirtualFree(orig, 0, MEM_RELEASE);
+  VirtualFree(exec, 0, MEM_RELEASE);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
   if (!hv::is_hv_running()) {
     printf("HV not running.\n");
     return 0;
   }
 
   hide_hypervisor();
+
+  // the benchmark causes thousands of vm-exits, so it only runs on request
+  if (argc > 1 && strcmp(argv[1], "--benchmark-hooks") == 0)
+    benchmark_ept_hook_views();
+
   printf("Pinged the hypervisor! Flushing logs...\n");
 
-  hv::for_each_cpu([](uint32_t) {
-    hv::remove_all_mmrs();
-  });
+  uint64_t latency = 0;
+  hv::remove_all_mmrs_global(&latency);
+  printf("Removed every MMR (shootdown took %zu TSC ticks).\n", latency);
 }
\ No newline at end of file